@@ -0,0 +1,90 @@
+#ifndef ADMISSION_HPP
+#define ADMISSION_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include "scheduler.hpp"
+
+// Per connection rate limit. Only touched by the connection's own thread or task.
+class TokenBucket {
+private:
+    double rate;  // tokens per second, 0 means unlimited
+    double burst; // bucket size
+    double tokens;
+    std::chrono::steady_clock::time_point last;
+public:
+    TokenBucket(double rate, double burst) : rate(rate), burst(burst), tokens(burst), last(std::chrono::steady_clock::now()) {}
+
+    bool try_take() {
+        if (this->rate <= 0) {
+            return true;
+        }
+        auto now = std::chrono::steady_clock::now();
+        this->tokens = std::min(this->burst, this->tokens + std::chrono::duration<double>(now - this->last).count() * this->rate);
+        this->last = now;
+        if (this->tokens < 1) {
+            return false;
+        }
+        this->tokens -= 1;
+        return true;
+    }
+
+    // Waits until a token is available. The connection stops reading meanwhile,
+    // so a flooding client is held back by its own full socket buffer. A task on
+    // a worker suspends until then and the worker runs other connections, a
+    // connection's own thread sleeps.
+    Task<void> take() {
+        while (!this->try_take()) {
+            auto wait = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>((1 - this->tokens) / this->rate));
+            co_await Scheduler::sleep_until(this->last + wait);
+        }
+    }
+};
+
+// Counters for admission control, readable while the engine runs
+struct AdmissionStats {
+    std::atomic<uint64_t> admitted{0};
+    std::atomic<uint64_t> throttled{0}; // rejected by a connection's rate limit
+    std::atomic<uint64_t> shed{0};      // rejected because an instrument's queue was full
+    std::atomic<uint32_t> max_queue_depth{0};
+
+    void observe_depth(uint32_t depth) {
+        uint32_t seen = this->max_queue_depth.load(std::memory_order_relaxed);
+        while (depth > seen && !this->max_queue_depth.compare_exchange_weak(seen, depth, std::memory_order_relaxed)) {
+        }
+    }
+};
+
+// Holds a place in an instrument's bounded work queue for as long as it lives.
+// The queue is the set of orders that are being matched or waiting for the
+// book's locks, capacity 0 means unbounded.
+class AdmissionTicket {
+private:
+    std::atomic<uint32_t>& depth;
+    bool admitted;
+public:
+    AdmissionTicket(std::atomic<uint32_t>& depth, uint32_t capacity, AdmissionStats& stats) : depth(depth) {
+        uint32_t position = this->depth.fetch_add(1, std::memory_order_relaxed) + 1;
+        this->admitted = capacity == 0 || position <= capacity;
+        if (this->admitted) {
+            stats.admitted.fetch_add(1, std::memory_order_relaxed);
+            stats.observe_depth(position);
+        } else {
+            this->depth.fetch_sub(1, std::memory_order_relaxed);
+            stats.shed.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    ~AdmissionTicket() {
+        if (this->admitted) {
+            this->depth.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+    AdmissionTicket(const AdmissionTicket&) = delete;
+    AdmissionTicket& operator=(const AdmissionTicket&) = delete;
+
+    explicit operator bool() const { return this->admitted; }
+};
+
+#endif
@@ -0,0 +1,198 @@
+#include <algorithm>
+#include <cstdint>
+#include <immintrin.h>
+#include "auction.h"
+
+namespace {
+
+// Best price so far: most volume, then least surplus, then the lowest price
+struct Candidate {
+    uint64_t volume = 0;
+    uint64_t imbalance = UINT64_MAX;
+    size_t index = SIZE_MAX;
+
+    bool beaten_by(uint64_t other_volume, uint64_t other_imbalance, size_t other_index) const {
+        return other_volume > this->volume || (other_volume == this->volume && (other_imbalance < this->imbalance
+            || (other_imbalance == this->imbalance && other_index < this->index)));
+    }
+};
+
+uint64_t total(const uint64_t* quantities, size_t n) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        sum += quantities[i];
+    }
+    return sum;
+}
+
+// Buys execute at any price up to their limit, sells at any price from theirs,
+// so at prices[i] the bids are those from i up and the offers those up to i
+void search_scalar(const uint64_t* buy, const uint64_t* sell, size_t from, size_t n, uint64_t buy_above, uint64_t sell_below, Candidate& best) {
+    for (size_t i = from; i < n; i++) {
+        sell_below += sell[i];
+        uint64_t bid = buy_above;
+        buy_above -= buy[i];
+        uint64_t volume = std::min(bid, sell_below);
+        uint64_t imbalance = std::max(bid, sell_below) - volume;
+        if (best.beaten_by(volume, imbalance, i)) {
+            best = {volume, imbalance, i};
+        }
+    }
+}
+
+// Inclusive prefix sum of four lanes: add the vector shifted up one lane, then two
+__attribute__((target("avx2")))
+inline __m256i prefix_sum(__m256i x) {
+    __m256i zero = _mm256_setzero_si256();
+    x = _mm256_add_epi64(x, _mm256_blend_epi32(_mm256_permute4x64_epi64(x, _MM_SHUFFLE(2, 1, 0, 0)), zero, 0x03));
+    x = _mm256_add_epi64(x, _mm256_permute2x128_si256(x, x, 0x08));
+    return x;
+}
+
+// Four prices at a time, each lane keeping its own best, then the lanes and the
+// remainder go through the scalar comparison. Quantities fit in 63 bits, so the
+// signed 64-bit compares order them correctly.
+__attribute__((target("avx2")))
+void search_avx2(const uint64_t* buy, const uint64_t* sell, size_t n, Candidate& best) {
+    __m256i buy_carry = _mm256_setzero_si256();
+    __m256i sell_carry = _mm256_setzero_si256();
+    __m256i buy_total = _mm256_set1_epi64x(static_cast<long long>(total(buy, n)));
+    __m256i best_volume = _mm256_setzero_si256();
+    __m256i best_imbalance = _mm256_set1_epi64x(INT64_MAX);
+    __m256i best_index = _mm256_set1_epi64x(INT64_MAX);
+    __m256i index = _mm256_setr_epi64x(0, 1, 2, 3);
+    __m256i four = _mm256_set1_epi64x(4);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(buy + i));
+        __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(sell + i));
+        __m256i buy_below = _mm256_add_epi64(prefix_sum(b), buy_carry);
+        __m256i sell_below = _mm256_add_epi64(prefix_sum(s), sell_carry);
+        buy_carry = _mm256_permute4x64_epi64(buy_below, _MM_SHUFFLE(3, 3, 3, 3));
+        sell_carry = _mm256_permute4x64_epi64(sell_below, _MM_SHUFFLE(3, 3, 3, 3));
+
+        // Bids at or above each price are everything not strictly below it
+        __m256i bid = _mm256_add_epi64(_mm256_sub_epi64(buy_total, buy_below), b);
+        __m256i bid_heavier = _mm256_cmpgt_epi64(bid, sell_below);
+        __m256i volume = _mm256_blendv_epi8(bid, sell_below, bid_heavier);
+        __m256i imbalance = _mm256_sub_epi64(_mm256_add_epi64(bid, sell_below), _mm256_add_epi64(volume, volume));
+
+        // Later prices in a lane only win outright, which keeps the lowest of equals
+        __m256i better = _mm256_or_si256(_mm256_cmpgt_epi64(volume, best_volume),
+            _mm256_and_si256(_mm256_cmpeq_epi64(volume, best_volume), _mm256_cmpgt_epi64(best_imbalance, imbalance)));
+        best_volume = _mm256_blendv_epi8(best_volume, volume, better);
+        best_imbalance = _mm256_blendv_epi8(best_imbalance, imbalance, better);
+        best_index = _mm256_blendv_epi8(best_index, index, better);
+        index = _mm256_add_epi64(index, four);
+    }
+    alignas(32) uint64_t volumes[4], imbalances[4], indices[4];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(volumes), best_volume);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(imbalances), best_imbalance);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(indices), best_index);
+    for (int lane = 0; lane < 4 && i > 0; lane++) {
+        if (best.beaten_by(volumes[lane], imbalances[lane], indices[lane])) {
+            best = {volumes[lane], imbalances[lane], indices[lane]};
+        }
+    }
+    uint64_t sell_below = static_cast<uint64_t>(_mm256_extract_epi64(sell_carry, 0));
+    search_scalar(buy, sell, i, n, total(buy + i, n - i), sell_below, best);
+}
+
+const bool has_avx2 = __builtin_cpu_supports("avx2");
+
+} // namespace
+
+bool clearing_price_vectorised() {
+    return has_avx2;
+}
+
+ClearingPrice find_clearing_price(const uint32_t* prices, const uint64_t* buy, const uint64_t* sell, size_t n, bool vectorised) {
+    Candidate best;
+    if (vectorised && has_avx2) {
+        search_avx2(buy, sell, n, best);
+    } else {
+        search_scalar(buy, sell, 0, n, total(buy, n), 0, best);
+    }
+    if (best.volume == 0) {
+        return {};
+    }
+    return {prices[best.index], best.volume};
+}
+
+void AuctionGate::wake_drain_waiter() {
+    if (this->drain_waiter != nullptr) {
+        std::exchange(this->drain_waiter, nullptr)->wake();
+    }
+}
+
+bool AuctionGate::SharedAwaiter::await_ready() {
+    if (Scheduler::current() == nullptr) {
+        this->gate.lock_shared();
+        return true;
+    }
+    this->gate.commands.fetch_add(1);
+    if (!this->gate.auction.load()) {
+        return true;
+    }
+    this->gate.unlock_shared();
+    return false;
+}
+
+// Checked again under waiters_mutex, which unlock holds while it lets the waiters in
+bool AuctionGate::SharedAwaiter::await_suspend(std::coroutine_handle<> handle) {
+    this->suspending(handle);
+    std::lock_guard<std::mutex> lock(this->gate.waiters_mutex);
+    this->gate.commands.fetch_add(1);
+    if (!this->gate.auction.load()) {
+        return false;
+    }
+    if (this->gate.commands.fetch_sub(1) == 1) {
+        this->gate.commands.notify_one();
+        this->gate.wake_drain_waiter();
+    }
+    this->waiter.next = this->gate.shared_waiters;
+    this->gate.shared_waiters = &this->waiter;
+    return true;
+}
+
+// unlock_shared takes waiters_mutex after the count drops, so the count read here is either
+// not the last or the one it will find the waiter for
+bool AuctionGate::DrainAwaiter::await_suspend(std::coroutine_handle<> handle) {
+    this->suspending(handle);
+    std::lock_guard<std::mutex> lock(this->gate.waiters_mutex);
+    if (this->gate.commands.load() == 0) {
+        return false;
+    }
+    this->gate.drain_waiter = &this->waiter;
+    return true;
+}
+
+void AuctionGate::unlock() {
+    Waiter* waiters;
+    {
+        std::lock_guard<std::mutex> lock(this->waiters_mutex);
+        // Waiting tasks are counted in before the next auction can start waiting for commands
+        waiters = std::exchange(this->shared_waiters, nullptr);
+        for (Waiter* waiter = waiters; waiter != nullptr; waiter = waiter->next) {
+            this->commands.fetch_add(1);
+        }
+        this->auction.store(false);
+    }
+    this->auction.notify_all();
+    this->auction_mutex.unlock();
+    while (waiters != nullptr) {
+        Waiter* next = waiters->next;
+        waiters->wake();
+        waiters = next;
+    }
+}
+
+Task<void> AuctionGate::lock_async() {
+    if (Scheduler::current() == nullptr) {
+        this->lock();
+        co_return;
+    }
+    (co_await this->auction_mutex.lock_async()).release();
+    this->auction.store(true);
+    co_await DrainAwaiter(*this);
+}
@@ -0,0 +1,108 @@
+#ifndef AUCTION_H
+#define AUCTION_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include "order.h"
+
+// Where a call auction uncrosses, volume 0 if the book does not cross
+struct ClearingPrice {
+    uint32_t price = 0;
+    uint64_t volume = 0;
+};
+
+// One execution of an uncross. Both orders were resting, the one that arrived first is reported as the resting order.
+struct AuctionFill {
+    std::shared_ptr<RestingOrder> earlier;
+    std::shared_ptr<RestingOrder> later;
+    uint32_t execution_id;
+    uint32_t count;
+};
+
+// Prices that maximise the executed volume, then minimise the unexecuted
+// surplus, then the lowest of those. prices are the n distinct limit prices of
+// both sides in ascending order, buy and sell the quantity resting at each.
+// The cumulative volumes come from AVX2 prefix sums where the CPU has them.
+ClearingPrice find_clearing_price(const uint32_t* prices, const uint64_t* buy, const uint64_t* sell, size_t n, bool vectorised = true);
+
+// True if find_clearing_price can use AVX2 on this CPU
+bool clearing_price_vectorised();
+
+// Commands hold it shared and run alongside each other, an auction holds it
+// exclusively to have every book to itself. Unlike std::shared_mutex, a waiting
+// auction holds new commands back, so a steady stream of them cannot starve it.
+// Tasks on a scheduler's workers take it with the _async calls, which suspend
+// instead of blocking the worker.
+class AuctionGate {
+private:
+    std::atomic<uint32_t> commands{0};
+    std::atomic<bool> auction{false};
+    AsyncMutex auction_mutex;
+    // Tasks waiting for the auction to end, and an auction task waiting for commands to finish
+    std::mutex waiters_mutex;
+    Waiter* shared_waiters = nullptr;
+    Waiter* drain_waiter = nullptr;
+
+    // Must hold waiters_mutex
+    void wake_drain_waiter();
+public:
+    class SharedAwaiter : public Suspension {
+    private:
+        AuctionGate& gate;
+    public:
+        explicit SharedAwaiter(AuctionGate& gate) : gate(gate) {}
+        bool await_ready();
+        bool await_suspend(std::coroutine_handle<> handle);
+        void await_resume() { this->resumed(); }
+    };
+
+    class DrainAwaiter : public Suspension {
+    private:
+        AuctionGate& gate;
+    public:
+        explicit DrainAwaiter(AuctionGate& gate) : gate(gate) {}
+        bool await_ready() { return this->gate.commands.load() == 0; }
+        bool await_suspend(std::coroutine_handle<> handle);
+        void await_resume() { this->resumed(); }
+    };
+
+    void lock_shared() {
+        while (true) {
+            this->commands.fetch_add(1);
+            if (!this->auction.load()) {
+                return;
+            }
+            this->unlock_shared();
+            this->auction.wait(true);
+        }
+    }
+
+    void unlock_shared() {
+        if (this->commands.fetch_sub(1) == 1 && this->auction.load()) {
+            this->commands.notify_one();
+            std::lock_guard<std::mutex> lock(this->waiters_mutex);
+            this->wake_drain_waiter();
+        }
+    }
+
+    void lock() {
+        this->auction_mutex.lock();
+        this->auction.store(true);
+        for (uint32_t running = this->commands.load(); running != 0; running = this->commands.load()) {
+            this->commands.wait(running);
+        }
+    }
+
+    void unlock();
+
+    // Awaits lock_shared
+    SharedAwaiter lock_shared_async() { return SharedAwaiter(*this); }
+
+    // Awaits lock
+    Task<void> lock_async();
+};
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef BBO_CACHE_HPP
+#define BBO_CACHE_HPP
+
+#include <atomic>
+#include <cstdint>
+
+// A price of 0 with a count of 0 means that side of the book is empty
+struct BestBidOffer {
+    uint32_t bid_price = 0;
+    uint64_t bid_count = 0;
+    uint32_t ask_price = 0;
+    uint64_t ask_count = 0;
+};
+
+// Seqlock protected best bid/offer on its own cache line.
+// Writers must be serialised by the caller, readers never take a lock and only
+// retry if they overlap a write, which is a handful of stores.
+class alignas(64) BboCache {
+private:
+    std::atomic<uint32_t> seq{0};
+    std::atomic<uint32_t> bid_price{0};
+    std::atomic<uint32_t> ask_price{0};
+    std::atomic<uint64_t> bid_count{0};
+    std::atomic<uint64_t> ask_count{0};
+
+public:
+    void store(const BestBidOffer& bbo) {
+        uint32_t s = this->seq.load(std::memory_order_relaxed);
+        this->seq.store(s + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        this->bid_price.store(bbo.bid_price, std::memory_order_relaxed);
+        this->bid_count.store(bbo.bid_count, std::memory_order_relaxed);
+        this->ask_price.store(bbo.ask_price, std::memory_order_relaxed);
+        this->ask_count.store(bbo.ask_count, std::memory_order_relaxed);
+        this->seq.store(s + 2, std::memory_order_release);
+    }
+
+    BestBidOffer load() const {
+        BestBidOffer bbo;
+        while (true) {
+            uint32_t before = this->seq.load(std::memory_order_acquire);
+            if (before & 1) {
+                continue; // write in progress
+            }
+            bbo.bid_price = this->bid_price.load(std::memory_order_relaxed);
+            bbo.bid_count = this->bid_count.load(std::memory_order_relaxed);
+            bbo.ask_price = this->ask_price.load(std::memory_order_relaxed);
+            bbo.ask_count = this->ask_count.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (this->seq.load(std::memory_order_relaxed) == before) {
+                return bbo;
+            }
+        }
+    }
+};
+
+#endif
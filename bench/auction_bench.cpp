@@ -0,0 +1,171 @@
+// Call auction uncross cost over many instruments with deep books.
+// Usage: ./auction_bench [instruments] [orders per side] [crossing levels]
+//
+// First the clearing price search alone, scalar against AVX2 prefix sums, on
+// every instrument's crossing levels. Then whole uncrosses the way the engine
+// runs them: books filled during a call period are uncrossed across a thread
+// pool and each instrument's fills go out through Output::OrdersExecuted, with
+// stdout discarded.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <streambuf>
+#include <thread>
+#include <vector>
+
+#include "../io.hpp"
+#include "../orderbook.h"
+#include "../thread_pool.hpp"
+
+namespace {
+
+// Orders for the whole uncross, buys and sells spread over 512 ticks each and
+// overlapping by half
+constexpr uint32_t levels_per_side = 512;
+
+struct Quote {
+    bool buy;
+    uint32_t price;
+    uint32_t count;
+};
+
+std::vector<std::vector<Quote>> generate(uint32_t instruments, uint32_t per_side) {
+    std::mt19937_64 rng(1);
+    std::vector<std::vector<Quote>> quotes(instruments);
+    for (std::vector<Quote>& book : quotes) {
+        for (uint32_t i = 0; i < 2 * per_side; i++) {
+            bool buy = i % 2 == 0;
+            uint32_t offset = static_cast<uint32_t>(rng() % levels_per_side);
+            book.push_back({buy, buy ? 1000 + offset : 1000 + levels_per_side / 2 + offset, 1 + static_cast<uint32_t>(rng() % 100)});
+        }
+    }
+    return quotes;
+}
+
+struct Levels {
+    std::vector<uint32_t> prices;
+    std::vector<uint64_t> buy;
+    std::vector<uint64_t> sell;
+};
+
+// Crossing levels of a deep book as Orderbook::uncross passes them: every price
+// from the best ask to the best bid has an order on at least one side
+Levels deep_levels(std::mt19937_64& rng, uint32_t depth) {
+    Levels levels;
+    for (uint32_t i = 0; i < depth; i++) {
+        uint64_t side = rng() % 3;
+        levels.prices.push_back(1000 + i);
+        levels.buy.push_back(side != 1 ? 1 + rng() % 1000 : 0);
+        levels.sell.push_back(side != 0 ? 1 + rng() % 1000 : 0);
+    }
+    return levels;
+}
+
+// Microseconds for one pass over every instrument, best of a few
+double clearing_us(const std::vector<Levels>& books, bool vectorised, uint64_t& checksum) {
+    double best = 1e18;
+    for (int round = 0; round < 5; round++) {
+        checksum = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (const Levels& levels : books) {
+            ClearingPrice clearing = find_clearing_price(levels.prices.data(), levels.buy.data(), levels.sell.data(), levels.prices.size(), vectorised);
+            checksum += clearing.price * 1000003ull + clearing.volume;
+        }
+        best = std::min(best, std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+    }
+    return best;
+}
+
+class DiscardBuffer : public std::streambuf {
+protected:
+    int overflow(int c) override { return c; }
+    std::streamsize xsputn(const char*, std::streamsize n) override { return n; }
+};
+
+struct UncrossResult {
+    double ms;
+    uint64_t fills;
+};
+
+UncrossResult run_uncross(const std::vector<std::vector<Quote>>& quotes, unsigned threads, bool vectorised) {
+    // A fresh set of books each run, since an uncross empties the crossing part
+    std::vector<std::unique_ptr<Orderbook>> books;
+    OrderIndex ids;
+    uint32_t id = 1;
+    for (size_t i = 0; i < quotes.size(); i++) {
+        char name[24];
+        std::snprintf(name, sizeof(name), "I%zu", i);
+        books.push_back(std::make_unique<Orderbook>(name));
+        for (const Quote& quote : quotes[i]) {
+            books.back()->rest_call_order(quote.buy ? "buy" : "sell", quote.price, quote.count, id++, 0, ids).order->set_order_ready();
+        }
+    }
+    ThreadPool pool(threads);
+    std::atomic<uint64_t> fills{0};
+    auto start = std::chrono::steady_clock::now();
+    pool.parallel_for(books.size(), [&](size_t i) {
+        thread_local std::vector<AuctionFill> book_fills;
+        thread_local std::vector<Execution> executions;
+        book_fills.clear();
+        executions.clear();
+        ClearingPrice clearing = books[i]->uncross(1, book_fills, ids, vectorised);
+        for (const AuctionFill& fill : book_fills) {
+            executions.push_back({fill.earlier->get_order_id(), fill.later->get_order_id(), fill.execution_id, clearing.price, fill.count, nullptr, nullptr});
+        }
+        Output::OrdersExecuted(executions.data(), executions.size(), 1);
+        fills += book_fills.size();
+    });
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    return {ms, fills.load()};
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    uint32_t instruments = argc > 1 ? static_cast<uint32_t>(std::strtoul(argv[1], nullptr, 10)) : 5000;
+    uint32_t per_side = argc > 2 ? static_cast<uint32_t>(std::strtoul(argv[2], nullptr, 10)) : 100;
+    uint32_t depth = argc > 3 ? static_cast<uint32_t>(std::strtoul(argv[3], nullptr, 10)) : 1024;
+    std::vector<std::vector<Quote>> quotes = generate(instruments, per_side);
+
+    std::vector<Levels> levels;
+    std::mt19937_64 rng(2);
+    for (uint32_t i = 0; i < instruments; i++) {
+        levels.push_back(deep_levels(rng, depth));
+    }
+    size_t total_levels = static_cast<size_t>(instruments) * depth;
+    uint64_t scalar_sum, vector_sum;
+    double scalar = clearing_us(levels, false, scalar_sum);
+    double vector = clearing_us(levels, true, vector_sum);
+    if (scalar_sum != vector_sum) {
+        std::printf("scalar and AVX2 clearing prices differ\n");
+        return 1;
+    }
+    std::printf("clearing price search, %u instruments, %u crossing levels each (AVX2 %s)\n", instruments,
+        depth, clearing_price_vectorised() ? "available" : "not available, both scalar");
+    std::printf("%-10s %10s %10s\n", "", "total us", "ns/level");
+    std::printf("%-10s %10.0f %10.2f\n", "scalar", scalar, scalar * 1000 / total_levels);
+    std::printf("%-10s %10.0f %10.2f\n", "avx2", vector, vector * 1000 / total_levels);
+
+    DiscardBuffer discard;
+    std::streambuf* stdout_buffer = std::cout.rdbuf(&discard);
+    std::vector<std::pair<unsigned, UncrossResult>> results;
+    for (unsigned threads : {1u, 2u, 4u, 8u}) {
+        results.emplace_back(threads, run_uncross(quotes, threads, true));
+    }
+    UncrossResult scalar_run = run_uncross(quotes, 1, false);
+    std::cout.rdbuf(stdout_buffer);
+
+    std::printf("\nuncross of %u instruments, %u orders per side, fills printed in bulk (%u hardware threads)\n", instruments, per_side,
+        std::thread::hardware_concurrency());
+    std::printf("%-10s %10s %10s\n", "threads", "total ms", "fills");
+    for (const auto& [threads, result] : results) {
+        std::printf("%-10u %10.1f %10lu\n", threads, result.ms, result.fills);
+    }
+    std::printf("%-10s %10.1f %10lu\n", "1, scalar", scalar_run.ms, scalar_run.fills);
+    return 0;
+}
@@ -0,0 +1,282 @@
+// Thread per connection against connections as tasks on a few workers.
+// Usage: ./connection_bench [engine binary] [commands] [workers, default one per CPU]
+//
+// For 8, 64 and 512 connections the engine is started once with a thread per
+// connection and once with -C workers. Every connection sends its share of a
+// seeded order flow on four instruments, crossing often enough that orders
+// wait on each other's side mutexes and readiness, then a query that marks
+// its end. Commands are written as fast as the engine takes them, and the
+// time runs until the last connection's query is answered. The engine's
+// threads, context switches and CPU time are read from /proc at that point.
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../io.hpp"
+
+namespace {
+
+struct Engine {
+    pid_t pid = -1;
+    FILE* out = nullptr;
+    std::string socket_path;
+};
+
+Engine start_engine(const char* binary, unsigned workers) {
+    Engine engine;
+    engine.socket_path = "/tmp/connection-bench-" + std::to_string(getpid()) + ".sock";
+    int pipefd[2];
+    if (pipe(pipefd) != 0) {
+        return engine;
+    }
+    std::string workers_arg = std::to_string(workers);
+    engine.pid = fork();
+    if (engine.pid == 0) {
+        dup2(pipefd[1], STDOUT_FILENO);
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDERR_FILENO);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        if (workers > 0) {
+            execl(binary, binary, "-C", workers_arg.c_str(), engine.socket_path.c_str(), static_cast<char*>(nullptr));
+        } else {
+            execl(binary, binary, engine.socket_path.c_str(), static_cast<char*>(nullptr));
+        }
+        _exit(127);
+    }
+    close(pipefd[1]);
+    engine.out = fdopen(pipefd[0], "r");
+    return engine;
+}
+
+void stop_engine(Engine& engine) {
+    kill(engine.pid, SIGTERM);
+    waitpid(engine.pid, nullptr, 0);
+    fclose(engine.out);
+    unlink(engine.socket_path.c_str());
+}
+
+int connect_to(const std::string& path) {
+    for (int attempt = 0; attempt < 500; attempt++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr {};
+        addr.sun_family = AF_UNIX;
+        std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        if (connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) == 0) {
+            return fd;
+        }
+        close(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return -1;
+}
+
+// One connection's commands: orders around 100 on four instruments, a cancel
+// of one of its own earlier orders every tenth command, then the end marker
+std::vector<ClientCommand> generate(uint32_t connection, uint32_t commands) {
+    std::mt19937 rng(connection + 1);
+    std::vector<ClientCommand> out;
+    uint32_t first_id = connection * (commands + 1) + 1;
+    for (uint32_t i = 0; i < commands; i++) {
+        ClientCommand cmd {};
+        cmd.order_id = first_id + i;
+        if (i > 0 && rng() % 10 == 0) {
+            cmd.type = input_cancel;
+            cmd.order_id = first_id + rng() % i;
+        } else {
+            cmd.type = rng() % 2 == 0 ? input_buy : input_sell;
+            cmd.price = 95 + rng() % 11;
+            cmd.count = 1 + rng() % 20;
+            std::snprintf(cmd.instrument, sizeof(cmd.instrument), "SYM%u", static_cast<unsigned>(rng() % 4));
+        }
+        out.push_back(cmd);
+    }
+    ClientCommand done {};
+    done.type = input_query;
+    std::strncpy(done.instrument, "DONE", sizeof(done.instrument) - 1);
+    out.push_back(done);
+    return out;
+}
+
+struct ProcessStats {
+    unsigned threads = 0;
+    uint64_t context_switches = 0;
+    double cpu_seconds = 0;
+    uint64_t rss_kb = 0;
+};
+
+uint64_t status_field(const std::string& path, const char* name) {
+    FILE* file = std::fopen(path.c_str(), "r");
+    if (file == nullptr) {
+        return 0;
+    }
+    char line[256];
+    uint64_t value = 0;
+    size_t length = std::strlen(name);
+    while (std::fgets(line, sizeof(line), file) != nullptr) {
+        if (std::strncmp(line, name, length) == 0) {
+            value = std::strtoull(line + length, nullptr, 10);
+            break;
+        }
+    }
+    std::fclose(file);
+    return value;
+}
+
+// Context switches are counted per thread, so every thread's are summed
+ProcessStats process_stats(pid_t pid) {
+    ProcessStats stats;
+    std::string proc = "/proc/" + std::to_string(pid);
+    stats.rss_kb = status_field(proc + "/status", "VmRSS:");
+    if (DIR* tasks = opendir((proc + "/task").c_str())) {
+        while (dirent* entry = readdir(tasks)) {
+            if (entry->d_name[0] == '.') {
+                continue;
+            }
+            std::string status = proc + "/task/" + entry->d_name + "/status";
+            stats.threads++;
+            stats.context_switches += status_field(status, "voluntary_ctxt_switches:") + status_field(status, "nonvoluntary_ctxt_switches:");
+        }
+        closedir(tasks);
+    }
+    if (FILE* stat = std::fopen((proc + "/stat").c_str(), "r")) {
+        char buffer[1024];
+        size_t got = std::fread(buffer, 1, sizeof(buffer) - 1, stat);
+        buffer[got] = '\0';
+        std::fclose(stat);
+        // utime and stime are the 12th and 13th fields after the command name
+        const char* fields = std::strrchr(buffer, ')');
+        unsigned long long utime = 0, stime = 0;
+        if (fields != nullptr && std::sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) == 2) {
+            stats.cpu_seconds = static_cast<double>(utime + stime) / sysconf(_SC_CLK_TCK);
+        }
+    }
+    return stats;
+}
+
+struct Result {
+    double seconds;
+    ProcessStats stats;
+};
+
+bool run(const char* binary, unsigned workers, uint32_t connections, uint32_t commands, Result& result) {
+    Engine engine = start_engine(binary, workers);
+    if (engine.pid < 0) {
+        return false;
+    }
+    std::vector<int> fds;
+    std::vector<std::vector<ClientCommand>> streams;
+    std::vector<size_t> written(connections, 0);
+    std::atomic<bool> ok{true};
+    for (uint32_t c = 0; c < connections && ok; c++) {
+        int fd = connect_to(engine.socket_path);
+        ok = fd != -1;
+        if (ok) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            fds.push_back(fd);
+            streams.push_back(generate(c, commands / connections));
+        }
+    }
+
+    // Every connection's last command is its query, and a connection's commands are handled in order
+    std::thread reader([&] {
+        char line[256];
+        uint32_t done = 0;
+        while (done < connections && std::fgets(line, sizeof(line), engine.out) != nullptr) {
+            if (std::strncmp(line, "Q DONE", 6) == 0) {
+                done++;
+            }
+        }
+        if (done < connections) {
+            ok = false;
+        }
+    });
+    auto start = std::chrono::steady_clock::now();
+    std::vector<pollfd> pending;
+    std::vector<uint32_t> index;
+    while (ok) {
+        pending.clear();
+        index.clear();
+        for (uint32_t c = 0; c < fds.size(); c++) {
+            if (written[c] < streams[c].size() * sizeof(ClientCommand)) {
+                pending.push_back({fds[c], POLLOUT, 0});
+                index.push_back(c);
+            }
+        }
+        if (pending.empty()) {
+            break;
+        }
+        if (poll(pending.data(), pending.size(), 1000) < 0) {
+            ok = false;
+            break;
+        }
+        for (size_t i = 0; i < pending.size(); i++) {
+            if (!(pending[i].revents & POLLOUT)) {
+                continue;
+            }
+            uint32_t c = index[i];
+            const char* data = reinterpret_cast<const char*>(streams[c].data());
+            size_t total = streams[c].size() * sizeof(ClientCommand);
+            // Whole commands only, and few enough that a socket that polled writable takes all
+            // of them at once, so no read in the engine ever sees half of one
+            size_t left = (total - written[c]) / sizeof(ClientCommand);
+            ssize_t sent = write(fds[c], data + written[c], std::min<size_t>(left, 64) * sizeof(ClientCommand));
+            if (sent > 0) {
+                written[c] += sent;
+            } else if (sent < 0 && errno != EAGAIN) {
+                ok = false;
+            }
+        }
+    }
+    reader.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result = {seconds, process_stats(engine.pid)};
+    for (int fd : fds) {
+        close(fd);
+    }
+    stop_engine(engine);
+    return ok;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    const char* binary = argc > 1 ? argv[1] : "./engine";
+    uint32_t commands = argc > 2 ? static_cast<uint32_t>(std::strtoul(argv[2], nullptr, 10)) : 200000;
+    unsigned workers = argc > 3 ? static_cast<unsigned>(std::strtoul(argv[3], nullptr, 10)) : std::max(std::thread::hardware_concurrency(), 1u);
+    signal(SIGPIPE, SIG_IGN);
+
+    std::printf("%u commands over 4 instruments, %u hardware threads, tasks on %u workers\n", commands, std::thread::hardware_concurrency(), workers);
+    std::printf("%-12s %-8s %12s %10s %14s %12s %10s\n", "connections", "model", "commands/s", "threads", "ctx switches", "cpu us/cmd", "rss MB");
+    for (uint32_t connections : {8u, 64u, 512u}) {
+        for (unsigned model_workers : {0u, workers}) {
+            Result result;
+            if (!run(binary, model_workers, connections, commands, result)) {
+                std::fprintf(stderr, "engine %s stopped responding\n", binary);
+                return 1;
+            }
+            uint32_t handled = commands / connections * connections + connections;
+            std::printf("%-12u %-8s %12.0f %10u %14lu %12.2f %10.1f\n", connections, model_workers == 0 ? "threads" : "tasks", handled / result.seconds,
+                result.stats.threads, result.stats.context_switches, result.stats.cpu_seconds * 1e6 / handled, result.stats.rss_kb / 1024.0);
+        }
+    }
+    return 0;
+}
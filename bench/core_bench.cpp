@@ -0,0 +1,464 @@
+// Microbenchmarks of the core data structures, written out as JSON so a change
+// to one of them can be compared against a run from before it.
+// Usage: ./core_bench [-o results.json] [-b baseline.json]
+//
+// Groups:
+//   hashmap    ts_orderbook_hashmap get, exists, insert and a 90/10 get/insert mix
+//              on 1 to 8 threads sharing one map
+//   orderbook  Orderbook insert_order, popTopOrder with insert_order_with_val, and
+//              churn, for each side book at several depths and cancel ratios
+//   order      RestingOrder accessors, readiness checks and the wait handoff
+//   output     Output formatting with stdout discarded, and events to a sink
+//
+// Every result is the fastest of a few runs. ns_per_op is wall time over all
+// operations, so on several threads it is the inverse of total throughput.
+// With -b, results are printed next to the baseline's with the change.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "../io.hpp"
+#include "../orderbook.h"
+
+namespace {
+
+struct Result {
+    std::string id;
+    uint64_t ops;
+    double ns_per_op;
+};
+
+std::vector<Result> results;
+
+// Runs run(), which does ops operations, a few times and keeps the fastest
+void measure(const std::string& id, uint64_t ops, const std::function<void()>& run) {
+    double best = 1e300;
+    for (int rep = 0; rep < 3; rep++) {
+        auto start = std::chrono::steady_clock::now();
+        run();
+        best = std::min(best, std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count());
+    }
+    results.push_back({id, ops, best / ops});
+    std::printf("%-52s %12.1f\n", id.c_str(), best / ops);
+}
+
+// Starts threads calling body(thread index) together and waits for all of them
+void run_threads(unsigned threads, const std::function<void(unsigned)>& body) {
+    std::atomic<bool> go{false};
+    std::vector<std::thread> pool;
+    for (unsigned t = 0; t < threads; t++) {
+        pool.emplace_back([&, t] {
+            while (!go.load(std::memory_order_acquire)) {
+                std::this_thread::yield();
+            }
+            body(t);
+        });
+    }
+    go.store(true, std::memory_order_release);
+    for (std::thread& thread : pool) {
+        thread.join();
+    }
+}
+
+// Keeps a value alive so the loop computing it is not optimised away
+std::atomic<uint64_t> checksum{0};
+
+std::shared_ptr<RestingOrder> make_order(uint32_t id, uint32_t price) {
+    return std::make_shared<RestingOrder>(id, "BENCH", price, 1, "buy", static_cast<intmax_t>(id));
+}
+
+void bench_hashmap() {
+    constexpr uint32_t keys = 100000;
+    constexpr uint32_t ops_per_thread = 50000;
+    std::vector<std::shared_ptr<RestingOrder>> orders;
+    for (uint32_t id = 1; id <= keys; id++) {
+        orders.push_back(make_order(id, 100));
+    }
+    ts_orderbook_hashmap<uint32_t, RestingOrder> filled;
+    for (const std::shared_ptr<RestingOrder>& order : orders) {
+        filled.insert(order->get_order_id(), order);
+    }
+
+    for (unsigned threads : {1u, 2u, 4u, 8u}) {
+        std::string suffix = "/threads=" + std::to_string(threads);
+        uint64_t total = static_cast<uint64_t>(ops_per_thread) * threads;
+        measure("hashmap/get" + suffix, total, [&] {
+            run_threads(threads, [&](unsigned t) {
+                std::mt19937 rng(t);
+                uint64_t found = 0;
+                for (uint32_t i = 0; i < ops_per_thread; i++) {
+                    found += filled.get(1 + rng() % keys) != nullptr;
+                }
+                checksum += found;
+            });
+        });
+        // Half the keys looked up are missing, as for the ids of new orders
+        measure("hashmap/exists" + suffix, total, [&] {
+            run_threads(threads, [&](unsigned t) {
+                std::mt19937 rng(t);
+                uint64_t found = 0;
+                for (uint32_t i = 0; i < ops_per_thread; i++) {
+                    found += filled.exists(1 + rng() % (2 * keys));
+                }
+                checksum += found;
+            });
+        });
+        // Each thread inserts keys of its own into an empty map, which ends up holding all of them
+        uint32_t inserts = keys / threads;
+        measure("hashmap/insert" + suffix, static_cast<uint64_t>(inserts) * threads, [&] {
+            ts_orderbook_hashmap<uint32_t, RestingOrder> map;
+            run_threads(threads, [&](unsigned t) {
+                for (uint32_t i = t * inserts; i < (t + 1) * inserts; i++) {
+                    map.insert(i + 1, orders[i]);
+                }
+            });
+        });
+        // Readers and writers on the same buckets: one insert of a new key for every nine gets
+        measure("hashmap/get_insert_90_10" + suffix, total, [&] {
+            ts_orderbook_hashmap<uint32_t, RestingOrder> map;
+            for (uint32_t i = 0; i < keys / 2; i++) {
+                map.insert(i + 1, orders[i]);
+            }
+            run_threads(threads, [&](unsigned t) {
+                std::mt19937 rng(t);
+                uint64_t found = 0;
+                uint32_t next = keys + t * ops_per_thread;
+                for (uint32_t i = 0; i < ops_per_thread; i++) {
+                    if (i % 10 == 9) {
+                        map.insert(next++, orders[i % keys]);
+                    } else {
+                        found += map.get(1 + rng() % keys) != nullptr;
+                    }
+                }
+                checksum += found;
+            });
+        });
+    }
+}
+
+struct BookKind {
+    const char* name;
+    std::optional<LadderConfig> ladder;
+    bool skiplist;
+};
+
+constexpr uint32_t base_price = 10000;
+constexpr uint32_t band = 1000;
+
+// Buy orders at prices spread over the band
+std::vector<std::shared_ptr<RestingOrder>> make_book_orders(size_t n, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    std::vector<std::shared_ptr<RestingOrder>> orders;
+    orders.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+        orders.push_back(make_order(static_cast<uint32_t>(i + 1), base_price + static_cast<uint32_t>(rng() % band)));
+    }
+    return orders;
+}
+
+/*
+Churn keeps depth live orders on the buy side. Each step inserts a new order and
+then takes a live one out again: with probability cancel_ratio by cancelling a
+random resting order, which leaves a tombstone in the side book as a cancel does
+in the engine, and otherwise by matching, which pops the top and drops tombstones
+until it reaches a live order. Tombstones build up until they reach the top, so
+the share of the side book they make up grows with the cancel ratio.
+*/
+void churn(Orderbook& book, uint32_t depth, double cancel_ratio, uint32_t steps, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    std::bernoulli_distribution cancels(cancel_ratio);
+    // Cancel candidates, entries matched in the meantime are skipped when picked
+    std::vector<std::shared_ptr<RestingOrder>> resting;
+    uint32_t id = 1;
+    intmax_t timestamp = 0;
+    auto add = [&] {
+        uint32_t price = base_price + static_cast<uint32_t>(rng() % band);
+        resting.push_back(book.insert_order("buy", id++, "BENCH", price, 1, timestamp++));
+    };
+    for (uint32_t i = 0; i < depth; i++) {
+        add();
+    }
+    for (uint32_t step = 0; step < steps; step++) {
+        add();
+        if (cancels(rng)) {
+            while (true) {
+                size_t pick = rng() % resting.size();
+                std::shared_ptr<RestingOrder> order = std::move(resting[pick]);
+                resting[pick] = std::move(resting.back());
+                resting.pop_back();
+                if (order->get_count() > 0 && order->get_deleted_timestamp() < 0) {
+                    order->delete_order(timestamp++);
+                    break;
+                }
+            }
+        } else {
+            while (true) {
+                std::shared_ptr<RestingOrder> top = book.popTopOrder("buy").value();
+                if (top->get_deleted_timestamp() < 0) {
+                    top->set_count(0);
+                    break;
+                }
+            }
+        }
+    }
+}
+
+void bench_orderbook() {
+    std::vector<BookKind> kinds = {
+        {"heap", std::nullopt, false},
+        {"skiplist", std::nullopt, true},
+        {"ladder", LadderConfig{base_price, 1, band}, false},
+    };
+    constexpr uint32_t steps = 100000;
+    for (const BookKind& kind : kinds) {
+        for (uint32_t depth : {100u, 10000u, 100000u}) {
+            std::string prefix = std::string("orderbook/") + kind.name;
+            std::string suffix = "/depth=" + std::to_string(depth);
+            std::vector<std::shared_ptr<RestingOrder>> orders = make_book_orders(depth, depth);
+            measure(prefix + "/insert_order" + suffix, depth, [&] {
+                Orderbook book("BENCH", kind.ladder, kind.skiplist);
+                for (const std::shared_ptr<RestingOrder>& order : orders) {
+                    book.insert_order_with_val("buy", order);
+                }
+            });
+            // What the matching path did for an order that does not cross: pop the opposite top and put it back
+            Orderbook book("BENCH", kind.ladder, kind.skiplist);
+            for (const std::shared_ptr<RestingOrder>& order : orders) {
+                book.insert_order_with_val("buy", order);
+            }
+            measure(prefix + "/pop_reinsert" + suffix, steps, [&] {
+                for (uint32_t i = 0; i < steps; i++) {
+                    book.insert_order_with_val("buy", book.popTopOrder("buy").value());
+                }
+            });
+            for (double cancel_ratio : {0.0, 0.5, 0.9}) {
+                char ratio[8];
+                std::snprintf(ratio, sizeof(ratio), "%.1f", cancel_ratio);
+                measure(prefix + "/churn" + suffix + "/cancel_ratio=" + ratio, steps, [&] {
+                    Orderbook churned("BENCH", kind.ladder, kind.skiplist);
+                    churn(churned, depth, cancel_ratio, steps, depth);
+                });
+            }
+        }
+    }
+}
+
+void bench_order() {
+    constexpr uint32_t ops = 1000000;
+    std::shared_ptr<RestingOrder> order = make_order(1, 100);
+    order->set_count(1u << 30);
+    order->set_order_ready();
+    auto accessor = [&](const char* name, const std::function<uint64_t()>& call) {
+        for (unsigned threads : {1u, 4u}) {
+            measure(std::string("order/") + name + "/threads=" + std::to_string(threads), static_cast<uint64_t>(ops) * threads, [&] {
+                run_threads(threads, [&](unsigned) {
+                    uint64_t sum = 0;
+                    for (uint32_t i = 0; i < ops; i++) {
+                        sum += call();
+                    }
+                    checksum += sum;
+                });
+            });
+        }
+    };
+    accessor("get_price", [&] { return order->get_price(); });
+    accessor("get_count", [&] { return order->get_count(); });
+    accessor("get_deleted_timestamp", [&] { return static_cast<uint64_t>(order->get_deleted_timestamp()); });
+    accessor("get_side", [&] { return order->get_side().size(); });
+    accessor("get_execution_id", [&] { return order->get_execution_id(); });
+    accessor("decrease_count", [&] { order->decrease_count(1); return 0; });
+    accessor("check_ready", [&] { order->check_order_ready_or_wait(); return 0; });
+
+    measure("order/set_order_ready", ops, [&] {
+        for (uint32_t i = 0; i < ops; i++) {
+            order->set_order_ready();
+        }
+    });
+    // Two threads take turns making an order ready for the other, each wait blocks until the other's set
+    constexpr uint32_t handoffs = 20000;
+    std::vector<std::shared_ptr<RestingOrder>> ping, pong;
+    measure("order/ready_wait_handoff", 2 * handoffs, [&] {
+        ping.clear();
+        pong.clear();
+        for (uint32_t i = 0; i < handoffs; i++) {
+            ping.push_back(make_order(i, 100));
+            pong.push_back(make_order(i, 100));
+        }
+        run_threads(2, [&](unsigned t) {
+            for (uint32_t i = 0; i < handoffs; i++) {
+                if (t == 0) {
+                    ping[i]->set_order_ready();
+                    pong[i]->check_order_ready_or_wait();
+                } else {
+                    ping[i]->check_order_ready_or_wait();
+                    pong[i]->set_order_ready();
+                }
+            }
+        });
+    });
+}
+
+class DiscardBuffer : public std::streambuf {
+protected:
+    int overflow(int c) override { return c; }
+    std::streamsize xsputn(const char*, std::streamsize n) override { return n; }
+};
+
+struct CountingSink : EventSink {
+    uint64_t events = 0;
+    void publish(const EngineEvent& event) override { this->events += event.kind; }
+};
+
+void bench_output() {
+    constexpr uint32_t ops = 500000;
+    DiscardBuffer discard;
+    std::streambuf* stdout_buffer = std::cout.rdbuf(&discard);
+    std::vector<std::pair<std::string, std::function<void(uint32_t)>>> events = {
+        {"OrderAdded", [](uint32_t i) { Output::OrderAdded(i, "BENCH", 10000 + i % 100, 1 + i % 50, i % 2, i); }},
+        {"OrderExecuted", [](uint32_t i) { Output::OrderExecuted(i, i + 1, 1 + i % 4, 10000 + i % 100, 1 + i % 50, i); }},
+        {"OrderDeleted", [](uint32_t i) { Output::OrderDeleted(i, i % 2, i); }},
+        {"OrderRejected", [](uint32_t i) { Output::OrderRejected(i, reject_throttled, i); }},
+        {"TopOfBook", [](uint32_t i) { Output::TopOfBook("BENCH", 10000 + i % 100, i, 10100 + i % 100, i, i); }},
+    };
+    CountingSink sink;
+    for (bool to_stdout : {true, false}) {
+        Output::print_stdout = to_stdout;
+        Output::sink = to_stdout ? nullptr : &sink;
+        for (const auto& [name, print] : events) {
+            measure(std::string("output/") + (to_stdout ? "stdout/" : "sink/") + name, ops, [&] {
+                for (uint32_t i = 0; i < ops; i++) {
+                    print(i);
+                }
+            });
+        }
+    }
+    Output::sink = nullptr;
+    Output::print_stdout = true;
+
+    // Executions printed in batches the size of a sweep through a level
+    std::vector<Execution> batch;
+    for (uint32_t i = 0; i < 64; i++) {
+        batch.push_back({i, 100000 + i, 1, 10000, 1 + i % 50, nullptr, nullptr});
+    }
+    measure("output/stdout/OrdersExecuted/batch=64", static_cast<uint64_t>(ops / 64) * 64, [&] {
+        for (uint32_t i = 0; i < ops / 64; i++) {
+            Output::OrdersExecuted(batch.data(), batch.size(), i);
+        }
+    });
+    std::cout.rdbuf(stdout_buffer);
+    checksum += sink.events;
+}
+
+std::string json_escape(const std::string& text) {
+    std::string out;
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            out.push_back('\\');
+        }
+        out.push_back(c);
+    }
+    return out;
+}
+
+// One result per line, which is also what read_baseline expects
+bool write_json(const std::string& path) {
+    std::ofstream out(path);
+    if (!out) {
+        return false;
+    }
+    char host[256] = "unknown";
+    gethostname(host, sizeof(host) - 1);
+    out << "{\n  \"benchmark\": \"core_bench\",\n  \"host\": \"" << json_escape(host) << "\",\n  \"hardware_threads\": "
+        << std::thread::hardware_concurrency() << ",\n  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        char ns[32];
+        std::snprintf(ns, sizeof(ns), "%.2f", results[i].ns_per_op);
+        out << "    {\"id\": \"" << json_escape(results[i].id) << "\", \"ops\": " << results[i].ops << ", \"ns_per_op\": " << ns << "}"
+            << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n}\n";
+    return static_cast<bool>(out);
+}
+
+// ns_per_op by id from a file written by write_json
+std::map<std::string, double> read_baseline(const std::string& path) {
+    std::map<std::string, double> baseline;
+    std::ifstream in(path);
+    std::string line;
+    const std::string id_key = "\"id\": \"";
+    const std::string ns_key = "\"ns_per_op\": ";
+    while (std::getline(in, line)) {
+        size_t id = line.find(id_key);
+        size_t ns = line.find(ns_key);
+        if (id == std::string::npos || ns == std::string::npos) {
+            continue;
+        }
+        id += id_key.size();
+        baseline[line.substr(id, line.find('"', id) - id)] = std::strtod(line.c_str() + ns + ns_key.size(), nullptr);
+    }
+    return baseline;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    std::string output = "core_bench.json";
+    std::string baseline_path;
+    int opt;
+    while ((opt = getopt(argc, argv, "o:b:")) != -1) {
+        switch (opt) {
+            case 'o': output = optarg; break;
+            case 'b': baseline_path = optarg; break;
+            default:
+                std::fprintf(stderr, "Usage: %s [-o results.json] [-b baseline.json]\n", argv[0]);
+                return 1;
+        }
+    }
+    std::map<std::string, double> baseline;
+    if (!baseline_path.empty()) {
+        baseline = read_baseline(baseline_path);
+        if (baseline.empty()) {
+            std::fprintf(stderr, "No results in %s\n", baseline_path.c_str());
+            return 1;
+        }
+    }
+
+    std::printf("%-52s %12s\n", "benchmark", "ns/op");
+    bench_hashmap();
+    bench_orderbook();
+    bench_order();
+    bench_output();
+    if (!write_json(output)) {
+        std::fprintf(stderr, "Could not write %s\n", output.c_str());
+        return 1;
+    }
+    std::printf("results written to %s\n", output.c_str());
+
+    if (!baseline.empty()) {
+        std::printf("\nagainst %s, ns/op\n%-52s %12s %12s %8s\n", baseline_path.c_str(), "benchmark", "baseline", "now", "change");
+        for (const Result& result : results) {
+            auto it = baseline.find(result.id);
+            if (it == baseline.end()) {
+                std::printf("%-52s %12s %12.1f %8s\n", result.id.c_str(), "-", result.ns_per_op, "new");
+                continue;
+            }
+            std::printf("%-52s %12.1f %12.1f %+7.1f%%\n", result.id.c_str(), it->second, result.ns_per_op, (result.ns_per_op / it->second - 1) * 100);
+        }
+    }
+    return 0;
+}
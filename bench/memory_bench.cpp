@@ -0,0 +1,95 @@
+// Resident memory of books with many instruments and resting orders.
+// Usage: ./memory_bench [instruments] [orders]
+//
+// Every instrument is listed with an order book, then orders priced away from
+// the market rest the way the engine rests them, through rest_passive_order
+// with an Activity held and the order index the engine uses for cancels.
+// Nine in ten orders go to the 1% of instruments that are busy and the rest
+// are spread over the others. Heap books are measured against compact ones
+// (-M in the engine), both while every book has just been used and once the
+// idle book sweep has run. Bytes are the heap's in-use bytes from mallinfo2.
+
+#include <malloc.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../orderbook.h"
+
+namespace {
+
+size_t heap_in_use() {
+    return mallinfo2().uordblks;
+}
+
+struct Usage {
+    double instrument_bytes; // per listed instrument with no orders, once idle
+    double active_bytes;     // per resting order, every book just used
+    double idle_bytes;       // per resting order, idle books shrunk
+};
+
+Usage measure(bool compact, uint32_t instruments, uint32_t orders) {
+    size_t start = heap_in_use();
+    Usage usage {};
+    {
+        ts_orderbook_hashmap<std::string, Orderbook> books;
+        OrderIndex ids;
+        std::vector<std::string> names;
+        std::vector<Orderbook*> listed;
+        for (uint32_t i = 0; i < instruments; i++) {
+            names.push_back("SYM" + std::to_string(i));
+            books.insert_if_not_exist(names.back(), std::nullopt, false, compact);
+            listed.push_back(books.get(names.back()).get());
+        }
+        // The first sweep only clears what the last one saw
+        auto sweep = [&] {
+            for (int pass = 0; pass < 2; pass++) {
+                for (Orderbook* book : listed) {
+                    book->shrink_if_idle();
+                }
+            }
+        };
+        sweep();
+        size_t listed_bytes = heap_in_use() - start;
+        usage.instrument_bytes = static_cast<double>(listed_bytes) / instruments;
+
+        std::mt19937 rng(1);
+        uint32_t busy = std::max(instruments / 100, 1u);
+        for (uint32_t id = 1; id <= orders; id++) {
+            uint32_t instrument = rng() % 10 != 0 || busy == instruments ? rng() % busy : busy + rng() % (instruments - busy);
+            bool buy = rng() % 2 == 0;
+            uint32_t price = buy ? 900 + rng() % 100 : 1001 + rng() % 100;
+            Orderbook& book = *listed[instrument];
+            Orderbook::Activity activity(book);
+            book.rest_passive_order(buy ? "buy" : "sell", price, 1 + rng() % 100, id, 0, false, ids).order->set_order_ready();
+        }
+        usage.active_bytes = static_cast<double>(heap_in_use() - start - listed_bytes) / orders;
+        sweep();
+        usage.idle_bytes = static_cast<double>(heap_in_use() - start - listed_bytes) / orders;
+    }
+    return usage;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    uint32_t instruments = argc > 1 ? static_cast<uint32_t>(std::strtoul(argv[1], nullptr, 10)) : 20000;
+    uint32_t orders = argc > 2 ? static_cast<uint32_t>(std::strtoul(argv[2], nullptr, 10)) : 1000000;
+
+    std::printf("%u resting orders over %u instruments, 90%% of them on %u\n", orders, instruments, std::max(instruments / 100, 1u));
+    std::printf("%-10s %16s %16s %16s %12s\n", "books", "B/instrument", "B/order active", "B/order idle", "total MB");
+    Usage heap = measure(false, instruments, orders);
+    Usage compact = measure(true, instruments, orders);
+    for (const auto& [name, usage] : {std::pair{"heap", heap}, std::pair{"compact", compact}}) {
+        double total = usage.instrument_bytes * instruments + usage.idle_bytes * orders;
+        std::printf("%-10s %16.1f %16.1f %16.1f %12.1f\n", name, usage.instrument_bytes, usage.active_bytes, usage.idle_bytes, total / 1048576);
+    }
+    double heap_total = heap.instrument_bytes * instruments + heap.idle_bytes * orders;
+    double compact_total = compact.instrument_bytes * instruments + compact.idle_bytes * orders;
+    std::printf("compact books use %.1fx less once idle, %.1fx less per order while active\n", heap_total / compact_total, heap.active_bytes / compact.active_bytes);
+    return 0;
+}
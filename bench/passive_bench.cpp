@@ -0,0 +1,74 @@
+// Passive quote throughput on one instrument, by thread count.
+// Usage: ./passive_bench [orders per thread]
+//
+// Every thread rests non-crossing buys and sells on the same book, either the
+// way the engine used to (side mutex, then initialOrderProcessing) or through
+// the fast path (rest_passive_order). Each order holds an Orderbook::Activity
+// as handle_command does. Output lines are not printed.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "../orderbook.h"
+
+namespace {
+
+void rest_locked(Orderbook& book, OrderIndex& ids, const std::string& side, uint32_t price, uint32_t id) {
+    Orderbook::Activity activity(book);
+    std::lock_guard<AsyncMutex> lock(book.side_mutex(side));
+    std::shared_ptr<RestingOrder> order = book.initialOrderProcessing(side, price, 1, id, 0, ids).second;
+    // What match_order does for an order that does not cross: pop the opposite top and add it back
+    std::string other_side = side == "buy" ? "sell" : "buy";
+    std::optional<std::shared_ptr<RestingOrder>> top = book.popTopOrder(other_side);
+    if (top.has_value()) {
+        book.insert_order_with_val(other_side, top.value());
+    }
+    book.finishOrderProcessing(side, price, 1);
+    order->set_order_ready();
+}
+
+void rest_fast(Orderbook& book, OrderIndex& ids, const std::string& side, uint32_t price, uint32_t id) {
+    Orderbook::Activity activity(book);
+    Orderbook::PassiveOrder passive = book.rest_passive_order(side, price, 1, id, 0, false, ids);
+    passive.order->set_order_ready();
+}
+
+using RestFn = void (*)(Orderbook&, OrderIndex&, const std::string&, uint32_t, uint32_t);
+
+// Million orders per second
+double run(RestFn rest, int threads, uint32_t per_thread) {
+    Orderbook book("BENCH");
+    OrderIndex ids;
+    std::vector<std::thread> workers;
+    auto start = std::chrono::steady_clock::now();
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t] {
+            for (uint32_t i = 0; i < per_thread; i++) {
+                uint32_t id = t * per_thread + i + 1;
+                bool buy = i % 2 == 0;
+                rest(book, ids, buy ? "buy" : "sell", buy ? 100 + i % 100 : 300 + i % 100, id);
+            }
+        });
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return threads * per_thread / seconds / 1e6;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    uint32_t per_thread = argc > 1 ? static_cast<uint32_t>(std::strtoul(argv[1], nullptr, 10)) : 100000;
+    std::printf("passive quotes on one instrument, million orders/s (%u hardware threads)\n", std::thread::hardware_concurrency());
+    std::printf("%-8s %12s %12s\n", "threads", "side mutex", "fast path");
+    for (int threads : {1, 2, 4, 8}) {
+        std::printf("%-8d %12.2f %12.2f\n", threads, run(rest_locked, threads, per_thread), run(rest_fast, threads, per_thread));
+    }
+    return 0;
+}
@@ -0,0 +1,89 @@
+// Compares the heap and flat price ladder side books.
+// Usage: ./sidebook_bench [price levels in band]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "../sidebook.h"
+
+namespace {
+
+constexpr uint32_t base_price = 10000;
+
+std::vector<std::shared_ptr<RestingOrder>> make_orders(size_t n, uint32_t band, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    std::vector<std::shared_ptr<RestingOrder>> orders;
+    orders.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+        uint32_t price = base_price + static_cast<uint32_t>(rng() % band);
+        orders.push_back(std::make_shared<RestingOrder>(i + 1, "BENCH", price, 1, "buy", static_cast<intmax_t>(i)));
+    }
+    return orders;
+}
+
+// Nanoseconds per operation for the fastest of a few runs
+double time_ns(size_t ops, const std::function<void()>& run) {
+    double best = 1e300;
+    for (int rep = 0; rep < 3; rep++) {
+        auto start = std::chrono::steady_clock::now();
+        run();
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        best = std::min(best, ns / ops);
+    }
+    return best;
+}
+
+// Push every order then drain the book
+double fill_and_drain(const std::function<std::unique_ptr<SideBook>()>& make, const std::vector<std::shared_ptr<RestingOrder>>& orders) {
+    return time_ns(orders.size() * 2, [&] {
+        std::unique_ptr<SideBook> book = make();
+        for (const std::shared_ptr<RestingOrder>& order : orders) {
+            book->push(order);
+        }
+        while (book->pop().has_value()) {
+        }
+    });
+}
+
+// Keep the book at a fixed depth: pop the top and push a new order, the way
+// matching pops resting orders while new ones keep arriving
+double churn(const std::function<std::unique_ptr<SideBook>()>& make, const std::vector<std::shared_ptr<RestingOrder>>& orders, size_t depth) {
+    return time_ns((orders.size() - depth) * 2, [&] {
+        std::unique_ptr<SideBook> book = make();
+        for (size_t i = 0; i < depth; i++) {
+            book->push(orders[i]);
+        }
+        for (size_t i = depth; i < orders.size(); i++) {
+            book->pop();
+            book->push(orders[i]);
+        }
+    });
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    uint32_t band = argc > 1 ? static_cast<uint32_t>(std::strtoul(argv[1], nullptr, 10)) : 256;
+    LadderConfig ladder {base_price, 1, band};
+    auto make_heap = [] { return std::unique_ptr<SideBook>(std::make_unique<HeapSideBook<BuyOrderComparator>>()); };
+    auto make_ladder = [ladder] { return std::unique_ptr<SideBook>(std::make_unique<LadderSideBook>(true, ladder)); };
+
+    std::printf("price band of %u levels, ns per push or pop\n", band);
+    std::printf("%-24s %10s %10s\n", "benchmark", "heap", "ladder");
+    for (size_t depth : {100, 10000, 200000}) {
+        std::vector<std::shared_ptr<RestingOrder>> orders = make_orders(depth, band, depth);
+        std::printf("%-24s %10.1f %10.1f\n", ("fill+drain " + std::to_string(depth)).c_str(),
+            fill_and_drain(make_heap, orders), fill_and_drain(make_ladder, orders));
+    }
+    std::vector<std::shared_ptr<RestingOrder>> orders = make_orders(1000000, band, 42);
+    for (size_t depth : {100, 10000, 200000}) {
+        std::printf("%-24s %10.1f %10.1f\n", ("churn depth " + std::to_string(depth)).c_str(),
+            churn(make_heap, orders, depth), churn(make_ladder, orders, depth));
+    }
+    return 0;
+}
@@ -0,0 +1,89 @@
+// Compares the heap and skiplist side books under concurrent inserts.
+// Usage: ./skiplist_bench [orders per thread]
+//
+// Each inserter thread pushes buys at its own band of prices into one side
+// book while a matcher thread keeps popping the top, the way resting orders
+// arrive on a busy instrument while it trades. Reports the insert rate and how
+// many pops the matcher got done in the same time.
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "../sidebook.h"
+#include "../skiplist.h"
+
+namespace {
+
+struct Result {
+    double inserts; // million per second
+    double pops;    // million per second
+};
+
+Result run(const std::function<std::unique_ptr<SideBook>()>& make, int threads, uint32_t per_thread) {
+    std::unique_ptr<SideBook> book = make();
+    std::vector<std::vector<std::shared_ptr<RestingOrder>>> orders(threads);
+    for (int t = 0; t < threads; t++) {
+        orders[t].reserve(per_thread);
+        for (uint32_t i = 0; i < per_thread; i++) {
+            uint32_t id = t * per_thread + i + 1;
+            orders[t].push_back(std::make_shared<RestingOrder>(id, "BENCH", 10000 + t * 64 + i % 64, 1, "buy", id));
+        }
+    }
+
+    std::atomic<int> running{threads};
+    std::atomic<bool> go{false};
+    uint64_t pops = 0;
+    std::thread matcher([&] {
+        while (!go.load(std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+        while (running.load(std::memory_order_acquire) > 0) {
+            if (book->pop().has_value()) {
+                pops++;
+            }
+        }
+    });
+    std::vector<std::thread> inserters;
+    for (int t = 0; t < threads; t++) {
+        inserters.emplace_back([&, t] {
+            while (!go.load(std::memory_order_acquire)) {
+                std::this_thread::yield();
+            }
+            for (std::shared_ptr<RestingOrder>& order : orders[t]) {
+                book->push(std::move(order));
+            }
+            running.fetch_sub(1, std::memory_order_release);
+        });
+    }
+    auto start = std::chrono::steady_clock::now();
+    go.store(true, std::memory_order_release);
+    for (std::thread& inserter : inserters) {
+        inserter.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    matcher.join();
+    return {threads * per_thread / seconds / 1e6, pops / seconds / 1e6};
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    uint32_t per_thread = argc > 1 ? static_cast<uint32_t>(std::strtoul(argv[1], nullptr, 10)) : 50000;
+    auto make_heap = [] { return std::unique_ptr<SideBook>(std::make_unique<HeapSideBook<BuyOrderComparator>>()); };
+    auto make_skiplist = [] { return std::unique_ptr<SideBook>(std::make_unique<SkipListSideBook>(true)); };
+
+    std::printf("inserters plus one matcher on one side book, million ops/s (%u hardware threads)\n", std::thread::hardware_concurrency());
+    std::printf("%-8s %12s %12s %12s %12s\n", "threads", "heap push", "heap pop", "skip push", "skip pop");
+    for (int threads : {1, 2, 4, 8, 16, 32}) {
+        Result heap = run(make_heap, threads, per_thread);
+        Result skiplist = run(make_skiplist, threads, per_thread);
+        std::printf("%-8d %12.2f %12.2f %12.2f %12.2f\n", threads, heap.inserts, heap.pops, skiplist.inserts, skiplist.pops);
+    }
+    return 0;
+}
@@ -0,0 +1,61 @@
+// Cost of the flight recorder on the paths it instruments.
+// Usage: ./trace_bench [iterations]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <mutex>
+
+#include "../flight_recorder.hpp"
+
+namespace {
+
+double ns_per_op(uint64_t iterations, const std::function<void()>& run) {
+    auto start = std::chrono::steady_clock::now();
+    run();
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / iterations;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    uint64_t iterations = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 20000000;
+    std::mutex mutex;
+    volatile uint64_t sink = 0;
+
+    std::printf("%-32s %10s\n", "operation", "ns/op");
+    std::printf("%-32s %10.2f\n", "trace clock read", ns_per_op(iterations, [&] {
+        for (uint64_t i = 0; i < iterations; i++) {
+            sink = sink + trace_clock();
+        }
+    }));
+    std::printf("%-32s %10.2f\n", "clock_gettime monotonic", ns_per_op(iterations, [&] {
+        for (uint64_t i = 0; i < iterations; i++) {
+            timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            sink = sink + ts.tv_nsec;
+        }
+    }));
+    std::printf("%-32s %10.2f\n", "record event", ns_per_op(iterations, [&] {
+        for (uint64_t i = 0; i < iterations; i++) {
+            FlightRecorder::record(trace_read_begin);
+        }
+    }));
+    std::printf("%-32s %10.2f\n", "command begin and end", ns_per_op(iterations, [&] {
+        for (uint64_t i = 0; i < iterations; i++) {
+            CommandTrace trace(static_cast<uint32_t>(i));
+        }
+    }));
+    std::printf("%-32s %10.2f\n", "lock_guard, uncontended", ns_per_op(iterations, [&] {
+        for (uint64_t i = 0; i < iterations; i++) {
+            std::lock_guard<std::mutex> lock(mutex);
+        }
+    }));
+    std::printf("%-32s %10.2f\n", "TracedLock, uncontended", ns_per_op(iterations, [&] {
+        for (uint64_t i = 0; i < iterations; i++) {
+            TracedLock<std::mutex> lock(mutex, trace_side_lock_wait);
+        }
+    }));
+    return 0;
+}
@@ -0,0 +1,191 @@
+// Compares order latency over the Unix socket and over a shared memory session.
+// Usage: ./transport_bench [engine binary] [orders]
+//
+// Sends one order at a time and waits for it to be handled before sending the
+// next. Latency is measured to the engine's stdout line for both transports,
+// and also to the event on the session's ring for shared memory. The engine is
+// started once per shared memory spin setting so both the busy-polling and the
+// futex-only paths are measured.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../shm_ring.hpp"
+
+namespace {
+
+struct Engine {
+    pid_t pid = -1;
+    FILE* out = nullptr;
+    std::string socket_path;
+};
+
+Engine start_engine(const char* binary, unsigned spins) {
+    Engine engine;
+    engine.socket_path = "/tmp/transport-bench-" + std::to_string(getpid()) + ".sock";
+    int pipefd[2];
+    if (pipe(pipefd) != 0) {
+        return engine;
+    }
+    std::string spins_arg = std::to_string(spins);
+    engine.pid = fork();
+    if (engine.pid == 0) {
+        dup2(pipefd[1], STDOUT_FILENO);
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDERR_FILENO);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        execl(binary, binary, "-p", spins_arg.c_str(), engine.socket_path.c_str(), static_cast<char*>(nullptr));
+        _exit(127);
+    }
+    close(pipefd[1]);
+    engine.out = fdopen(pipefd[0], "r");
+    return engine;
+}
+
+void stop_engine(Engine& engine) {
+    kill(engine.pid, SIGTERM);
+    waitpid(engine.pid, nullptr, 0);
+    fclose(engine.out);
+    unlink(engine.socket_path.c_str());
+}
+
+int connect_to(const std::string& path) {
+    for (int attempt = 0; attempt < 500; attempt++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr {};
+        addr.sun_family = AF_UNIX;
+        std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        if (connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) == 0) {
+            return fd;
+        }
+        close(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return -1;
+}
+
+// Alternating buys and sells at one price, so every order prints exactly one
+// line (an add or an execution) and the book never grows
+ClientCommand order(uint32_t id) {
+    ClientCommand cmd {};
+    cmd.type = id % 2 == 0 ? input_buy : input_sell;
+    cmd.order_id = id;
+    cmd.price = 100;
+    cmd.count = 1;
+    std::strncpy(cmd.instrument, "BENCH", sizeof(cmd.instrument) - 1);
+    return cmd;
+}
+
+double now_us() {
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void report(const char* name, std::vector<double> latencies) {
+    std::sort(latencies.begin(), latencies.end());
+    double mean = 0;
+    for (double l : latencies) {
+        mean += l;
+    }
+    mean /= latencies.size();
+    std::printf("%-32s %10.1f %10.1f %10.1f\n", name, latencies[latencies.size() / 2],
+        latencies[std::min(latencies.size() - 1, latencies.size() * 99 / 100)], mean);
+}
+
+bool read_line(FILE* in) {
+    char line[256];
+    return std::fgets(line, sizeof(line), in) != nullptr;
+}
+
+bool bench_socket(const Engine& engine, uint32_t orders, uint32_t first_id) {
+    int fd = connect_to(engine.socket_path);
+    if (fd == -1) {
+        return false;
+    }
+    std::vector<double> to_stdout;
+    for (uint32_t i = 0; i < orders; i++) {
+        ClientCommand cmd = order(first_id + i);
+        double start = now_us();
+        if (write(fd, &cmd, sizeof(cmd)) != sizeof(cmd) || !read_line(engine.out)) {
+            close(fd);
+            return false;
+        }
+        to_stdout.push_back(now_us() - start);
+    }
+    close(fd);
+    report("socket, to stdout", to_stdout);
+    return true;
+}
+
+bool bench_shm(const Engine& engine, uint32_t orders, uint32_t first_id, unsigned spins) {
+    int fd = connect_to(engine.socket_path);
+    ClientCommand request {};
+    request.type = input_session;
+    std::unique_ptr<ShmSession> session;
+    if (fd == -1 || write(fd, &request, sizeof(request)) != sizeof(request) || (session = ShmSession::attach(recv_fd(fd))) == nullptr) {
+        return false;
+    }
+    std::vector<double> to_stdout, to_event;
+    EngineEvent event;
+    for (uint32_t i = 0; i < orders; i++) {
+        ClientCommand cmd = order(first_id + i);
+        double start = now_us();
+        if (!session->commands.push(cmd, spins, -1) || !session->events.pop(event, spins, -1)) {
+            close(fd);
+            return false;
+        }
+        to_event.push_back(now_us() - start);
+        if (!read_line(engine.out)) {
+            close(fd);
+            return false;
+        }
+        to_stdout.push_back(now_us() - start);
+    }
+    session->commands.close();
+    close(fd);
+    std::string name = "shm spin " + std::to_string(spins);
+    report((name + ", to event").c_str(), to_event);
+    report((name + ", to stdout").c_str(), to_stdout);
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    const char* binary = argc > 1 ? argv[1] : "./engine";
+    uint32_t orders = argc > 2 ? static_cast<uint32_t>(std::strtoul(argv[2], nullptr, 10)) : 20000;
+    signal(SIGPIPE, SIG_IGN);
+
+    std::printf("%u orders sent one at a time, latency in us\n", orders);
+    std::printf("%-32s %10s %10s %10s\n", "transport", "p50", "p99", "mean");
+    uint32_t next_id = 1;
+    for (unsigned spins : {4096u, 0u}) {
+        Engine engine = start_engine(binary, spins);
+        if (engine.pid < 0) {
+            std::fprintf(stderr, "could not start %s\n", binary);
+            return 1;
+        }
+        bool ok = (spins == 0 || bench_socket(engine, orders, next_id)) && bench_shm(engine, orders, next_id + orders, spins);
+        next_id += 2 * orders;
+        stop_engine(engine);
+        if (!ok) {
+            std::fprintf(stderr, "engine %s stopped responding\n", binary);
+            return 1;
+        }
+    }
+    return 0;
+}
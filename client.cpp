@@ -11,12 +11,41 @@
 #include <sys/socket.h>
 
 #include <atomic>
+#include <memory>
 
 #include "io.hpp"
+#include "shm_ring.hpp"
 
 #define INPUT_CANCEL_ORDER 'C'
 #define INPUT_BUY_ORDER 'B'
 #define INPUT_SELL_ORDER 'S'
+#define INPUT_QUERY 'Q'
+#define INPUT_AUCTION 'A'
+
+// Parses the optional order flags after a new order: IOC, FOK, POST, STP or STP=<id>
+static bool parse_order_flags(char* rest, ClientCommand& input)
+{
+	for(char* token = strtok(rest, " \t\n"); token != NULL; token = strtok(NULL, " \t\n"))
+	{
+		unsigned stp_id;
+		if(strcmp(token, "IOC") == 0)
+			input.flags |= order_flag_ioc;
+		else if(strcmp(token, "FOK") == 0)
+			input.flags |= order_flag_fok;
+		else if(strcmp(token, "POST") == 0)
+			input.flags |= order_flag_post_only;
+		else if(strcmp(token, "STP") == 0)
+			input.flags |= order_flag_stp;
+		else if(sscanf(token, "STP=%u", &stp_id) == 1 && stp_id > 0 && stp_id <= UINT16_MAX)
+		{
+			input.flags |= order_flag_stp;
+			input.stp_id = (uint16_t) stp_id;
+		}
+		else
+			return false;
+	}
+	return true;
+}
 
 static char* line_buffer;
 static size_t line_buffer_size = 0;
@@ -48,11 +77,99 @@ static void* poll_thread(void* fdptr)
 	return 0;
 }
 
+// Prints an event in the engine's output format
+static void print_event(const EngineEvent& event)
+{
+	switch(event.kind)
+	{
+		case 'B':
+		case 'S':
+			printf("%c %u %s %u %lu %ld\n", event.kind, event.id, event.instrument, event.price, event.count, event.timestamp);
+			break;
+		case 'E':
+			printf("E %u %u %u %u %lu %ld\n", event.id, event.new_id, event.execution_id, event.price, event.count, event.timestamp);
+			break;
+		case 'X':
+		case 'R': printf("%c %u %c %ld\n", event.kind, event.id, event.detail, event.timestamp); break;
+		case 'Q':
+			printf("Q %s %u %lu %u %lu %ld\n", event.instrument, event.price, event.count, event.ask_price, event.ask_count, event.timestamp);
+			break;
+	}
+	fflush(stdout);
+}
+
+struct EventPrinterArgs
+{
+	ShmSession* session;
+	int fd;
+};
+
+// Prints the session's events until the engine closes the ring or the socket
+static void* event_printer_thread(void* argsptr)
+{
+	EventPrinterArgs* args = (EventPrinterArgs*) argsptr;
+	EngineEvent event;
+	while(true)
+	{
+		if(args->session->events.pop(event, 0, 100))
+		{
+			print_event(event);
+			continue;
+		}
+		if(args->session->events.closed())
+			break;
+		struct pollfd pfd {};
+		pfd.fd = args->fd;
+		pfd.events = POLLRDHUP;
+		if(poll(&pfd, 1, 0) != 0)
+		{
+			fprintf(stderr, "Connection closed by server\n");
+			_exit(0);
+		}
+	}
+	return 0;
+}
+
+// Prints the execution reports written back on the socket until the engine closes it
+static void* report_reader_thread(void* fdptr)
+{
+	int fd = (int) (long) fdptr;
+	EngineEvent event;
+	size_t have = 0;
+	while(true)
+	{
+		ssize_t n = read(fd, (char*) &event + have, sizeof(event) - have);
+		if(n <= 0)
+			break;
+		have += n;
+		if(have == sizeof(event))
+		{
+			print_event(event);
+			have = 0;
+		}
+	}
+	return 0;
+}
+
 int main(int argc, char* argv[])
 {
-	if(argc < 2)
+	bool use_shm = false;
+	bool use_reports = false;
+	int opt;
+	while((opt = getopt(argc, argv, "me")) != -1)
 	{
-		fprintf(stderr, "Usage: %s <path of socket to connect to> < <input>\n", argv[0]);
+		switch(opt)
+		{
+			case 'm': use_shm = true; break;
+			case 'e': use_reports = true; break;
+			default: optind = argc; break;
+		}
+	}
+	if(optind >= argc || (use_shm && use_reports))
+	{
+		fprintf(stderr, "Usage: %s [-m | -e] <path of socket to connect to> < <input>\n", argv[0]);
+		fprintf(stderr, "  -m  send commands over a shared memory ring and print the session's events\n");
+		fprintf(stderr, "  -e  ask for execution reports on the socket and print them\n");
 		return 1;
 	}
 
@@ -66,7 +183,7 @@ int main(int argc, char* argv[])
 	{
 		struct sockaddr_un sockaddr {};
 		sockaddr.sun_family = AF_UNIX;
-		strncpy(sockaddr.sun_path, argv[1], sizeof(sockaddr.sun_path) - 1);
+		strncpy(sockaddr.sun_path, argv[optind], sizeof(sockaddr.sun_path) - 1);
 		if(connect(clientfd, (const struct sockaddr*) &sockaddr, sizeof(sockaddr)) != 0)
 		{
 			perror("connect");
@@ -77,11 +194,51 @@ int main(int argc, char* argv[])
 	FILE* client = fdopen(clientfd, "r+");
 	setbuf(client, NULL);
 
-	pthread_t poll_thread_handle;
-	if(pthread_create(&poll_thread_handle, NULL, poll_thread, (void*) (long) clientfd) < 0)
+	std::unique_ptr<ShmSession> session;
+	EventPrinterArgs printer_args {};
+	pthread_t printer_thread_handle;
+	if(use_reports)
 	{
-		fprintf(stderr, "Failed to create poll thread\n");
-		return 1;
+		ClientCommand request {};
+		request.type = input_reports;
+		if(fwrite(&request, 1, sizeof(request), client) != sizeof(request))
+		{
+			fprintf(stderr, "Failed to ask for execution reports\n");
+			return 1;
+		}
+		if(pthread_create(&printer_thread_handle, NULL, report_reader_thread, (void*) (long) clientfd) != 0)
+		{
+			fprintf(stderr, "Failed to create report reader thread\n");
+			return 1;
+		}
+	}
+	else if(use_shm)
+	{
+		ClientCommand request {};
+		request.type = input_session;
+		request.count = ShmSession::default_capacity;
+		if(fwrite(&request, 1, sizeof(request), client) != sizeof(request)
+		    || (session = ShmSession::attach(recv_fd(clientfd))) == nullptr)
+		{
+			fprintf(stderr, "Failed to set up shared memory session\n");
+			return 1;
+		}
+		printer_args.session = session.get();
+		printer_args.fd = clientfd;
+		if(pthread_create(&printer_thread_handle, NULL, event_printer_thread, &printer_args) != 0)
+		{
+			fprintf(stderr, "Failed to create event printer thread\n");
+			return 1;
+		}
+	}
+	else
+	{
+		pthread_t poll_thread_handle;
+		if(pthread_create(&poll_thread_handle, NULL, poll_thread, (void*) (long) clientfd) < 0)
+		{
+			fprintf(stderr, "Failed to create poll thread\n");
+			return 1;
+		}
 	}
 
 	while(1)
@@ -104,20 +261,52 @@ int main(int argc, char* argv[])
 					return 1;
 				}
 				break;
+			case INPUT_QUERY:
+				input.type = input_query;
+				if(sscanf(line_buffer + 1, " %8s", input.instrument) != 1)
+				{
+					fprintf(stderr, "Invalid query: %s\n", line_buffer);
+					return 1;
+				}
+				break;
+			case INPUT_AUCTION:
+			{
+				char phase[8];
+				input.type = input_auction;
+				if(sscanf(line_buffer + 1, " %7s", phase) != 1 || (strcmp(phase, "CALL") != 0 && strcmp(phase, "CROSS") != 0))
+				{
+					fprintf(stderr, "Invalid auction command, expected A CALL or A CROSS: %s\n", line_buffer);
+					return 1;
+				}
+				input.count = strcmp(phase, "CALL") == 0;
+				break;
+			}
 			case INPUT_BUY_ORDER: input.type = input_buy; goto new_order;
 			case INPUT_SELL_ORDER:
 				input.type = input_sell;
 			new_order:
-				if(sscanf(line_buffer + 1, " %u %8s %u %u", &input.order_id, input.instrument, &input.price, &input.count) != 4)
+			{
+				int consumed = 0;
+				if(sscanf(line_buffer + 1, " %u %8s %u %u%n", &input.order_id, input.instrument, &input.price, &input.count, &consumed) != 4
+				    || !parse_order_flags(line_buffer + 1 + consumed, input))
 				{
 					fprintf(stderr, "Invalid new order: %s\n", line_buffer);
 					return 1;
 				}
 				break;
+			}
 			default: fprintf(stderr, "Invalid command '%c'\n", line_buffer[0]); return 1;
 		}
 
-		if(fwrite(&input, 1, sizeof(input), client) != sizeof(input))
+		if(session != nullptr)
+		{
+			if(!session->commands.push(input, 0, -1))
+			{
+				fprintf(stderr, "Failed to write command\n");
+				return 1;
+			}
+		}
+		else if(fwrite(&input, 1, sizeof(input), client) != sizeof(input))
 		{
 			fprintf(stderr, "Failed to write command\n");
 			return 1;
@@ -125,6 +314,18 @@ int main(int argc, char* argv[])
 	}
 
 	main_is_exiting = 1;
+	if(session != nullptr)
+	{
+		// The engine closes the event ring once it has handled every command
+		session->commands.close();
+		pthread_join(printer_thread_handle, NULL);
+	}
+	else if(use_reports)
+	{
+		// The engine closes its end once it has handled every command and sent their reports
+		shutdown(clientfd, SHUT_WR);
+		pthread_join(printer_thread_handle, NULL);
+	}
 	fclose(client);
 
 	return ferror(stderr) ? 1 : 0;
@@ -0,0 +1,230 @@
+#include <algorithm>
+#include "compact_book.h"
+
+CompactSideBook::CompactSideBook(bool is_buy, const std::string& instrument, CompactLevels levels)
+        : is_buy(is_buy), instrument(instrument), levels(std::move(levels)) {}
+
+bool CompactSideBook::worse(uint32_t a, uint32_t b) const {
+    return this->is_buy ? a < b : a > b;
+}
+
+CompactLevels::iterator CompactSideBook::find_level(uint32_t price) {
+    return std::lower_bound(this->levels.begin(), this->levels.end(), price,
+        [this](const CompactLevel& level, uint32_t p) { return this->worse(level.price, p); });
+}
+
+std::shared_ptr<RestingOrder> CompactSideBook::materialize(uint32_t price, const CompactOrder& record) const {
+    std::shared_ptr<RestingOrder> order = std::make_shared<RestingOrder>(record.order_id, this->instrument, price, record.count,
+        this->is_buy ? "buy" : "sell", record.timestamp, record.stp_key, record.owner);
+    order->set_next_execution_id(record.execution_id);
+    order->set_order_ready();
+    return order;
+}
+
+CompactOrder* CompactSideBook::front_locked() {
+    while (!this->levels.empty()) {
+        CompactLevel& level = this->levels.back();
+        if (level.head == level.orders.size()) {
+            this->levels.pop_back();
+            continue;
+        }
+        CompactOrder& record = level.orders[level.head];
+        if (record.hot && this->hot.find(record.order_id) == this->hot.end()) {
+            this->pop_front_locked();
+            continue;
+        }
+        return &record;
+    }
+    return nullptr;
+}
+
+void CompactSideBook::pop_front_locked() {
+    CompactLevel& level = this->levels.back();
+    level.head++;
+    if (level.head == level.orders.size()) {
+        this->levels.pop_back();
+    } else if (level.head >= 64 && level.head * 2 >= level.orders.size()) {
+        // Reclaim popped records of a level that never drains
+        level.orders.erase(level.orders.begin(), level.orders.begin() + level.head);
+        level.head = 0;
+    }
+}
+
+CompactOrder* CompactSideBook::find_record_locked(uint32_t price, intmax_t timestamp, uint32_t order_id, bool hot) {
+    auto level = this->find_level(price);
+    if (level == this->levels.end() || level->price != price) {
+        return nullptr;
+    }
+    auto pos = std::lower_bound(level->orders.begin() + level->head, level->orders.end(), timestamp,
+        [](const CompactOrder& o, intmax_t t) { return o.timestamp < t; });
+    for (; pos != level->orders.end() && pos->timestamp == timestamp; pos++) {
+        if (pos->order_id == order_id && (pos->hot != 0) == hot) {
+            return &*pos;
+        }
+    }
+    return nullptr;
+}
+
+void CompactSideBook::push(std::shared_ptr<RestingOrder> order) {
+    uint32_t price = order->get_price();
+    intmax_t timestamp = order->get_timestamp();
+    uint32_t order_id = order->get_order_id();
+    std::lock_guard<std::mutex> lock(this->mut);
+    auto it = this->find_level(price);
+    if (it == this->levels.end() || it->price != price) {
+        it = this->levels.insert(it, CompactLevel {price, 0, {}});
+    }
+    CompactLevel& level = *it;
+    if (level.head == level.orders.size()) {
+        level.orders.clear();
+        level.head = 0;
+    }
+    // The rest of the placeholder is filled in when the order is swept back
+    CompactOrder placeholder {timestamp, order_id, 0, 0, 0, 0, 1};
+    if (level.orders.size() == level.head || level.orders.back().timestamp < timestamp) {
+        level.orders.push_back(placeholder);
+    } else if (level.head > 0 && level.orders[level.head].timestamp > timestamp) {
+        // Orders that were popped and are being added back go in front
+        level.orders[--level.head] = placeholder;
+    } else {
+        auto pos = std::upper_bound(level.orders.begin() + level.head, level.orders.end(), timestamp,
+            [](intmax_t t, const CompactOrder& o) { return t < o.timestamp; });
+        level.orders.insert(pos, placeholder);
+    }
+    this->hot[order_id] = {std::move(order), true};
+    if (this->hot.size() >= this->sweep_at) {
+        this->sweep_locked();
+    }
+}
+
+// A cold top record becomes an object that stays in the book
+std::shared_ptr<RestingOrder> CompactSideBook::top_locked() {
+    CompactOrder* record = this->front_locked();
+    if (record == nullptr) {
+        return nullptr;
+    }
+    if (record->hot) {
+        return this->hot[record->order_id].order;
+    }
+    std::shared_ptr<RestingOrder> order = this->materialize(this->levels.back().price, *record);
+    record->hot = 1;
+    this->hot[record->order_id] = {order, true};
+    return order;
+}
+
+std::optional<std::shared_ptr<RestingOrder>> CompactSideBook::top() {
+    std::lock_guard<std::mutex> lock(this->mut);
+    std::shared_ptr<RestingOrder> order = this->top_locked();
+    if (order == nullptr) {
+        return std::nullopt;
+    }
+    return order;
+}
+
+std::optional<std::shared_ptr<RestingOrder>> CompactSideBook::pop() {
+    std::lock_guard<std::mutex> lock(this->mut);
+    std::shared_ptr<RestingOrder> order = this->top_locked();
+    if (order == nullptr) {
+        return std::nullopt;
+    }
+    this->hot[order->get_order_id()].in_book = false;
+    this->pop_front_locked();
+    return order;
+}
+
+void CompactSideBook::pop_if_deleted(intmax_t curr_timestamp) {
+    std::lock_guard<std::mutex> lock(this->mut);
+    CompactOrder* record = this->front_locked();
+    // Cold records are never deleted
+    if (record == nullptr || !record->hot) {
+        return;
+    }
+    Hot& entry = this->hot[record->order_id];
+    intmax_t deleted_timestamp = entry.order->get_deleted_timestamp();
+    if (deleted_timestamp >= 0 && deleted_timestamp <= curr_timestamp) {
+        entry.in_book = false;
+        this->pop_front_locked();
+    }
+}
+
+std::shared_ptr<RestingOrder> CompactSideBook::find_order(uint32_t order_id, uint32_t price, intmax_t timestamp) {
+    std::lock_guard<std::mutex> lock(this->mut);
+    auto found = this->hot.find(order_id);
+    if (found != this->hot.end()) {
+        return found->second.order;
+    }
+    CompactOrder* record = this->find_record_locked(price, timestamp, order_id, false);
+    if (record == nullptr) {
+        return nullptr;
+    }
+    std::shared_ptr<RestingOrder> order = this->materialize(price, *record);
+    record->hot = 1;
+    this->hot[order_id] = {order, true};
+    return order;
+}
+
+void CompactSideBook::forget_order(uint32_t order_id) {
+    std::lock_guard<std::mutex> lock(this->mut);
+    this->hot.erase(order_id);
+}
+
+/*
+Objects that something other than the hot map holds are left alone, no other
+thread can get hold of one while mut is held. Popped and deleted orders are
+dropped, deleted ones leaving a forgotten placeholder. Orders still waiting to
+be ready are kept until their command is done.
+*/
+void CompactSideBook::sweep_locked() {
+    for (auto it = this->hot.begin(); it != this->hot.end();) {
+        Hot& entry = it->second;
+        if (entry.order.use_count() != 1) {
+            it++;
+            continue;
+        }
+        RestingOrder& order = *entry.order;
+        if (!entry.in_book || order.get_deleted_timestamp() >= 0 || order.get_count() == 0) {
+            it = this->hot.erase(it);
+            continue;
+        }
+        if (!order.is_order_ready()) {
+            it++;
+            continue;
+        }
+        CompactOrder* record = this->find_record_locked(order.get_price(), order.get_timestamp(), it->first, true);
+        if (record == nullptr) {
+            it++;
+            continue;
+        }
+        *record = {order.get_timestamp(), it->first, order.get_count(), order.get_stp_key(), order.get_owner(), order.next_execution_id(), 0};
+        it = this->hot.erase(it);
+    }
+    this->sweep_at = std::max<size_t>(64, this->hot.size() * 2);
+}
+
+void CompactSideBook::settle() {
+    std::lock_guard<std::mutex> lock(this->mut);
+    this->sweep_locked();
+}
+
+bool CompactSideBook::settled() {
+    std::lock_guard<std::mutex> lock(this->mut);
+    this->sweep_locked();
+    return this->hot.empty();
+}
+
+CompactLevels CompactSideBook::release() {
+    std::lock_guard<std::mutex> lock(this->mut);
+    CompactLevels kept;
+    for (CompactLevel& level : this->levels) {
+        // Nothing is hot any more, so hot records are forgotten placeholders
+        auto end = std::remove_if(level.orders.begin() + level.head, level.orders.end(), [](const CompactOrder& o) { return o.hot != 0; });
+        if (end == level.orders.begin() + level.head) {
+            continue;
+        }
+        CompactLevel& trimmed = kept.emplace_back(CompactLevel {level.price, 0, {}});
+        trimmed.orders.assign(level.orders.begin() + level.head, end);
+    }
+    kept.shrink_to_fit();
+    this->levels.clear();
+    return kept;
+}
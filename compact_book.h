@@ -0,0 +1,90 @@
+#ifndef COMPACT_BOOK_H
+#define COMPACT_BOOK_H
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "sidebook.h"
+
+// A resting order that no command is using, as a plain record
+struct CompactOrder {
+    intmax_t timestamp;
+    uint32_t order_id;
+    uint32_t count;
+    uint32_t stp_key;
+    uint32_t owner;
+    uint32_t execution_id; // the next one the order hands out
+    uint32_t hot;          // non-zero if the order lives in a RestingOrder instead, see CompactSideBook
+};
+static_assert(sizeof(CompactOrder) == 32, "two records to a cache line");
+
+// One price level's records in time priority, those before head have been popped
+struct CompactLevel {
+    uint32_t price;
+    uint32_t head = 0;
+    std::vector<CompactOrder> orders;
+};
+
+// A side's levels from the worst price to the best, so the best level is at the back
+using CompactLevels = std::vector<CompactLevel>;
+
+/*
+Side book for instruments with many resting orders that rarely trade.
+A RestingOrder with its locks and condition variable is several hundred bytes,
+so orders nobody is using are kept as 32 byte records in per level arrays.
+Commands still get RestingOrder objects: popping or finding a record builds one,
+and orders pushed by commands stay objects. While an order is an object its
+record is a placeholder marked hot, and the object is kept in the hot map.
+Sweeps write objects that only the hot map holds back into their records.
+A hot record whose object was forgotten belongs to a deleted order and is
+skipped, as matching skips deleted orders.
+*/
+class CompactSideBook : public SideBook {
+private:
+    struct Hot {
+        std::shared_ptr<RestingOrder> order;
+        bool in_book; // false once popped, until pushed back
+    };
+
+    const bool is_buy;
+    const std::string& instrument;
+    CompactLevels levels;
+    std::unordered_map<uint32_t, Hot> hot;
+    size_t sweep_at = 64;
+    std::mutex mut;
+
+    bool worse(uint32_t a, uint32_t b) const;
+    CompactLevels::iterator find_level(uint32_t price);
+    std::shared_ptr<RestingOrder> materialize(uint32_t price, const CompactOrder& record) const;
+    // Best record that is not a forgotten placeholder, dropping the ones in front of it. Must hold mut
+    CompactOrder* front_locked();
+    void pop_front_locked();
+    // order_id's record at price, found by its timestamp as a level is in time priority. Must hold mut
+    CompactOrder* find_record_locked(uint32_t price, intmax_t timestamp, uint32_t order_id, bool hot);
+    std::shared_ptr<RestingOrder> top_locked();
+    void sweep_locked();
+public:
+    // instrument must outlive the side book
+    CompactSideBook(bool is_buy, const std::string& instrument, CompactLevels levels = {});
+
+    void push(std::shared_ptr<RestingOrder> order) override;
+    std::optional<std::shared_ptr<RestingOrder>> top() override;
+    std::optional<std::shared_ptr<RestingOrder>> pop() override;
+    void pop_if_deleted(intmax_t curr_timestamp) override;
+
+    // Every order in the book can be found, objects are only tracked while hot
+    void track_order(std::shared_ptr<RestingOrder>) override {}
+    std::shared_ptr<RestingOrder> find_order(uint32_t order_id, uint32_t price, intmax_t timestamp) override;
+    void forget_order(uint32_t order_id) override;
+    void settle() override;
+
+    // Sweeps, then whether every order is back in its record
+    bool settled();
+    // Hands over the records, trimmed to size. Only once settled, with no command using the book.
+    CompactLevels release();
+};
+
+#endif
@@ -1,149 +1,722 @@
+#include <algorithm>
+#include <fstream>
 #include <iostream>
+#include <map>
+#include <shared_mutex>
+#include <sstream>
 #include <thread>
 
 #include "io.hpp"
 #include "engine.hpp"
+#include "shm_ring.hpp"
+
+bool EngineConfig::load_ladders(const std::string& path)
+{
+	std::ifstream file(path);
+	if (!file) {
+		return false;
+	}
+	std::string line;
+	while (std::getline(file, line)) {
+		if (line.empty() || line[0] == '#') {
+			continue;
+		}
+		std::istringstream fields(line);
+		std::string instrument;
+		LadderConfig ladder {};
+		if (!(fields >> instrument >> ladder.base >> ladder.tick >> ladder.levels) || ladder.tick == 0 || ladder.levels == 0) {
+			SyncCerr {} << "Invalid ladder config line: " << line << std::endl;
+			return false;
+		}
+		this->ladders[instrument] = ladder;
+	}
+	return true;
+}
+
+Engine::Engine(EngineConfig config) : config(std::move(config)), call_period(false), auction_pool(this->config.auction_threads)
+{
+	if (this->config.stats_interval_ms > 0) {
+		std::thread(&Engine::report_admission, this).detach();
+	}
+	if (this->config.idle_book_ms > 0) {
+		std::thread(&Engine::shrink_idle_books, this).detach();
+	}
+	Output::print_stdout = this->config.print_stdout;
+	FlightRecorder::instance().configure(this->config.trace_path, this->config.trace_window_ms, this->config.trace_threshold_us);
+	if (this->config.workers > 0) {
+		// A task's execution reports go out whenever it gives up its worker, not only once its command is done
+		this->scheduler = std::make_unique<Scheduler>(this->config.workers, &ReportSession::flush_dirty);
+	}
+}
+
+bool Engine::listen_for_followers()
+{
+	this->replicator = Replicator::listen(this->config.replication_path, this->config.replication_log_limit);
+	if (this->replicator == nullptr) {
+		return false;
+	}
+	Output::before_event = &await_replication;
+	return true;
+}
+
+void Engine::open_call_period()
+{
+	ClientCommand command {};
+	command.type = input_auction;
+	command.count = 1;
+	this->call_period = true;
+	intmax_t timestamp = getCurrentTimestamp();
+	if (this->replicator != nullptr) {
+		this->replicator->append({timestamp, command, 0, 0});
+	}
+	SyncCerr {} << "Call period started at timestamp " << timestamp << std::endl;
+}
+
+/*
+Replays the primary's commands in timestamp order through handle_command on this
+thread alone. The engine's output is the same as handling its commands one at a
+time in timestamp order, so the books end up the same as the primary's.
+Records arrive in timestamp order, one behind a gap waits here until the gap
+is replayed. When the primary goes away, records after a gap are dropped.
+A gap the primary should have filled long ago means the stream lost a record,
+and a primary that closed the stream but still listens dropped this follower.
+Either way these books are not the primary's, so the follower gives up.
+*/
+bool Engine::follow()
+{
+	std::unique_ptr<ReplicationStream> stream = ReplicationStream::connect(this->config.follow_path, 10000);
+	if (stream == nullptr) {
+		return false;
+	}
+	// Standby output would duplicate the primary's
+	Output::print_stdout = this->config.print_stdout && this->config.print_replay;
+	// Records waiting behind a gap before the follower gives up on it, 48 MB of them
+	constexpr size_t max_replay_gap = 1 << 20;
+	std::map<int64_t, ReplicationRecord> early;
+	int64_t next = 0;
+	bool stuck = false;
+	// handle_command leaves thread locals behind, keep them off the caller's thread, which exits from a signal handler
+	std::thread replayer([&] {
+		TokenBucket unlimited(0, 1);
+		std::vector<ReplicationRecord> records;
+		while (stream->read(records)) {
+			for (const ReplicationRecord& record : records) {
+				early.emplace(record.timestamp, record);
+			}
+			for (auto it = early.begin(); it != early.end() && it->first == next; it = early.erase(it), next++) {
+				this->replay(it->second, unlimited);
+			}
+			// The primary appends in timestamp order, so nothing should wait here for long
+			if (early.size() > max_replay_gap) {
+				stuck = true;
+				return;
+			}
+		}
+	});
+	replayer.join();
+	if (stuck) {
+		SyncCerr {} << "Follower diverged from the primary, timestamp " << next << " never arrived and "
+		            << early.size() << " later commands are waiting for it" << std::endl;
+		return false;
+	}
+	if (ReplicationStream::connect(this->config.follow_path, 0) != nullptr) {
+		SyncCerr {} << "Primary dropped this follower at timestamp " << next << " and is still running" << std::endl;
+		return false;
+	}
+	timestamp.store(next);
+	Output::print_stdout = this->config.print_stdout;
+	SyncCerr {} << "Primary gone, taking over at timestamp " << next << ", " << early.size() << " commands after a gap dropped" << std::endl;
+	return true;
+}
+
+void Engine::replay(const ReplicationRecord& record, TokenBucket& unlimited)
+{
+	// Later connections must not share a self-trade prevention key with the primary's
+	if (record.session_key >= this->next_session_key) {
+		this->next_session_key = record.session_key + 1;
+	}
+	timestamp.store(record.timestamp);
+	if (record.rejected != 0) {
+		// The primary's admission control rejected it, only the timestamp is taken
+		intmax_t rejected_at = getCurrentTimestamp();
+		if (this->replicator != nullptr) {
+			this->replicator->append(record);
+		}
+		Output::OrderRejected(record.command.order_id, static_cast<RejectReason>(record.rejected), rejected_at);
+		return;
+	}
+	this->handle_command(record.command, record.session_key, unlimited).run();
+	if (command_timestamp != record.timestamp) {
+		SyncCerr {} << "Follower diverged from the primary at timestamp " << record.timestamp << std::endl;
+	}
+}
+
+void Engine::report_admission()
+{
+	while (true) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(this->config.stats_interval_ms));
+		std::ostringstream depths;
+		this->orderbooks.for_each([&depths](const std::string& instrument, Orderbook& orderbook) {
+			uint32_t depth = orderbook.queue_depth.load(std::memory_order_relaxed);
+			if (depth > 0) {
+				depths << " " << instrument << "=" << depth;
+			}
+		});
+		SyncCerr {}
+		    << "admission: admitted " << this->admission.admitted.load(std::memory_order_relaxed)
+		    << " throttled " << this->admission.throttled.load(std::memory_order_relaxed)
+		    << " shed " << this->admission.shed.load(std::memory_order_relaxed)
+		    << " max depth " << this->admission.max_queue_depth.load(std::memory_order_relaxed)
+		    << " depth" << (depths.str().empty() ? " 0" : depths.str()) << std::endl;
+	}
+}
+
+void Engine::shrink_idle_books()
+{
+	while (true) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(this->config.idle_book_ms));
+		this->orderbooks.for_each([](const std::string&, Orderbook& orderbook) { orderbook.shrink_if_idle(); });
+	}
+}
+
+std::optional<LadderConfig> Engine::ladder_for(const std::string& instrument) const
+{
+	auto it = this->config.ladders.find(instrument);
+	if (it == this->config.ladders.end()) {
+		return std::nullopt;
+	}
+	return it->second;
+}
 
 void Engine::accept(ClientConnection connection)
 {
-	auto thread = std::thread(&Engine::connection_thread, this, std::move(connection));
+	if (this->scheduler != nullptr) {
+		this->scheduler->spawn(this->serve_connection(std::move(connection)));
+		return;
+	}
+	auto thread = std::thread([this, connection = std::move(connection)]() mutable { this->serve_connection(std::move(connection)).run(); });
 	thread.detach();
 }
 
-void Engine::connection_thread(ClientConnection connection)
+std::optional<BestBidOffer> Engine::get_bbo(const std::string& instrument)
+{
+	std::shared_ptr<Orderbook> orderbook = this->orderbooks.get(instrument);
+	if (orderbook == nullptr) {
+		return std::nullopt;
+	}
+	return orderbook->get_bbo();
+}
+
+/*
+Ends a call period. Every book is uncrossed at the auction command's timestamp,
+split across the pool since no book depends on another. Called with the auction
+gate held exclusively, so nothing else is using the books.
+*/
+void Engine::uncross(intmax_t timestamp)
+{
+	std::vector<Orderbook*> books;
+	this->orderbooks.for_each([&books](const std::string&, Orderbook& orderbook) { books.push_back(&orderbook); });
+	this->auction_pool.parallel_for(books.size(), [&](size_t i) { this->uncross_book(*books[i], timestamp); });
+}
+
+void Engine::uncross_book(Orderbook& orderbook, intmax_t timestamp)
 {
+	thread_local std::vector<AuctionFill> fills;
+	thread_local std::vector<Execution> executions;
+	// Keeps the owners' sessions alive until their reports are flushed
+	thread_local std::vector<std::shared_ptr<ReportSession>> owners;
+	if (orderbook.empty_stub()) {
+		return;
+	}
+	Orderbook::Activity activity(orderbook);
+	fills.clear();
+	ClearingPrice clearing = orderbook.uncross(timestamp, fills, this->idToOrder);
+	if (fills.empty()) {
+		return;
+	}
+	executions.clear();
+	for (const AuctionFill& fill : fills) {
+		std::shared_ptr<ReportSession> resting_owner = this->report_session(fill.earlier->get_owner());
+		std::shared_ptr<ReportSession> new_owner = this->report_session(fill.later->get_owner());
+		executions.push_back({fill.earlier->get_order_id(), fill.later->get_order_id(), fill.execution_id, clearing.price, fill.count, resting_owner.get(), new_owner.get()});
+		owners.push_back(std::move(resting_owner));
+		owners.push_back(std::move(new_owner));
+	}
+	Output::OrdersExecuted(executions.data(), executions.size(), timestamp);
+	// Pool threads run no command that would flush these later. Flushes never block,
+	// so a client that stops reading does not hold up the auction.
+	ReportSession::flush_dirty();
+	owners.clear();
+	fills.clear();
+}
+
+// Owner 0 is an order whose connection did not ask for reports
+std::shared_ptr<ReportSession> Engine::report_session(uint32_t owner)
+{
+	return owner != 0 ? this->reportSessions.get(owner) : nullptr;
+}
+
+/*
+Match an incoming order against the other side of the book at its timestamp.
+Must hold the incoming order's side mutex. Returns the unfilled count.
+Resting orders that were popped but not used are added back before returning.
+*/
+Task<uint32_t> Engine::match_order(Orderbook& orderbook, const ClientCommand& input, const std::string& side, intmax_t timestamp, uint32_t stp_key)
+{
+	std::string other_side = side == "buy" ? "sell" : "buy";
+	bool stp = input.flags & order_flag_stp;
+	std::vector<std::shared_ptr<RestingOrder>> orders_to_add_back;
+
+	uint32_t count_left = input.count;
+	// Try to fill orders
+	while (count_left > 0) {
+		std::optional<std::shared_ptr<RestingOrder>> optional = orderbook.popTopOrder(other_side);
+		if (!optional.has_value()) {
+			// No available resting orders
+			break;
+		}
+		std::shared_ptr<RestingOrder> other_ptr = optional.value();
+
+		intmax_t deleted_timestamp = other_ptr -> get_deleted_timestamp();
+		if (deleted_timestamp >= 0 && deleted_timestamp < timestamp) {
+			continue;
+		}
+
+		if (other_ptr->get_timestamp() > timestamp) {
+			// Ignore and replace any orders that have a greater timestamp as this represents an order that would be added after this order
+			orders_to_add_back.emplace_back(other_ptr);
+			if ((side == "buy" && other_ptr -> get_price() > input.price) || (side == "sell" && other_ptr -> get_price() < input.price)) {
+				break; // No resting orders can fill this order
+			}
+			continue;
+		}
+		if ((side == "buy" && other_ptr -> get_price() > input.price) || (side == "sell" && other_ptr -> get_price() < input.price)) {
+			orders_to_add_back.emplace_back(other_ptr);
+			break; // No resting orders can fill this order
+		}
+
+		// Check if order is ready, if not wait as this means there is another concurrent opp order with lower timestamp with a good price that should be matched
+		co_await other_ptr->ready();
+
+		// Order can be used
+		uint32_t other_count = other_ptr->get_count();
+		if (other_count == 0) {
+			continue;
+		}
+		if (stp && other_ptr->get_stp_key() == stp_key) {
+			// Self-trade prevention cancels the resting order instead of trading with it
+			other_ptr -> delete_order(timestamp);
+			orderbook.forget(other_side, other_ptr->get_order_id(), this->idToOrder);
+			orderbook.remove_level_quantity(other_side, other_ptr->get_price(), other_count);
+			Output::OrderDeleted(other_ptr->get_order_id(), true, timestamp, this->report_session(other_ptr->get_owner()).get());
+			continue;
+		}
+		if (count_left < other_count) {
+			orders_to_add_back.push_back(other_ptr);
+			// Update count of resting order
+			other_ptr -> decrease_count(count_left);
+			orderbook.remove_level_quantity(other_side, other_ptr->get_price(), count_left);
+			// Check the parameter names in `io.hpp`.
+			Output::OrderExecuted(other_ptr->get_order_id(), input.order_id, other_ptr->get_execution_id(), other_ptr->get_price(), count_left, timestamp, this->report_session(other_ptr->get_owner()).get());
+			count_left = 0;
+			continue;
+		}
+		// Execute using full resting order
+		// We set deleted_timestamp
+		other_ptr -> delete_order(timestamp);
+		orderbook.forget(other_side, other_ptr->get_order_id(), this->idToOrder);
+		orderbook.remove_level_quantity(other_side, other_ptr->get_price(), other_count);
+		// Check the parameter names in `io.hpp`.
+		Output::OrderExecuted(other_ptr->get_order_id(), input.order_id, other_ptr->get_execution_id(), other_ptr->get_price(), other_count, timestamp, this->report_session(other_ptr->get_owner()).get());
+		count_left -= other_count;
+	}
+
+	// Add back any orders that should be added back
+	for (std::shared_ptr<RestingOrder> order_ptr : orders_to_add_back) {
+		orderbook.insert_order_with_val(other_side, order_ptr);
+	}
+	co_return count_left;
+}
+
+// Thread locals of the command a connection's task is handling
+class CommandContext : public TaskContext
+{
+private:
+	intmax_t timestamp = -1;
+	EventSink* sink = nullptr;
+	uint32_t traced_order = 0;
+	ReplicatedCommand* replicated = nullptr;
+
+public:
+	void save() override
+	{
+		this->timestamp = command_timestamp;
+		this->sink = Output::sink;
+		this->traced_order = FlightRecorder::traced_order();
+		this->replicated = replicated_command;
+	}
+
+	void restore() override
+	{
+		command_timestamp = this->timestamp;
+		Output::sink = this->sink;
+		FlightRecorder::set_traced_order(this->traced_order);
+		replicated_command = this->replicated;
+	}
+};
+
+/*
+Reads and handles a connection's commands one at a time. With a scheduler this
+is a task on its workers that suspends while the socket has nothing to read and
+while a command waits, and a few workers serve every connection. Without one it
+runs on the connection's own thread and those waits block the thread.
+*/
+Task<void> Engine::serve_connection(ClientConnection connection)
+{
+	// Default self-trade prevention key, above any client supplied stp_id
+	uint32_t session_key = this->next_session_key++;
+	double burst = this->config.rate_burst > 0 ? this->config.rate_burst : std::max(this->config.rate_limit, 1.0);
+	TokenBucket rate_limit(this->config.rate_limit, burst);
+	std::shared_ptr<ReportSession> reports;
+	bool first = true;
+	CommandContext context;
+	current_task_context = &context;
+	Output::sink = nullptr;
+
 	while(true)
 	{
 		ClientCommand input {};
-		switch(connection.readInput(input))
-		{
-			case ReadResult::Error: SyncCerr {} << "Error reading input" << std::endl;
-			case ReadResult::EndOfFile: return;
-			case ReadResult::Success: break;
-		}
-
-		// Functions for printing output actions in the prescribed format are
-		// provided in the Output class:
-		switch(input.type)
-		{
-			case input_cancel: {
-				SyncCerr {} << "Got cancel: ID: " << input.order_id << std::endl;
-				if (!this->idToOrder.exists(input.order_id)) {
-					Output::OrderDeleted(input.order_id, false, getCurrentTimestamp());
+		FlightRecorder::record(trace_read_begin);
+		ReadResult result = connection.tryReadInput(input);
+		while (result == ReadResult::WouldBlock) {
+			co_await Scheduler::readable(connection.handle());
+			result = connection.tryReadInput(input);
+		}
+		if (result != ReadResult::Success) {
+			if (result == ReadResult::Error) {
+				SyncCerr {} << "Error reading input" << std::endl;
+			}
+			break;
+		}
+
+		if (input.type == input_session) {
+			if (this->scheduler == nullptr) {
+				// The socket only stays open to notice the client going away
+				this->serve_shm_session(connection, input, session_key, rate_limit);
+				break;
+			}
+			// Rings are polled by a thread of their own rather than a worker
+			this->scheduler->forget(connection.handle());
+			std::thread([this, connection = std::move(connection), input, session_key, rate_limit]() mutable {
+				this->serve_shm_session(connection, input, session_key, rate_limit);
+			}).detach();
+			break;
+		}
+		if (std::exchange(first, false) && input.type == input_reports) {
+			int fd = connection.duplicateHandle();
+			if (fd == -1) {
+				SyncCerr {} << "Could not set up execution reports" << std::endl;
+				break;
+			}
+			reports = std::make_shared<ReportSession>(fd);
+			this->reportSessions.insert(session_key, reports);
+			Output::sink = reports.get();
+			continue;
+		}
+		if (this->delayed_by_rate_limit(input)) {
+			// Before handle_command holds the auction gate, so only this connection waits
+			co_await rate_limit.take();
+		}
+		co_await this->handle_command(input, session_key, rate_limit, reports != nullptr ? session_key : 0);
+		// A connection that always has a command waiting must not keep a worker to itself
+		co_await Scheduler::yield();
+	}
+
+	if (reports != nullptr) {
+		// Executions of orders still resting are no longer reported, the socket closes once in-flight flushes finish
+		this->reportSessions.erase(session_key);
+		Output::sink = nullptr;
+	}
+	if (this->scheduler != nullptr && connection.handle() != -1) {
+		this->scheduler->forget(connection.handle());
+	}
+	current_task_context = nullptr;
+}
+
+// Cancels and queries are never throttled, they only ever reduce load
+bool Engine::delayed_by_rate_limit(const ClientCommand& input) const
+{
+	return !this->config.reject_over_rate && (input.type == input_buy || input.type == input_sell);
+}
+
+// Buffers a session's events while its command runs, they go to its ring once the command has let go of every lock
+class ShmEventSink : public EventSink
+{
+private:
+	ShmSession& session;
+	ClientConnection& connection;
+	unsigned spins;
+	bool client_gone = false;
+	std::vector<EngineEvent> pending;
+
+public:
+	ShmEventSink(ShmSession& session, ClientConnection& connection, unsigned spins) : session(session), connection(connection), spins(spins) {}
+
+	void publish(const EngineEvent& event) override
+	{
+		if (!this->client_gone) {
+			this->pending.push_back(event);
+		}
+	}
+
+	// A slow client holds up its own session only, but a dead one must not hold it forever
+	void flush()
+	{
+		for (const EngineEvent& event : this->pending) {
+			while (!this->client_gone && !this->session.events.push(event, this->spins, 100)) {
+				this->client_gone = this->connection.peerClosed();
+			}
+		}
+		this->pending.clear();
+	}
+};
+
+void Engine::serve_shm_session(ClientConnection& connection, const ClientCommand& request, uint32_t session_key, TokenBucket& rate_limit)
+{
+	std::unique_ptr<ShmSession> session = ShmSession::create(request.count);
+	if (session == nullptr || !connection.sendFd(session->file())) {
+		SyncCerr {} << "Could not set up shared memory session" << std::endl;
+		return;
+	}
+	ShmEventSink sink(*session, connection, this->config.shm_spins);
+	Output::sink = &sink;
+
+	ClientCommand input;
+	while (true) {
+		FlightRecorder::record(trace_read_begin);
+		if (session->commands.pop(input, this->config.shm_spins, 100)) {
+			if (this->delayed_by_rate_limit(input)) {
+				rate_limit.take().run();
+			}
+			this->handle_command(input, session_key, rate_limit).run();
+			sink.flush();
+		} else if (session->commands.closed() || connection.peerClosed()) {
+			break;
+		}
+	}
+	Output::sink = nullptr;
+	session->events.close();
+}
+
+/*
+Handles one command. It is a task so that it can suspend where it would wait
+on another command: the auction gate, a side mutex or a resting order that is
+not ready yet. Off a scheduler's workers those waits block and it is run inline.
+*/
+Task<void> Engine::handle_command(const ClientCommand& input, uint32_t session_key, TokenBucket& rate_limit, uint32_t report_owner)
+{
+	CommandTrace trace(input.order_id);
+	command_timestamp = -1;
+	// Commands that take no timestamp did nothing a follower needs to see
+	ReplicatedCommand replicated {this->replicator.get(), {-1, input, session_key, 0}};
+	replicated_command = this->replicator != nullptr ? &replicated : nullptr;
+	co_await this->auction_gate.lock_shared_async();
+	std::shared_lock<AuctionGate> command_lock(this->auction_gate, std::adopt_lock);
+	// Functions for printing output actions in the prescribed format are
+	// provided in the Output class:
+	switch(input.type)
+	{
+		case input_session: {
+			SyncCerr {} << "Session already uses shared memory" << std::endl;
+			break;
+		}
+		case input_reports: {
+			SyncCerr {} << "Execution reports must be requested by the first command" << std::endl;
+			break;
+		}
+		case input_auction: {
+			command_lock.unlock();
+			co_await this->auction_gate.lock_async();
+			std::lock_guard<AuctionGate> auction_lock(this->auction_gate, std::adopt_lock);
+			intmax_t timestamp = getCurrentTimestamp();
+			// The pool threads print the uncross without this command's record to wait for
+			await_replication();
+			if (input.count != 0) {
+				this->call_period = true;
+				SyncCerr {} << "Call period started at timestamp " << timestamp << std::endl;
+			} else {
+				this->uncross(timestamp);
+				this->call_period = false;
+				SyncCerr {} << "Uncrossed at timestamp " << timestamp << std::endl;
+			}
+			break;
+		}
+		case input_cancel: {
+			SyncCerr {} << "Got cancel: ID: " << input.order_id << std::endl;
+			std::optional<OrderLocation> location = this->idToOrder.find(input.order_id);
+			if (!location.has_value()) {
+				Output::OrderDeleted(input.order_id, false, getCurrentTimestamp());
+				break;
+			}
+			Orderbook& orderbook = *location->book;
+			Orderbook::Activity activity(orderbook);
+			std::string side = location->is_buy ? "buy" : "sell";
+			std::shared_ptr<RestingOrder> order = orderbook.find_order(side, location->price, location->timestamp, input.order_id);
+			if (order == nullptr) {
+				// Filled or cancelled since it was looked up
+				Output::OrderDeleted(input.order_id, false, getCurrentTimestamp());
+				break;
+			}
+			co_await order->ready();
+
+			// If order is a Buy, should not execute with a concurrent Sell as Sells may use up this Buy
+			std::unique_lock<AsyncMutex> order_side_lock = co_await orderbook.side_mutex(location->is_buy ? "sell" : "buy").lock_async(trace_side_lock_wait);
+
+			intmax_t timestamp = getCurrentTimestamp();
+			intmax_t delete_timestamp = order->get_deleted_timestamp();
+			if (delete_timestamp >= 0 && delete_timestamp < timestamp) {
+				Output::OrderDeleted(input.order_id, false, timestamp);
+			} else {
+				order->delete_order(timestamp);
+				orderbook.remove_level_quantity(side, order->get_price(), order->get_count());
+				orderbook.forget(side, input.order_id, this->idToOrder);
+				Output::OrderDeleted(input.order_id, true, timestamp, this->report_session(order->get_owner()).get());
+			}
+			break;
+		}
+		case input_query: {
+			BestBidOffer bbo = this->get_bbo(input.instrument).value_or(BestBidOffer {});
+			Output::TopOfBook(input.instrument, bbo.bid_price, bbo.bid_count, bbo.ask_price, bbo.ask_count, getCurrentTimestamp());
+			break;
+		}
+		default: {
+			SyncCerr {}
+			    << "Got order: " << static_cast<char>(input.type) << " " << input.instrument << " x " << input.count << " @ "
+			    << input.price << " ID: " << input.order_id << std::endl;
+
+			std::string side = input.type == CommandType::input_buy ? "buy" : "sell";
+			std::string other_side = side == "buy" ? "sell" : "buy";
+			uint8_t flags = input.flags;
+			uint32_t stp_key = input.stp_id != 0 ? input.stp_id : session_key;
+
+			if (!valid_order_flags(flags)) {
+				Output::OrderRejected(input.order_id, reject_invalid_flags, getCurrentTimestamp());
+				break;
+			}
+
+			// Orders over the rate limit were delayed before this unless they are rejected instead
+			if (this->config.reject_over_rate && !rate_limit.try_take()) {
+				this->admission.throttled.fetch_add(1, std::memory_order_relaxed);
+				replicated.record.rejected = reject_throttled;
+				Output::OrderRejected(input.order_id, reject_throttled, getCurrentTimestamp());
+				break;
+			}
+
+			if (!this->orderbooks.exists(input.instrument)) {
+				this->orderbooks.insert_if_not_exist(input.instrument, this->ladder_for(input.instrument), this->config.skiplist_books, this->config.compact_books);
+			}
+
+			std::shared_ptr<Orderbook> orderbook_ptr = this->orderbooks.get(input.instrument);
+
+			// Bound the orders waiting on this book's locks so a hot instrument sheds load instead of queueing it
+			AdmissionTicket ticket(orderbook_ptr->queue_depth, this->config.max_queue_depth, this->admission);
+			if (!ticket) {
+				replicated.record.rejected = reject_queue_full;
+				Output::OrderRejected(input.order_id, reject_queue_full, getCurrentTimestamp());
+				break;
+			}
+			Orderbook::Activity activity(*orderbook_ptr);
+
+			if (this->call_period) {
+				// Nothing trades until the uncross, so orders that only take liquidity have nothing to do
+				if (flags & (order_flag_ioc | order_flag_fok)) {
+					Output::OrderRejected(input.order_id, reject_auction, getCurrentTimestamp());
 					break;
 				}
-				std::shared_ptr<RestingOrder> order = this->idToOrder.get(input.order_id);
-				order->check_order_ready_or_wait();
-
-				// If order is a Buy, should not execute with a concurrent Sell as Sells may use up this Buy
-				std::shared_ptr orderbook = this->orderbooks.get(order->get_instrument());
-				std::lock_guard<std::mutex> order_side_lock(order->get_side() == "buy" ? orderbook->sellMutex : orderbook->buyMutex);
-
-				intmax_t timestamp = getCurrentTimestamp();
-				intmax_t delete_timestamp = order->get_deleted_timestamp();
-				if (delete_timestamp >= 0 && delete_timestamp < timestamp) {
-					Output::OrderDeleted(input.order_id, false, timestamp);
-				} else {
-					order->delete_order(timestamp);
-					Output::OrderDeleted(input.order_id, true, timestamp);
-				}
+				Orderbook::PassiveOrder passive = orderbook_ptr->rest_call_order(side, input.price, input.count, input.order_id, stp_key, this->idToOrder, report_owner);
+				Output::OrderAdded(input.order_id, input.instrument, input.price, input.count, input.type == input_sell, passive.timestamp);
+				passive.order->set_order_ready();
 				break;
 			}
-			default: {
-				SyncCerr {}
-				    << "Got order: " << static_cast<char>(input.type) << " " << input.instrument << " x " << input.count << " @ "
-				    << input.price << " ID: " << input.order_id << std::endl;
 
-				std::string side = input.type == CommandType::input_buy ? "buy" : "sell";
-				std::string other_side = side == "buy" ? "sell" : "buy";
-
-				if (!this->orderbooks.exists(input.instrument)) {
-					this->orderbooks.insert_if_not_exist(input.instrument);
+			if (flags & order_flag_post_only) {
+				Orderbook::PassiveOrder passive = orderbook_ptr->rest_passive_order(side, input.price, input.count, input.order_id, stp_key, false, this->idToOrder, report_owner);
+				if (passive.outcome == Orderbook::PassiveOrder::crosses) {
+					// Levels are only exact once both sides have stopped matching. Always buy then sell, so two of these cannot deadlock.
+					std::unique_lock<AsyncMutex> buy_lock = co_await orderbook_ptr->side_mutex("buy").lock_async(trace_side_lock_wait);
+					std::unique_lock<AsyncMutex> sell_lock = co_await orderbook_ptr->side_mutex("sell").lock_async(trace_side_lock_wait);
+					passive = orderbook_ptr->rest_passive_order(side, input.price, input.count, input.order_id, stp_key, true, this->idToOrder, report_owner);
+				}
+				if (passive.outcome == Orderbook::PassiveOrder::rejected) {
+					Output::OrderRejected(input.order_id, reject_post_only, passive.timestamp);
+					break;
 				}
+				Output::OrderAdded(input.order_id, input.instrument, input.price, input.count, input.type == input_sell, passive.timestamp);
+				passive.order->set_order_ready();
+				break;
+			}
 
-				std::shared_ptr<Orderbook> orderbook_ptr = this->orderbooks.get(input.instrument);
-				
-				// Lock rest of same side orders
-				std::lock_guard<std::mutex> order_side_lock(side == "buy" ? orderbook_ptr->buyMutex : orderbook_ptr->sellMutex);
-
-				// Perform initial processing sequentially
-				std::pair<intmax_t, std::shared_ptr<RestingOrder>> pair = orderbook_ptr->initialOrderProcessing(side, input.price, input.count, input.order_id, this->idToOrder);
-				intmax_t timestamp = pair.first;
-				std::shared_ptr<RestingOrder> initial_order = pair.second;
-
-				std::vector<std::shared_ptr<RestingOrder>> orders_to_add_back;
-
-				int64_t count_left = input.count;
-				// Try to fill orders
-				while (count_left > 0) {
-					std::optional<std::shared_ptr<RestingOrder>> optional = orderbook_ptr->popTopOrder(other_side);
-					if (optional.has_value()) {
-						std::shared_ptr<RestingOrder> other_ptr = optional.value();
-
-						intmax_t deleted_timestamp = other_ptr -> get_deleted_timestamp();
-						if (deleted_timestamp >= 0 && deleted_timestamp < timestamp) {
-							continue;
-						}
-
-
-						if (other_ptr->get_timestamp() > timestamp) {
-							// Ignore and replace any orders that have a greater timestamp as this represents an order that would be added after this order
-							orders_to_add_back.emplace_back(other_ptr);
-							if ((side == "buy" && other_ptr -> get_price() > input.price) || (side == "sell" && other_ptr -> get_price() < input.price)) {
-								break; // No resting orders can fill this order
-							}
-							continue;
-						}
-						if ((side == "buy" && other_ptr -> get_price() > input.price) || (side == "sell" && other_ptr -> get_price() < input.price)) {
-							orders_to_add_back.emplace_back(other_ptr);
-							break; // No resting orders can fill this order
-						}
-
-						// Check if order is ready, if not wait as this means there is another concurrent opp order with lower timestamp with a good price that should be matched
-						other_ptr->check_order_ready_or_wait();
-
-						// Order can be used
-						uint32_t other_count = other_ptr->get_count();
-						if (other_count == 0) {
-							continue;
-						}
-						if (count_left < other_count) {
-							orders_to_add_back.push_back(other_ptr);
-							// Update count of resting order
-							other_ptr -> decrease_count(count_left);
-							// Check the parameter names in `io.hpp`.
-							Output::OrderExecuted(other_ptr->get_order_id(), input.order_id, other_ptr->get_execution_id(), other_ptr->get_price(), count_left, timestamp);
-							count_left = 0;
-							continue;
-						}
-						// Execute using full resting order
-						// We set deleted_timestamp
-						other_ptr -> delete_order(timestamp);
-						// Check the parameter names in `io.hpp`.
-						Output::OrderExecuted(other_ptr->get_order_id(), input.order_id, other_ptr->get_execution_id(), other_ptr->get_price(), other_ptr->get_count(), timestamp);
-						count_left -= other_ptr->get_count();
-						continue;
-					} else {
-						// No available resting orders
-						break;
-					}
+			if (flags & order_flag_fok) {
+				// The depth check needs the opposite side's levels to be exact, so stop both sides from matching
+				std::unique_lock<AsyncMutex> buy_lock = co_await orderbook_ptr->side_mutex("buy").lock_async(trace_side_lock_wait);
+				std::unique_lock<AsyncMutex> sell_lock = co_await orderbook_ptr->side_mutex("sell").lock_async(trace_side_lock_wait);
+				// Depth check against the aggregated levels, the book is untouched if it fails
+				auto [timestamp, fillable] = orderbook_ptr->reserveFillOrKillTimestamp(other_side, input.price, input.count);
+				if (!fillable) {
+					Output::OrderDeleted(input.order_id, true, timestamp);
+					break;
 				}
+				co_await this->match_order(*orderbook_ptr, input, side, timestamp, stp_key);
+				break;
+			}
 
-				if (count_left > 0) {
-					Output::OrderAdded(input.order_id, input.instrument, input.price, count_left, input.type == input_sell, timestamp);
-				} else {
-					initial_order->delete_order(timestamp);
+			if (!(flags & order_flag_ioc)) {
+				// Orders priced away from the market rest without waiting for the side mutex
+				Orderbook::PassiveOrder passive = orderbook_ptr->rest_passive_order(side, input.price, input.count, input.order_id, stp_key, false, this->idToOrder, report_owner);
+				if (passive.outcome == Orderbook::PassiveOrder::rested) {
+					Output::OrderAdded(input.order_id, input.instrument, input.price, input.count, input.type == input_sell, passive.timestamp);
+					passive.order->set_order_ready();
+					break;
 				}
-				initial_order->set_count(count_left);
-				// Update initial_order to ready and notify and waiting threads
-				initial_order->set_order_ready();
+			}
 
-				// Add back any orders that should be added back
-				for (std::shared_ptr<RestingOrder> order_ptr : orders_to_add_back) {
-					orderbook_ptr->insert_order_with_val(other_side, order_ptr);
+			// Lock rest of same side orders
+			std::unique_lock<AsyncMutex> order_side_lock = co_await orderbook_ptr->side_mutex(side).lock_async(trace_side_lock_wait);
+
+			if (flags & order_flag_ioc) {
+				// Never rests, so it is not put in the book or in idToOrder
+				intmax_t timestamp = orderbook_ptr->reserveTimestamp();
+				uint32_t count_left = co_await this->match_order(*orderbook_ptr, input, side, timestamp, stp_key);
+				if (count_left > 0) {
+					Output::OrderDeleted(input.order_id, true, timestamp);
 				}
 				break;
 			}
+
+			// Perform initial processing sequentially
+			std::pair<intmax_t, std::shared_ptr<RestingOrder>> pair = orderbook_ptr->initialOrderProcessing(side, input.price, input.count, input.order_id, stp_key, this->idToOrder, report_owner);
+			intmax_t timestamp = pair.first;
+			std::shared_ptr<RestingOrder> initial_order = pair.second;
+
+			uint32_t count_left = co_await this->match_order(*orderbook_ptr, input, side, timestamp, stp_key);
+
+			if (count_left > 0) {
+				Output::OrderAdded(input.order_id, input.instrument, input.price, count_left, input.type == input_sell, timestamp);
+			} else {
+				initial_order->delete_order(timestamp);
+				orderbook_ptr->forget(side, input.order_id, this->idToOrder);
+			}
+			orderbook_ptr->finishOrderProcessing(side, input.price, count_left);
+			initial_order->set_count(count_left);
+			// Update initial_order to ready and notify and waiting threads
+			initial_order->set_order_ready();
+			break;
 		}
 	}
+	if (command_lock.owns_lock()) {
+		command_lock.unlock();
+	}
+	// Every lock taken above has been released, a slow client only holds up this thread
+	ReportSession::flush_dirty();
+	replicated_command = nullptr;
 }
@@ -5,26 +5,163 @@
 #define ENGINE_HPP
 
 #include <chrono>
+#include <optional>
+#include "admission.hpp"
 #include "io.hpp"
 #include "ts_orderbook_hashmap.hpp"
 #include "orderbook.h"
+#include "replication.h"
+#include "report_session.h"
+#include "scheduler.hpp"
+#include "thread_pool.hpp"
 #include <string>
+#include <thread>
+#include <unordered_map>
+
+struct EngineConfig
+{
+	// Instruments that use a flat price ladder instead of a heap
+	std::unordered_map<std::string, LadderConfig> ladders;
+
+	// Reads "INSTRUMENT BASE TICK LEVELS" lines, returns false if the file is malformed
+	bool load_ladders(const std::string& path);
+	// Other instruments use the concurrent skiplist side book instead of a heap
+	bool skiplist_books = false;
+	// Other instruments keep resting orders as compact records, and keep them while idle
+	bool compact_books = false;
+	// Books unused for this long shrink to a stub until their next order or cancel, 0 never shrinks them
+	unsigned idle_book_ms = 1000;
+
+	// Orders per second each connection may send, 0 means unlimited
+	double rate_limit = 0;
+	// Orders a connection may send at once after being idle, 0 means one second's worth
+	double rate_burst = 0;
+	// Reject orders over the rate limit instead of delaying the connection until they fit
+	bool reject_over_rate = false;
+	// Orders an instrument admits at once before rejecting, 0 means unbounded
+	uint32_t max_queue_depth = 0;
+	// Period of the admission counter report on stderr, 0 disables it
+	unsigned stats_interval_ms = 0;
+
+	// Times a shared memory session polls its ring before sleeping on the futex.
+	// Polling only pays off if the other side is running on another CPU.
+	unsigned shm_spins = std::thread::hardware_concurrency() > 1 ? 4096 : 0;
+
+	// Print events on stdout, off when every client takes its execution reports
+	bool print_stdout = true;
+
+	// Worker threads that run connections as tasks, 0 gives each connection a thread of its own
+	unsigned workers = 0;
+
+	// Threads that uncross instruments in parallel, counting the auction command's own
+	unsigned auction_threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+	// Followers connect here for the command stream, empty disables replication
+	std::string replication_path;
+	// Followers can join until this many commands have been replicated, the primary keeps them all until then (48 bytes each)
+	size_t replication_log_limit = 1 << 20;
+	// Replay this primary's stream until it goes away before serving clients, empty starts as primary
+	std::string follow_path;
+	// A follower prints the events of the commands it replays, to check them against the primary's
+	bool print_replay = false;
+
+	// Flight recorder dumps go to trace_path.1, trace_path.2 ..., empty disables dumps
+	std::string trace_path;
+	// How far back a dump goes, bounded by the per thread ring size
+	unsigned trace_window_ms = 10000;
+	// Dump when a command takes longer than this, 0 only dumps on SIGUSR1
+	unsigned trace_threshold_us = 0;
+};
 
 struct Engine
 {
 public:
+	explicit Engine(EngineConfig config = {});
+
 	void accept(ClientConnection conn);
 
+	// Best bid/offer for co-located callers, never blocks on the book's matching locks.
+	// Returns nullopt for instruments that have not traded yet.
+	std::optional<BestBidOffer> get_bbo(const std::string& instrument);
+
+	const AdmissionStats& admission_stats() const { return this->admission; }
+
+	// Starts streaming handled commands to followers on config.replication_path, false if it cannot listen
+	bool listen_for_followers();
+
+	// Keeps the books identical to config.follow_path's primary until it goes away, then
+	// takes over its sequence. Returns false if the primary could not be reached, or if this
+	// follower fell out of step with a primary and must not take over.
+	bool follow();
+
+	// Starts a call period before any client connects, for an opening auction. It is
+	// replicated like an auction command, so a follower's books rest orders the same way.
+	void open_call_period();
+
 private:
+	EngineConfig config;
 	ts_orderbook_hashmap<std::string, Orderbook> orderbooks;
-	ts_orderbook_hashmap<uint32_t, RestingOrder> idToOrder;
-	void connection_thread(ClientConnection conn);
+	// Where each resting order is, for cancels
+	OrderIndex idToOrder;
+	std::atomic<uint32_t> next_session_key{1 << 16};
+	// Connections that asked for execution reports, by session key
+	ts_orderbook_hashmap<uint32_t, ReportSession> reportSessions;
+	AdmissionStats admission;
+	std::unique_ptr<Replicator> replicator;
+	// Held shared by every command, auction commands hold it exclusively
+	AuctionGate auction_gate;
+	// Orders rest without matching until the next uncross, only changed by auction commands
+	bool call_period;
+	ThreadPool auction_pool;
+	// Runs connections when config.workers is set
+	std::unique_ptr<Scheduler> scheduler;
+	void report_admission();
+	void shrink_idle_books();
+	Task<void> serve_connection(ClientConnection conn);
+	// Whether input waits for a rate limit token before it is handled, rather than being rejected in handle_command
+	bool delayed_by_rate_limit(const ClientCommand& input) const;
+	Task<void> handle_command(const ClientCommand& input, uint32_t session_key, TokenBucket& rate_limit, uint32_t report_owner = 0);
+	std::shared_ptr<ReportSession> report_session(uint32_t owner);
+	void replay(const ReplicationRecord& record, TokenBucket& unlimited);
+	void serve_shm_session(ClientConnection& conn, const ClientCommand& request, uint32_t session_key, TokenBucket& rate_limit);
+	Task<uint32_t> match_order(Orderbook& orderbook, const ClientCommand& input, const std::string& side, intmax_t timestamp, uint32_t stp_key);
+	void uncross(intmax_t timestamp);
+	void uncross_book(Orderbook& orderbook, intmax_t timestamp);
+	std::optional<LadderConfig> ladder_for(const std::string& instrument) const;
 };
 
 inline std::atomic<intmax_t> timestamp{0};
 
+// The timestamp this thread's current command took, -1 until it takes one
+inline thread_local intmax_t command_timestamp = -1;
+
+// The command this thread is handling, while the engine streams to followers
+struct ReplicatedCommand
+{
+	Replicator* replicator;
+	ReplicationRecord record;
+	uint64_t sequence = 0; // its place in the stream once it took its timestamp
+	bool sent = false;
+};
+inline thread_local ReplicatedCommand* replicated_command = nullptr;
+
+// A replicated command is appended to the stream as it takes its timestamp
 inline intmax_t getCurrentTimestamp() {
-	return timestamp++;
+	ReplicatedCommand* command = replicated_command;
+	if (command != nullptr && command->sequence == 0) {
+		command->sequence = command->replicator->append(command->record, [] { return timestamp++; });
+		return command_timestamp = command->record.timestamp;
+	}
+	return command_timestamp = timestamp++;
+}
+
+// Output::before_event while replicating, the command's first event waits until its record was sent
+inline void await_replication() {
+	ReplicatedCommand* command = replicated_command;
+	if (command != nullptr && command->sequence != 0 && !command->sent) {
+		command->replicator->wait_sent(command->sequence);
+		command->sent = true;
+	}
 }
 
 #endif
@@ -0,0 +1,150 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include "flight_recorder.hpp"
+#include "io.hpp"
+
+namespace {
+
+double elapsed_ns(const timespec& from, const timespec& to) {
+    return (to.tv_sec - from.tv_sec) * 1e9 + (to.tv_nsec - from.tv_nsec);
+}
+
+} // namespace
+
+FlightRecorder::FlightRecorder() : start_tick(trace_clock()) {
+    clock_gettime(CLOCK_MONOTONIC, &this->start_time);
+}
+
+// Never destroyed, detached connection threads keep recording until exit
+FlightRecorder& FlightRecorder::instance() {
+    static FlightRecorder* recorder = new FlightRecorder();
+    return *recorder;
+}
+
+FlightRecorder::RingOwner::~RingOwner() {
+    if (local_ring != nullptr) {
+        local_ring->in_use.store(false, std::memory_order_release);
+        local_ring = nullptr;
+    }
+}
+
+// Rings are never freed, a thread that exits leaves its ring and what is in it for the next one
+FlightRecorder::Ring* FlightRecorder::claim_ring() {
+    static thread_local RingOwner owner;
+    (void) owner;
+    FlightRecorder& recorder = instance();
+    for (Ring* r = recorder.rings.load(std::memory_order_acquire); r != nullptr; r = r->next) {
+        bool expected = false;
+        if (!r->in_use.load(std::memory_order_relaxed) && r->in_use.compare_exchange_strong(expected, true)) {
+            local_ring = r;
+            return r;
+        }
+    }
+    Ring* r = new Ring();
+    r->in_use.store(true, std::memory_order_relaxed);
+    r->index = recorder.ring_count.fetch_add(1, std::memory_order_relaxed);
+    r->next = recorder.rings.load(std::memory_order_relaxed);
+    while (!recorder.rings.compare_exchange_weak(r->next, r, std::memory_order_release, std::memory_order_relaxed)) {
+    }
+    local_ring = r;
+    return r;
+}
+
+// Measured against the monotonic clock since the recorder was created
+double FlightRecorder::ticks_per_ns() const {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t tick = trace_clock();
+    double ns = elapsed_ns(this->start_time, now);
+    return ns > 0 ? (tick - this->start_tick) / ns : 1;
+}
+
+void FlightRecorder::configure(std::string path, unsigned window_ms, unsigned threshold_us) {
+    this->dump_path = std::move(path);
+    this->window_ms = window_ms;
+    this->threshold_us = threshold_us;
+    if (!this->dump_path.empty()) {
+        std::thread(&FlightRecorder::dump_thread, this).detach();
+    }
+}
+
+void FlightRecorder::dump_thread() {
+    auto last_dump = std::chrono::steady_clock::now() - std::chrono::milliseconds(this->window_ms);
+    while (true) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        if (this->threshold_us > 0) {
+            this->threshold_ticks.store(static_cast<uint64_t>(this->threshold_us * 1000.0 * this->ticks_per_ns()), std::memory_order_relaxed);
+        }
+        uint32_t reason = pending_dump.exchange(dump_none, std::memory_order_relaxed);
+        if (reason == dump_none) {
+            continue;
+        }
+        // A burst of slow commands would otherwise rewrite the same window over and over
+        auto now = std::chrono::steady_clock::now();
+        if (reason == dump_threshold && now - last_dump < std::chrono::milliseconds(this->window_ms)) {
+            continue;
+        }
+        last_dump = now;
+        std::string path = this->dump_path + "." + std::to_string(++this->dumps);
+        if (this->dump(path, static_cast<TraceDumpReason>(reason))) {
+            SyncCerr {} << "flight recorder: dumped last " << this->window_ms << "ms to " << path
+                        << (reason == dump_signal ? " on signal" : " after a slow command") << std::endl;
+        } else {
+            SyncCerr {} << "flight recorder: could not write " << path << std::endl;
+        }
+    }
+}
+
+bool FlightRecorder::dump(const std::string& path, TraceDumpReason reason) {
+    TraceFileHeader header {};
+    std::memcpy(header.magic, "FLTREC1", 8);
+    header.ticks_per_ns = this->ticks_per_ns();
+    header.dump_tick = trace_clock();
+    header.reason = reason;
+    uint64_t window_ticks = static_cast<uint64_t>(this->window_ms * 1e6 * header.ticks_per_ns);
+    uint64_t oldest_tick = header.dump_tick > window_ticks ? header.dump_tick - window_ticks : 0;
+
+    std::vector<std::pair<TraceRingHeader, std::vector<TraceEvent>>> copies;
+    for (Ring* r = this->rings.load(std::memory_order_acquire); r != nullptr; r = r->next) {
+        uint64_t head = r->head.load(std::memory_order_acquire);
+        uint64_t first = head > ring_capacity ? head - ring_capacity : 0;
+        std::vector<TraceEvent> events;
+        events.reserve(head - first);
+        for (uint64_t i = first; i < head; i++) {
+            const Slot& slot = r->slots[i & (ring_capacity - 1)];
+            uint64_t tag = slot.tag.load(std::memory_order_relaxed);
+            events.push_back({slot.tick.load(std::memory_order_relaxed), static_cast<uint32_t>(tag), static_cast<uint16_t>(tag >> 32), 0});
+        }
+        // Slots the writer may have reused while they were copied
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t head_after = r->head.load(std::memory_order_relaxed);
+        uint64_t valid_from = head_after >= ring_capacity ? head_after - ring_capacity + 1 : 0;
+        size_t skip = valid_from > first ? valid_from - first : 0;
+        std::vector<TraceEvent> kept;
+        for (size_t i = std::min(skip, events.size()); i < events.size(); i++) {
+            if (events[i].tick >= oldest_tick) {
+                kept.push_back(events[i]);
+            }
+        }
+        if (!kept.empty()) {
+            copies.push_back({{r->index, static_cast<uint32_t>(kept.size())}, std::move(kept)});
+        }
+    }
+    header.rings = copies.size();
+
+    std::string tmp = path + ".tmp";
+    FILE* file = std::fopen(tmp.c_str(), "wb");
+    if (file == nullptr) {
+        return false;
+    }
+    bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+    for (const auto& [ring_header, events] : copies) {
+        ok = ok && std::fwrite(&ring_header, sizeof(ring_header), 1, file) == 1
+            && std::fwrite(events.data(), sizeof(TraceEvent), events.size(), file) == events.size();
+    }
+    ok = std::fclose(file) == 0 && ok;
+    return ok && std::rename(tmp.c_str(), path.c_str()) == 0;
+}
@@ -0,0 +1,195 @@
+#ifndef FLIGHT_RECORDER_HPP
+#define FLIGHT_RECORDER_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Where a command is in the engine. Waits come in pairs, the wait stage is
+// stamped when a thread starts blocking and the next stage when it stops, and
+// both are only stamped if the thread actually had to block.
+enum TraceStage : uint16_t {
+    trace_read_begin,       // connection starts reading its next command
+    trace_read_done,        // command decoded, starts the command's trace
+    trace_side_lock_wait,   // buyMutex/sellMutex
+    trace_side_locked,
+    trace_book_lock_wait,   // incoming_order_mutex
+    trace_book_locked,
+    trace_ready_wait,       // check_order_ready_or_wait
+    trace_ready_done,
+    trace_output_wait,      // SyncCout::mut
+    trace_output_locked,
+    trace_log_wait,         // SyncCerr::mut
+    trace_log_locked,
+    trace_done,             // command handled
+    trace_stage_count,
+};
+
+// Dump file layout: a header, then per ring a ring header and its events, oldest first
+struct TraceFileHeader {
+    char magic[8];       // "FLTREC1"
+    double ticks_per_ns; // trace clock rate
+    uint64_t dump_tick;  // trace clock when the dump was taken
+    uint32_t reason;     // TraceDumpReason
+    uint32_t rings;
+};
+
+struct TraceRingHeader {
+    uint32_t ring;
+    uint32_t events;
+};
+
+struct TraceEvent {
+    uint64_t tick;
+    uint32_t order_id;
+    uint16_t stage;
+    uint16_t reserved;
+};
+
+enum TraceDumpReason : uint32_t {
+    dump_none,
+    dump_signal,
+    dump_threshold,
+};
+
+// Time stamp counter where there is one, which needs an invariant TSC to be
+// comparable across cores. Monotonic nanoseconds elsewhere.
+inline uint64_t trace_clock() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+// Always on recorder of where commands spend their time.
+// Every thread writes to its own ring, so recording is a clock read and two
+// relaxed stores. The dump thread reads rings while they are being written and
+// drops any slot that may have been overwritten during the copy.
+class FlightRecorder {
+public:
+    static constexpr uint32_t ring_capacity = 1 << 15;
+
+private:
+    struct Slot {
+        std::atomic<uint64_t> tick{0};
+        std::atomic<uint64_t> tag{0}; // order id, stage in the upper half
+    };
+    struct Ring {
+        alignas(64) std::atomic<uint64_t> head{0}; // events ever written
+        std::atomic<bool> in_use{false};
+        uint32_t index = 0;
+        Ring* next = nullptr;
+        std::unique_ptr<Slot[]> slots{new Slot[ring_capacity]};
+    };
+    // Gives a thread's ring back when the thread exits
+    struct RingOwner {
+        ~RingOwner();
+    };
+
+    inline static thread_local Ring* local_ring = nullptr;
+    inline static thread_local uint32_t local_order = 0;
+    inline static std::atomic<uint32_t> pending_dump{dump_none};
+
+    std::atomic<Ring*> rings{nullptr};
+    std::atomic<uint32_t> ring_count{0};
+    std::string dump_path;
+    unsigned window_ms = 10000;
+    std::atomic<uint64_t> threshold_ticks{UINT64_MAX}; // set once the clock is calibrated
+    unsigned threshold_us = 0;
+    uint64_t start_tick;
+    timespec start_time;
+    unsigned dumps = 0;
+
+    FlightRecorder();
+    static Ring* claim_ring();
+    double ticks_per_ns() const;
+    void dump_thread();
+public:
+    static FlightRecorder& instance();
+
+    // Returns the event's tick
+    static uint64_t record(TraceStage stage) {
+        Ring* ring = local_ring != nullptr ? local_ring : claim_ring();
+        uint64_t head = ring->head.load(std::memory_order_relaxed);
+        Slot& slot = ring->slots[head & (ring_capacity - 1)];
+        uint64_t tick = trace_clock();
+        // Orders the previous head store before the slot stores, for the reader's check
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.tick.store(tick, std::memory_order_relaxed);
+        slot.tag.store(local_order | static_cast<uint64_t>(stage) << 32, std::memory_order_relaxed);
+        ring->head.store(head + 1, std::memory_order_release);
+        return tick;
+    }
+
+    // Starts tracing a command on this thread, returns its start tick
+    static uint64_t begin(uint32_t order_id) {
+        local_order = order_id;
+        return record(trace_read_done);
+    }
+
+    // Ends the command's trace and asks for a dump if it took longer than the threshold
+    void end(uint64_t began) {
+        uint64_t ended = record(trace_done);
+        local_order = 0;
+        if (ended - began > this->threshold_ticks.load(std::memory_order_relaxed)) {
+            uint32_t none = dump_none;
+            pending_dump.compare_exchange_strong(none, dump_threshold, std::memory_order_relaxed);
+        }
+    }
+
+    // Dumps go to path.1, path.2 and so on. Starts the dump thread, call once.
+    void configure(std::string path, unsigned window_ms, unsigned threshold_us);
+
+    // The order this thread's trace is for, carried along by tasks that move between threads
+    static uint32_t traced_order() { return local_order; }
+    static void set_traced_order(uint32_t order_id) { local_order = order_id; }
+
+    // Async signal safe
+    static void request_dump() {
+        pending_dump.store(dump_signal, std::memory_order_relaxed);
+    }
+
+    // Writes the last window_ms of every ring to path, returns false if it could not
+    bool dump(const std::string& path, TraceDumpReason reason);
+};
+
+// One command's trace, from decoding to handled
+class CommandTrace {
+private:
+    uint64_t began;
+public:
+    explicit CommandTrace(uint32_t order_id) : began(FlightRecorder::begin(order_id)) {}
+    ~CommandTrace() { FlightRecorder::instance().end(this->began); }
+    CommandTrace(const CommandTrace&) = delete;
+    CommandTrace& operator=(const CommandTrace&) = delete;
+};
+
+// Lock guard that records how long it waited, if it had to
+template<typename Mutex>
+class TracedLock {
+private:
+    Mutex& mutex;
+public:
+    TracedLock(Mutex& mutex, TraceStage wait) : mutex(mutex) {
+        if (!this->mutex.try_lock()) {
+            FlightRecorder::record(wait);
+            this->mutex.lock();
+            FlightRecorder::record(static_cast<TraceStage>(wait + 1));
+        }
+    }
+    ~TracedLock() { this->mutex.unlock(); }
+    TracedLock(const TracedLock&) = delete;
+    TracedLock& operator=(const TracedLock&) = delete;
+};
+
+#endif
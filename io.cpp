@@ -1,11 +1,14 @@
-// This file contains I/O functions.
-// There should be no need to modify this file.
+// Socket and shared memory I/O for client connections.
 
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
 #include "io.hpp"
 #include "engine.hpp"
+#include "shm_ring.hpp"
 
 // out of line definitions for the mutexes in SyncCerr/SyncCout
 std::mutex SyncCerr::mut;
@@ -20,17 +23,52 @@ void ClientConnection::freeHandle()
 	}
 }
 
-ReadResult ClientConnection::readInput(ClientCommand& read_into)
+bool ClientConnection::sendFd(int fd)
 {
-	switch(read(m_handle, &read_into, sizeof(ClientCommand)))
-	{
-		case 0: //
-			return ReadResult::EndOfFile;
+	return send_fd(m_handle, fd);
+}
 
-		case sizeof(ClientCommand): //
-			return ReadResult::Success;
+bool ClientConnection::peerClosed()
+{
+	struct pollfd pfd {};
+	pfd.fd = m_handle;
+	pfd.events = POLLRDHUP;
+	return poll(&pfd, 1, 0) != 0;
+}
+
+int ClientConnection::duplicateHandle()
+{
+	return fcntl(m_handle, F_DUPFD_CLOEXEC, 0);
+}
 
-		default: //
-			return ReadResult::Error;
+ReadResult ClientConnection::readInput(ClientCommand& read_into)
+{
+	while(true)
+	{
+		ReadResult result = this->tryReadInput(read_into);
+		if(result != ReadResult::WouldBlock)
+			return result;
+		struct pollfd pfd {};
+		pfd.fd = m_handle;
+		pfd.events = POLLIN;
+		poll(&pfd, 1, -1);
 	}
 }
+
+ReadResult ClientConnection::tryReadInput(ClientCommand& read_into)
+{
+	ssize_t got = recv(m_handle, m_partial + m_partialSize, sizeof(ClientCommand) - m_partialSize, MSG_DONTWAIT);
+	if(got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return ReadResult::WouldBlock;
+	if(got < 0)
+		return ReadResult::Error;
+	if(got == 0)
+		// A command cut short by the client going away is an error
+		return m_partialSize == 0 ? ReadResult::EndOfFile : ReadResult::Error;
+	m_partialSize += got;
+	if(m_partialSize < sizeof(ClientCommand))
+		return ReadResult::WouldBlock;
+	std::memcpy(&read_into, m_partial, sizeof(ClientCommand));
+	m_partialSize = 0;
+	return ReadResult::Success;
+}
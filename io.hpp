@@ -1,20 +1,56 @@
-// This file contains definitions used by the provided I/O code.
-// There should be no need to modify this file.
+// Wire format, order flags, reject reasons and the output events shared by the engine and its clients.
 
 #pragma once
 
 #include <mutex>
 #include <utility>
+#include <charconv>
 #include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <string>
+
+#include "flight_recorder.hpp"
 
 enum CommandType
 {
 	input_buy = 'B',
 	input_sell = 'S',
-	input_cancel = 'C'
+	input_cancel = 'C',
+	input_query = 'Q',
+	input_session = 'N', // switch the connection to shared memory rings, count is the requested ring capacity
+	input_reports = 'E', // first command only, the connection also gets its execution reports as EngineEvent records
+	input_auction = 'A'  // count 1 starts a call period on every instrument, count 0 uncrosses them and resumes matching
+};
+
+// Bits of ClientCommand::flags for buy/sell orders
+enum OrderFlags : uint8_t
+{
+	order_flag_ioc = 1,       // immediate-or-cancel, the unfilled count never rests
+	order_flag_fok = 2,       // fill-or-kill, fills completely or not at all
+	order_flag_post_only = 4, // rejected instead of trading if it would cross
+	order_flag_stp = 8        // self-trade prevention, cancels resting orders with the same stp key
+};
+
+// At most one of IOC, FOK and post-only, and FOK is checked against levels that cannot tell stp keys apart
+inline bool valid_order_flags(uint8_t flags)
+{
+	uint8_t types = flags & (order_flag_ioc | order_flag_fok | order_flag_post_only);
+	return (types & (types - 1)) == 0 && !((flags & order_flag_fok) && (flags & order_flag_stp));
+}
+
+// Reasons printed by Output::OrderRejected
+enum RejectReason : char
+{
+	reject_invalid_flags = 'I',
+	reject_post_only = 'P',
+	reject_throttled = 'T',  // over the connection's order rate limit
+	reject_queue_full = 'Q', // the instrument already has its maximum of orders in flight
+	reject_auction = 'A'     // IOC or FOK during a call period, where nothing trades until the uncross
 };
 
+// flags and stp_id sit in what used to be padding, so the size is unchanged
+// and clients that zero the command keep the old behaviour
 struct ClientCommand
 {
 	CommandType type;
@@ -22,13 +58,53 @@ struct ClientCommand
 	uint32_t price;
 	uint32_t count;
 	char instrument[9];
+	uint8_t flags;
+	uint16_t stp_id; // self-trade prevention key shared across sessions, 0 uses the session's own key
+};
+static_assert(sizeof(ClientCommand) == 28, "ClientCommand is the wire format");
+
+// Binary form of one output line, for transports that hand events back to the session
+struct EngineEvent
+{
+	char kind;          // 'B', 'S', 'E', 'X', 'R' or 'Q', as the first character of the output line
+	char detail;        // 'A' or 'R' for X, the RejectReason for R
+	char instrument[9]; // B, S and Q
+	uint32_t id;        // order id, the resting order's id for E
+	uint32_t new_id;    // E only
+	uint32_t execution_id;
+	uint32_t price;     // bid price for Q
+	uint32_t ask_price; // Q only
+	uint64_t count;     // bid count for Q
+	uint64_t ask_count; // Q only
+	int64_t timestamp;
+};
+static_assert(sizeof(EngineEvent) == 56, "EngineEvent is the wire format");
+
+// Receives a copy of the events printed by a thread, see Output::sink
+struct EventSink
+{
+	virtual ~EventSink() = default;
+	virtual void publish(const EngineEvent& event) = 0;
+};
+
+// One line of a batch printed by Output::OrdersExecuted
+struct Execution
+{
+	uint32_t resting_id;
+	uint32_t new_id;
+	uint32_t execution_id;
+	uint32_t price;
+	uint32_t count;
+	EventSink* resting_owner; // may be null
+	EventSink* new_owner;     // may be null
 };
 
 enum class ReadResult
 {
 	Success,
 	EndOfFile,
-	Error
+	Error,
+	WouldBlock // tryReadInput only, no whole command has arrived yet
 };
 
 struct ClientConnection
@@ -36,7 +112,11 @@ struct ClientConnection
 	~ClientConnection() { this->freeHandle(); }
 	explicit ClientConnection(int handle) : m_handle(handle) { }
 
-	ClientConnection(ClientConnection&& other) : m_handle(std::exchange(other.m_handle, -1)) { }
+	ClientConnection(ClientConnection&& other)
+	    : m_handle(std::exchange(other.m_handle, -1)), m_partialSize(std::exchange(other.m_partialSize, 0))
+	{
+		std::memcpy(m_partial, other.m_partial, m_partialSize);
+	}
 	ClientConnection& operator=(ClientConnection&& other)
 	{
 		if(&other == this)
@@ -44,6 +124,8 @@ struct ClientConnection
 
 		this->freeHandle();
 		m_handle = std::exchange(other.m_handle, -1);
+		m_partialSize = std::exchange(other.m_partialSize, 0);
+		std::memcpy(m_partial, other.m_partial, m_partialSize);
 
 		return *this;
 	}
@@ -52,9 +134,23 @@ struct ClientConnection
 	ClientConnection& operator=(const ClientConnection&) = delete;
 
 	ReadResult readInput(ClientCommand& read_into);
+	// readInput that returns WouldBlock instead of waiting for a command. A command
+	// split across reads is kept until the rest of it arrives.
+	ReadResult tryReadInput(ClientCommand& read_into);
+	// The socket, for waiting on it
+	int handle() const { return m_handle; }
+	// Passes a file descriptor to the client over the socket
+	bool sendFd(int fd);
+	// True once the client has closed its end
+	bool peerClosed();
+	// A second descriptor for the socket that outlives the connection, -1 on failure
+	int duplicateHandle();
 
 private:
 	int m_handle;
+	// Start of a command that has not fully arrived
+	char m_partial[sizeof(ClientCommand)];
+	size_t m_partialSize = 0;
 	void freeHandle();
 };
 
@@ -63,7 +159,7 @@ private:
 struct SyncCout
 {
 	static std::mutex mut;
-	std::scoped_lock<std::mutex> lock { SyncCout::mut };
+	TracedLock<std::mutex> lock { SyncCout::mut, trace_output_wait };
 
 	template <typename T>
 	friend const SyncCout& operator<<(const SyncCout& s, T&& v)
@@ -84,7 +180,7 @@ struct SyncCout
 struct SyncCerr
 {
 	static std::mutex mut;
-	std::scoped_lock<std::mutex> lock { SyncCerr::mut };
+	TracedLock<std::mutex> lock { SyncCerr::mut, trace_log_wait };
 
 	template <typename T>
 	friend const SyncCerr& operator<<(const SyncCerr& s, T&& v)
@@ -102,18 +198,47 @@ struct SyncCerr
 
 class Output
 {
+private:
+	static void publish(const EngineEvent& event, EventSink* counterparty = nullptr)
+	{
+		if(sink != nullptr)
+			sink->publish(event);
+		if(counterparty != nullptr && counterparty != sink)
+			counterparty->publish(event);
+	}
+
 public:
+	// Events printed by this thread are also published here, if set
+	inline static thread_local EventSink* sink = nullptr;
+	// Set once at startup, false leaves the events to the sinks
+	inline static bool print_stdout = true;
+	// Called before each event is printed or published, set once at startup
+	inline static void (*before_event)() = nullptr;
+
 	inline static void
 	OrderAdded(uint32_t id, const char* symbol, uint32_t price, uint32_t count, bool is_sell_side, intmax_t output_timestamp)
 	{
-		SyncCout()
-		    << (is_sell_side ? "S " : "B ") //
-		    << id << " "                    //
-		    << symbol << " "                //
-		    << price << " "                 //
-		    << count << " "                 //
-		    << output_timestamp             //
-		    << std::endl;
+		if(before_event != nullptr)
+			before_event();
+		if(print_stdout)
+		{
+			SyncCout()
+			    << (is_sell_side ? "S " : "B ") //
+			    << id << " "                    //
+			    << symbol << " "                //
+			    << price << " "                 //
+			    << count << " "                 //
+			    << output_timestamp             //
+			    << std::endl;
+		}
+		EngineEvent event {};
+		event.kind = is_sell_side ? 'S' : 'B';
+		memcpy(event.instrument, symbol, strnlen(symbol, sizeof(event.instrument) - 1));
+		event.id = id;
+		event.price = price;
+		event.count = count;
+		event.timestamp = output_timestamp;
+		publish(event);
 	}
 
 	inline static void OrderExecuted(uint32_t resting_id,
@@ -121,26 +246,151 @@ public:
 	    uint32_t execution_id,
 	    uint32_t price,
 	    uint32_t count,
+	    intmax_t output_timestamp,
+	    EventSink* counterparty = nullptr) // the resting order's owner
+	{
+		if(before_event != nullptr)
+			before_event();
+		if(print_stdout)
+		{
+			SyncCout()
+			    << "E "                //
+			    << resting_id << " "   //
+			    << new_id << " "       //
+			    << execution_id << " " //
+			    << price << " "        //
+			    << count << " "        //
+			    << output_timestamp    //
+			    << std::endl;
+		}
+		EngineEvent event {};
+		event.kind = 'E';
+		event.id = resting_id;
+		event.new_id = new_id;
+		event.execution_id = execution_id;
+		event.price = price;
+		event.count = count;
+		event.timestamp = output_timestamp;
+		publish(event, counterparty);
+	}
+
+	// A batch of executions at one timestamp, written to stdout in one go. The
+	// events go to the two orders' owners only, the printing thread is neither.
+	inline static void OrdersExecuted(const Execution* executions, size_t count, intmax_t output_timestamp)
+	{
+		if(before_event != nullptr)
+			before_event();
+		if(print_stdout)
+		{
+			std::string lines;
+			lines.reserve(count * 48);
+			char field[24];
+			auto append = [&](uint64_t value, char separator) {
+				lines.append(field, std::to_chars(field, field + sizeof(field), value).ptr);
+				lines.push_back(separator);
+			};
+			for(size_t i = 0; i < count; i++)
+			{
+				const Execution& execution = executions[i];
+				lines.append("E ");
+				append(execution.resting_id, ' ');
+				append(execution.new_id, ' ');
+				append(execution.execution_id, ' ');
+				append(execution.price, ' ');
+				append(execution.count, ' ');
+				append(output_timestamp, '\n');
+			}
+			SyncCout() << lines << std::flush;
+		}
+		for(size_t i = 0; i < count; i++)
+		{
+			const Execution& execution = executions[i];
+			EngineEvent event {};
+			event.kind = 'E';
+			event.id = execution.resting_id;
+			event.new_id = execution.new_id;
+			event.execution_id = execution.execution_id;
+			event.price = execution.price;
+			event.count = execution.count;
+			event.timestamp = output_timestamp;
+			if(execution.resting_owner != nullptr)
+				execution.resting_owner->publish(event);
+			if(execution.new_owner != nullptr && execution.new_owner != execution.resting_owner)
+				execution.new_owner->publish(event);
+		}
+	}
+
+	inline static void OrderRejected(uint32_t id, RejectReason reason, intmax_t output_timestamp)
+	{
+		if(before_event != nullptr)
+			before_event();
+		if(print_stdout)
+		{
+			SyncCout()
+			    << "R "                           //
+			    << id << " "                      //
+			    << static_cast<char>(reason) << " " //
+			    << output_timestamp               //
+			    << std::endl;
+		}
+		EngineEvent event {};
+		event.kind = 'R';
+		event.detail = static_cast<char>(reason);
+		event.id = id;
+		event.timestamp = output_timestamp;
+		publish(event);
+	}
+
+	inline static void TopOfBook(const char* symbol,
+	    uint32_t bid_price,
+	    uint64_t bid_count,
+	    uint32_t ask_price,
+	    uint64_t ask_count,
 	    intmax_t output_timestamp)
 	{
-		SyncCout()
-		    << "E "                //
-		    << resting_id << " "   //
-		    << new_id << " "       //
-		    << execution_id << " " //
-		    << price << " "        //
-		    << count << " "        //
-		    << output_timestamp    //
-		    << std::endl;
+		if(before_event != nullptr)
+			before_event();
+		if(print_stdout)
+		{
+			SyncCout()
+			    << "Q "               //
+			    << symbol << " "      //
+			    << bid_price << " "   //
+			    << bid_count << " "   //
+			    << ask_price << " "   //
+			    << ask_count << " "   //
+			    << output_timestamp   //
+			    << std::endl;
+		}
+		EngineEvent event {};
+		event.kind = 'Q';
+		memcpy(event.instrument, symbol, strnlen(symbol, sizeof(event.instrument) - 1));
+		event.price = bid_price;
+		event.count = bid_count;
+		event.ask_price = ask_price;
+		event.ask_count = ask_count;
+		event.timestamp = output_timestamp;
+		publish(event);
 	}
 
-	inline static void OrderDeleted(uint32_t id, bool cancel_accepted, intmax_t output_timestamp)
+	inline static void OrderDeleted(uint32_t id, bool cancel_accepted, intmax_t output_timestamp, EventSink* counterparty = nullptr)
 	{
-		SyncCout()
-		    << "X "                            //
-		    << id << " "                       //
-		    << (cancel_accepted ? "A " : "R ") //
-		    << output_timestamp                //
-		    << std::endl;
+		if(before_event != nullptr)
+			before_event();
+		if(print_stdout)
+		{
+			SyncCout()
+			    << "X "                            //
+			    << id << " "                       //
+			    << (cancel_accepted ? "A " : "R ") //
+			    << output_timestamp                //
+			    << std::endl;
+		}
+		EngineEvent event {};
+		event.kind = 'X';
+		event.detail = cancel_accepted ? 'A' : 'R';
+		event.id = id;
+		event.timestamp = output_timestamp;
+		publish(event, counterparty);
 	}
 };
@@ -1,5 +1,4 @@
-// This file contains main() as well as the logic setting up the I/O.
-// There should be no need to modify this file.
+// main(): command line options, the listening socket and handing connections to the engine.
 
 #include <stdio.h>
 #include <signal.h>
@@ -10,6 +9,8 @@
 #include <sys/un.h>
 #include <unistd.h>
 
+#include <utility>
+
 #include "io.hpp"
 #include "engine.hpp"
 
@@ -22,6 +23,12 @@ static void handle_exit_signal(int signum)
 	exit(0);
 }
 
+static void handle_dump_signal(int signum)
+{
+	(void) signum;
+	FlightRecorder::request_dump();
+}
+
 static void exit_cleanup(void)
 {
 	if(listenfd == -1)
@@ -32,15 +39,114 @@ static void exit_cleanup(void)
 		unlink(socketpath);
 }
 
+static void usage(const char* argv0)
+{
+	fprintf(stderr,
+	    "Usage: %s [options] <socket path>\n"
+	    "  -l <file>              price ladder config, lines of INSTRUMENT BASE TICK LEVELS\n"
+	    "  -k                     concurrent skiplist side books for instruments without a ladder\n"
+	    "  -M                     compact side books for instruments without a ladder, resting orders are kept as records\n"
+	    "  -I <ms>                books unused for this long shrink to a stub (default 1000, 0 never)\n"
+	    "  -r <rate>[:<burst>]    per connection order rate limit in orders/s, excess orders are delayed\n"
+	    "  -t                     reject orders over the rate limit instead of delaying them\n"
+	    "  -q <depth>             max orders in flight per instrument, excess orders are rejected\n"
+	    "  -s <ms>                print admission counters to stderr at this interval\n"
+	    "  -p <spins>             shared memory sessions poll this many times before sleeping (default 4096, 0 on one CPU)\n"
+	    "  -d <file>              flight recorder dumps go to file.1, file.2 ..., on SIGUSR1 or a slow command\n"
+	    "  -D <us>                dump when a command takes longer than this\n"
+	    "  -W <ms>                how far back a dump goes (default 10000)\n"
+	    "  -o                     no output on stdout, clients get their own events as execution reports\n"
+	    "  -R <socket>            stream handled commands to followers connecting here\n"
+	    "  -L <commands>          followers can join until this many commands have been streamed (default 1048576)\n"
+	    "  -F <socket>            hot standby, replay the primary listening there and take over when it goes away\n"
+	    "  -P                     with -F, print the events of the replayed commands on stdout as the primary did\n"
+	    "  -A                     start in a call period, orders rest until a client sends the uncross (a follower gets it from its primary)\n"
+	    "  -u <threads>           threads that uncross instruments in parallel (default one per CPU)\n"
+	    "  -C <workers>           run connections as tasks on this many worker threads instead of a thread each\n",
+	    argv0);
+}
+
 int main(int argc, char* argv[])
 {
-	if(argc < 2)
+	EngineConfig config;
+	bool opening_auction = false;
+	int opt;
+	while((opt = getopt(argc, argv, "l:kMI:r:tq:s:p:d:D:W:oR:L:F:PAu:C:")) != -1)
+	{
+		switch(opt)
+		{
+			case 'l':
+				if(!config.load_ladders(optarg))
+				{
+					fprintf(stderr, "Could not load ladder config %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'k': config.skiplist_books = true; break;
+			case 'M': config.compact_books = true; break;
+			case 'I': config.idle_book_ms = strtoul(optarg, NULL, 10); break;
+			case 'r':
+			{
+				char* end;
+				config.rate_limit = strtod(optarg, &end);
+				if(*end == ':')
+					config.rate_burst = strtod(end + 1, &end);
+				if(*end != '\0' || config.rate_limit < 0 || config.rate_burst < 0)
+				{
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			}
+			case 't': config.reject_over_rate = true; break;
+			case 'q': config.max_queue_depth = strtoul(optarg, NULL, 10); break;
+			case 's': config.stats_interval_ms = strtoul(optarg, NULL, 10); break;
+			case 'p': config.shm_spins = strtoul(optarg, NULL, 10); break;
+			case 'd': config.trace_path = optarg; break;
+			case 'D': config.trace_threshold_us = strtoul(optarg, NULL, 10); break;
+			case 'W': config.trace_window_ms = strtoul(optarg, NULL, 10); break;
+			case 'o': config.print_stdout = false; break;
+			case 'R': config.replication_path = optarg; break;
+			case 'L': config.replication_log_limit = strtoull(optarg, NULL, 10); break;
+			case 'F': config.follow_path = optarg; break;
+			case 'P': config.print_replay = true; break;
+			case 'A': opening_auction = true; break;
+			case 'u': config.auction_threads = strtoul(optarg, NULL, 10); break;
+			case 'C': config.workers = strtoul(optarg, NULL, 10); break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+
+	if(optind >= argc)
 	{
-		fprintf(stderr, "Usage: %s <socket path>\n", argv[0]);
+		usage(argv[0]);
 		return 1;
 	}
 
-	socketpath = argv[1];
+	socketpath = argv[optind];
+	bool replicating = !config.replication_path.empty();
+	bool following = !config.follow_path.empty();
+	auto engine = new Engine(std::move(config));
+	if(replicating && !engine->listen_for_followers())
+	{
+		perror("replication socket");
+		return 1;
+	}
+	if(following)
+	{
+		if(!engine->follow())
+		{
+			fprintf(stderr, "Could not follow the primary\n");
+			return 1;
+		}
+		// Clients reconnect to the path the primary left behind
+		unlink(socketpath);
+	}
+	else if(opening_auction)
+	{
+		engine->open_call_period();
+	}
+
 	listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
 	if(listenfd == -1)
 	{
@@ -51,7 +157,7 @@ int main(int argc, char* argv[])
 	{
 		struct sockaddr_un sockaddr {};
 		sockaddr.sun_family = AF_UNIX;
-		strncpy(sockaddr.sun_path, argv[1], sizeof(sockaddr.sun_path) - 1);
+		strncpy(sockaddr.sun_path, socketpath, sizeof(sockaddr.sun_path) - 1);
 		if(bind(listenfd, (const struct sockaddr*) &sockaddr, sizeof(sockaddr)) != 0)
 		{
 			perror("bind");
@@ -62,6 +168,7 @@ int main(int argc, char* argv[])
 	atexit(exit_cleanup);
 	signal(SIGINT, handle_exit_signal);
 	signal(SIGTERM, handle_exit_signal);
+	signal(SIGUSR1, handle_dump_signal);
 
 	if(listen(listenfd, 8) != 0)
 	{
@@ -69,7 +176,6 @@ int main(int argc, char* argv[])
 		return 1;
 	}
 
-	auto engine = new Engine();
 	while(true)
 	{
 		int connfd = accept(listenfd, NULL, NULL);
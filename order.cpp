@@ -1,8 +1,9 @@
 #include "order.h"
+#include "flight_recorder.hpp"
 #include <shared_mutex>
 
-RestingOrder::RestingOrder(uint32_t order_id, const std::string& instrument, uint32_t price, uint32_t count, const std::string& side, intmax_t timestamp)
-        : order_id(order_id), instrument(instrument), price(price), count(count), side(side), timestamp(timestamp) {
+RestingOrder::RestingOrder(uint32_t order_id, const std::string& instrument, uint32_t price, uint32_t count, const std::string& side, intmax_t timestamp, uint32_t stp_key, uint32_t owner)
+        : order_id(order_id), instrument(instrument), price(price), count(count), side(side), timestamp(timestamp), stp_key(stp_key), owner(owner) {
             this->deleted_timestamp = -1;
             this->executed_timestamp = -1;
             this->is_ready = false;
@@ -13,7 +14,7 @@ RestingOrder::RestingOrder(uint32_t order_id, const std::string& instrument, uin
 RestingOrder::RestingOrder(RestingOrder&& other) noexcept
     : order_id(other.order_id), instrument(std::move(other.instrument)), price(other.price), count(other.count),
         side(std::move(other.side)), timestamp(other.timestamp), deleted_timestamp(other.deleted_timestamp), executed_timestamp(other.executed_timestamp),
-        curr_execution_id(other.curr_execution_id.load()) {}
+        curr_execution_id(other.curr_execution_id.load()), stp_key(other.stp_key), owner(other.owner) {}
 
 // Define move assignment operator
 RestingOrder& RestingOrder::operator=(RestingOrder&& other) noexcept {
@@ -27,6 +28,8 @@ RestingOrder& RestingOrder::operator=(RestingOrder&& other) noexcept {
         deleted_timestamp = other.deleted_timestamp;
         executed_timestamp = other.executed_timestamp;
         curr_execution_id.store(other.curr_execution_id.load());
+        stp_key = other.stp_key;
+        owner = other.owner;
     }
     return *this;
 }
@@ -37,6 +40,14 @@ uint32_t RestingOrder::get_execution_id() {
     return this->curr_execution_id++;
 }
 
+uint32_t RestingOrder::next_execution_id() {
+    return this->curr_execution_id.load();
+}
+
+void RestingOrder::set_next_execution_id(uint32_t next) {
+    this->curr_execution_id.store(next);
+}
+
 intmax_t RestingOrder::get_deleted_timestamp() {
     std::shared_lock<std::shared_mutex> lock(this->mut);
     return this->deleted_timestamp;
@@ -61,9 +72,14 @@ intmax_t RestingOrder::get_timestamp() {
 
 void RestingOrder::check_order_ready_or_wait() {
     std::unique_lock<std::mutex> lk{this->is_ready_mutex};
+    if (this->is_ready) {
+        return;
+    }
+    FlightRecorder::record(trace_ready_wait);
     while (!this->is_ready) {
         this->is_ready_cond_var.wait(lk);
     }
+    FlightRecorder::record(trace_ready_done);
 }
 
 uint32_t RestingOrder::get_count() {
@@ -86,12 +102,57 @@ void RestingOrder::set_count(uint32_t count) {
     this->count = count;
 }
 
+RestingOrder::ReadyAwaiter RestingOrder::ready() {
+    return ReadyAwaiter(*this);
+}
+
+bool RestingOrder::ReadyAwaiter::await_ready() {
+    if (Scheduler::current() == nullptr) {
+        this->order.check_order_ready_or_wait();
+        return true;
+    }
+    std::lock_guard<std::mutex> lk{this->order.is_ready_mutex};
+    return this->order.is_ready;
+}
+
+bool RestingOrder::ReadyAwaiter::await_suspend(std::coroutine_handle<> handle) {
+    this->suspending(handle);
+    std::lock_guard<std::mutex> lk{this->order.is_ready_mutex};
+    if (this->order.is_ready) {
+        return false;
+    }
+    FlightRecorder::record(trace_ready_wait);
+    this->waited = true;
+    this->waiter.next = this->order.ready_waiters;
+    this->order.ready_waiters = &this->waiter;
+    return true;
+}
+
+void RestingOrder::ReadyAwaiter::await_resume() {
+    this->resumed();
+    if (this->waited) {
+        FlightRecorder::record(trace_ready_done);
+    }
+}
+
 void RestingOrder::set_order_ready() {
+    Waiter* waiters;
     {
         std::lock_guard<std::mutex> lk{this->is_ready_mutex};
         this->is_ready = true;
+        waiters = std::exchange(this->ready_waiters, nullptr);
     }
     this->is_ready_cond_var.notify_all();
+    while (waiters != nullptr) {
+        Waiter* next = waiters->next;
+        waiters->wake();
+        waiters = next;
+    }
+}
+
+bool RestingOrder::is_order_ready() {
+    std::lock_guard<std::mutex> lk{this->is_ready_mutex};
+    return this->is_ready;
 }
 
 std::string RestingOrder::get_side() {
@@ -102,4 +163,14 @@ std::string RestingOrder::get_side() {
 std::string RestingOrder::get_instrument() {
     std::shared_lock<std::shared_mutex> lock(this->mut);
     return this->instrument;
-}
\ No newline at end of file
+}
+
+uint32_t RestingOrder::get_stp_key() {
+    std::shared_lock<std::shared_mutex> lock(this->mut);
+    return this->stp_key;
+}
+
+// Set at construction and never changed, so no lock
+uint32_t RestingOrder::get_owner() {
+    return this->owner;
+}
@@ -7,6 +7,7 @@
 #include <atomic>
 #include <condition_variable>
 #include <shared_mutex>
+#include "scheduler.hpp"
 
 class RestingOrder {
 private:
@@ -19,29 +20,52 @@ private:
     intmax_t deleted_timestamp;
     intmax_t executed_timestamp;
     std::atomic<uint32_t> curr_execution_id{1};
+    uint32_t stp_key; // orders with the same key never trade with each other under self-trade prevention
+    uint32_t owner; // session that gets this order's execution reports, 0 for none
     std::shared_mutex mut; // Protect read/writes to the order
 
     bool is_ready;
     std::mutex is_ready_mutex;
     std::condition_variable is_ready_cond_var;
+    Waiter* ready_waiters = nullptr; // tasks suspended until the order is ready
 
 public:
-    RestingOrder(uint32_t order_id, const std::string& instrument, uint32_t price, uint32_t count, const std::string& side, intmax_t timestamp);
+    RestingOrder(uint32_t order_id, const std::string& instrument, uint32_t price, uint32_t count, const std::string& side, intmax_t timestamp, uint32_t stp_key = 0, uint32_t owner = 0);
     RestingOrder(RestingOrder&& other) noexcept; // move constructor
     RestingOrder& operator=(RestingOrder&& other) noexcept; // move assignment operator
     uint32_t get_execution_id();
+    // The id get_execution_id hands out next, and setting it for an order rebuilt from a compact record
+    uint32_t next_execution_id();
+    void set_next_execution_id(uint32_t next);
     intmax_t get_deleted_timestamp();
     uint32_t get_price();
     intmax_t get_timestamp();
     uint32_t get_count();
     void delete_order(intmax_t timestamp);
     void check_order_ready_or_wait();
+
+    // check_order_ready_or_wait for a task, which suspends instead of blocking its worker
+    class ReadyAwaiter : public Suspension {
+    private:
+        RestingOrder& order;
+        bool waited = false;
+    public:
+        explicit ReadyAwaiter(RestingOrder& order) : order(order) {}
+        bool await_ready();
+        bool await_suspend(std::coroutine_handle<> handle);
+        void await_resume();
+    };
+    ReadyAwaiter ready();
+
     void decrease_count(uint32_t decrease_by);
     uint32_t get_order_id();
     void set_count(uint32_t count);
     void set_order_ready(); 
+    bool is_order_ready();
     std::string get_side();
     std::string get_instrument();
+    uint32_t get_stp_key();
+    uint32_t get_owner();
 };
 
 #endif
\ No newline at end of file
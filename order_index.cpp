@@ -0,0 +1,104 @@
+#include "order_index.h"
+#include "orderbook.h"
+
+static_assert(alignof(Orderbook) > 1, "the side is kept in the low bit of a book's address");
+
+// Fibonacci hashing, the top bits pick the shard and the next ones the home slot
+uint64_t OrderIndex::hash(uint32_t order_id) {
+    return order_id * 0x9E3779B97F4A7C15ull;
+}
+
+OrderIndex::Shard& OrderIndex::shard(uint32_t order_id) {
+    return this->shards[hash(order_id) >> 58];
+}
+
+size_t OrderIndex::probe(const Shard& shard, uint32_t order_id) {
+    size_t capacity = shard.slots.size();
+    size_t index = ((hash(order_id) >> 26) & 0xffffffff) * capacity >> 32;
+    while (shard.slots[index].book != 0 && shard.slots[index].order_id != order_id) {
+        index = index + 1 == capacity ? 0 : index + 1;
+    }
+    return index;
+}
+
+void OrderIndex::resize(Shard& shard, size_t capacity) {
+    std::vector<Slot> old = std::move(shard.slots);
+    shard.slots.assign(capacity, Slot {});
+    for (const Slot& slot : old) {
+        if (slot.book != 0) {
+            shard.slots[probe(shard, slot.order_id)] = slot;
+        }
+    }
+}
+
+void OrderIndex::insert(uint32_t order_id, const OrderLocation& location) {
+    Shard& shard = this->shard(order_id);
+    std::lock_guard<std::mutex> lock(shard.mut);
+    // Kept at most 80% full, so a probe rarely runs long
+    if ((shard.used + 1) * 5 > shard.slots.size() * 4) {
+        resize(shard, std::max(min_capacity, shard.slots.size() * 3 / 2));
+    }
+    Slot& slot = shard.slots[probe(shard, order_id)];
+    shard.used += slot.book == 0;
+    slot = {reinterpret_cast<uintptr_t>(location.book) | location.is_buy, order_id, location.price, location.timestamp};
+}
+
+std::optional<OrderLocation> OrderIndex::find(uint32_t order_id) {
+    Shard& shard = this->shard(order_id);
+    std::lock_guard<std::mutex> lock(shard.mut);
+    if (shard.used == 0) {
+        return std::nullopt;
+    }
+    const Slot& slot = shard.slots[probe(shard, order_id)];
+    if (slot.book == 0) {
+        return std::nullopt;
+    }
+    return OrderLocation {reinterpret_cast<Orderbook*>(slot.book & ~uintptr_t{1}), static_cast<bool>(slot.book & 1), slot.price, slot.timestamp};
+}
+
+// Backward shift deletion: later slots of the same probe run move up, so a lookup
+// never stops early at the freed slot and no tombstones are needed
+void OrderIndex::erase(uint32_t order_id) {
+    Shard& shard = this->shard(order_id);
+    std::lock_guard<std::mutex> lock(shard.mut);
+    if (shard.used == 0) {
+        return;
+    }
+    size_t capacity = shard.slots.size();
+    size_t hole = probe(shard, order_id);
+    if (shard.slots[hole].book == 0) {
+        return;
+    }
+    for (size_t next = hole + 1 == capacity ? 0 : hole + 1; shard.slots[next].book != 0; next = next + 1 == capacity ? 0 : next + 1) {
+        size_t home = ((hash(shard.slots[next].order_id) >> 26) & 0xffffffff) * capacity >> 32;
+        // The entry can fill the hole unless its home lies cyclically in (hole, next]
+        bool stays = hole <= next ? hole < home && home <= next : hole < home || home <= next;
+        if (!stays) {
+            shard.slots[hole] = shard.slots[next];
+            hole = next;
+        }
+    }
+    shard.slots[hole] = Slot {};
+    shard.used--;
+    if (shard.slots.size() > min_capacity && shard.used * 5 < shard.slots.size()) {
+        resize(shard, std::max(min_capacity, shard.slots.size() / 2));
+    }
+}
+
+size_t OrderIndex::size() {
+    size_t total = 0;
+    for (Shard& shard : this->shards) {
+        std::lock_guard<std::mutex> lock(shard.mut);
+        total += shard.used;
+    }
+    return total;
+}
+
+size_t OrderIndex::memory_bytes() {
+    size_t total = 0;
+    for (Shard& shard : this->shards) {
+        std::lock_guard<std::mutex> lock(shard.mut);
+        total += shard.slots.capacity() * sizeof(Slot);
+    }
+    return total;
+}
@@ -0,0 +1,58 @@
+#ifndef ORDER_INDEX_H
+#define ORDER_INDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+class Orderbook;
+
+// Where a resting order can be found: its book, side and price, and its timestamp
+// for side books that keep a level in time priority
+struct OrderLocation {
+    Orderbook* book;
+    bool is_buy;
+    uint32_t price;
+    intmax_t timestamp;
+};
+
+// Resting orders' locations by id, for cancels.
+// Each order takes one 24 byte slot of an open addressing table with linear
+// probing, instead of a list node holding a shared pointer that kept the order
+// alive. Ids are spread over shards with a lock each, so connections inserting
+// at the same time rarely share one.
+class OrderIndex {
+private:
+    struct Slot {
+        uintptr_t book = 0; // the book's address with the side in the low bit, 0 if the slot is free
+        uint32_t order_id = 0;
+        uint32_t price = 0;
+        intmax_t timestamp = 0;
+    };
+    struct Shard {
+        std::mutex mut;
+        std::vector<Slot> slots;
+        size_t used = 0;
+    };
+    static constexpr size_t shard_count = 64;
+    static constexpr size_t min_capacity = 16;
+    Shard shards[shard_count];
+
+    static uint64_t hash(uint32_t order_id);
+    Shard& shard(uint32_t order_id);
+    // Slot holding order_id, or the free slot it would go in. Must hold the shard's mut
+    static size_t probe(const Shard& shard, uint32_t order_id);
+    static void resize(Shard& shard, size_t capacity);
+public:
+    void insert(uint32_t order_id, const OrderLocation& location);
+    std::optional<OrderLocation> find(uint32_t order_id);
+    void erase(uint32_t order_id);
+
+    size_t size();
+    // Heap bytes held by the tables
+    size_t memory_bytes();
+};
+
+#endif
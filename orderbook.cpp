@@ -1,87 +1,235 @@
+#include <algorithm>
 #include <list>
+#include <utility>
 #include "orderbook.h"
+#include "skiplist.h"
 #include <memory>
 #include "engine.hpp"
+#include "flight_recorder.hpp"
 #include "ts_orderbook_hashmap.hpp"
 
-Orderbook::Orderbook(std::string instrument) : instrument(instrument) {};
+Orderbook::Orderbook(std::string instrument, std::optional<LadderConfig> ladder, bool skiplist, bool compact)
+    : instrument(instrument), ladder(ladder), skiplist(skiplist), compact(compact) {
+    this->expand();
+}
 
-std::shared_ptr<RestingOrder> Orderbook::insert_order(const std::string& side, uint32_t order_id, const std::string& instrument, uint32_t price, uint32_t count, uint32_t timestamp) {
-    std::shared_ptr<RestingOrder> order = std::make_shared<RestingOrder>(order_id, instrument, price, count, side, timestamp);
-    
-    if (side == "buy") {
-        std::lock_guard<std::mutex> lock(this->buyPQMutex);
-        this->buyOrders.push(order);
+void Orderbook::expand() {
+    this->state = std::make_unique<State>();
+    if (this->ladder.has_value()) {
+        this->state->buyOrders = std::make_unique<LadderSideBook>(true, this->ladder.value());
+        this->state->sellOrders = std::make_unique<LadderSideBook>(false, this->ladder.value());
+    } else if (this->compact) {
+        std::array<CompactLevels, 2> records;
+        if (this->frozen != nullptr) {
+            records = std::move(*this->frozen);
+            this->frozen.reset();
+        }
+        // Every record is a ready order, so the levels are the records' counts
+        for (const CompactLevel& level : records[0]) {
+            for (const CompactOrder& record : level.orders) {
+                this->state->buyLevels[level.price] += record.count;
+            }
+        }
+        for (const CompactLevel& level : records[1]) {
+            for (const CompactOrder& record : level.orders) {
+                this->state->sellLevels[level.price] += record.count;
+            }
+        }
+        this->state->buyOrders = std::make_unique<CompactSideBook>(true, this->instrument, std::move(records[0]));
+        this->state->sellOrders = std::make_unique<CompactSideBook>(false, this->instrument, std::move(records[1]));
+    } else if (this->skiplist) {
+        this->state->buyOrders = std::make_unique<SkipListSideBook>(true);
+        this->state->sellOrders = std::make_unique<SkipListSideBook>(false);
     } else {
-        std::lock_guard<std::mutex> lock(this->sellPQMutex);
-        this->sellOrders.push(order);
+        this->state->buyOrders = std::make_unique<HeapSideBook<BuyOrderComparator>>();
+        this->state->sellOrders = std::make_unique<HeapSideBook<SellOrderComparator>>();
     }
-    return order;
 }
 
-void Orderbook::insert_order_with_val(const std::string& side, std::shared_ptr<RestingOrder> val) {
-    if (side == "buy") {
-        std::lock_guard<std::mutex> lock(this->buyPQMutex);
-        this->buyOrders.push(val);
-    } else {
-        std::lock_guard<std::mutex> lock(this->sellPQMutex);
-        this->sellOrders.push(val);
+// Only an atomic increment unless the book is shrinking or shrunk
+Orderbook::Activity::Activity(Orderbook& book) : book(book) {
+    book.users.fetch_add(1);
+    book.touched.store(true, std::memory_order_relaxed);
+    if (book.shrinking.load() || book.stub.load()) {
+        std::lock_guard<std::mutex> lock(book.activity_mutex);
+        if (book.state == nullptr) {
+            book.expand();
+            book.stub.store(false);
+        }
     }
 }
 
-// Get the top order
-std::optional<std::shared_ptr<RestingOrder>> Orderbook::get_top_order(std::string side) {
-    if (side == "buy") {
-        std::lock_guard<std::mutex> lock(this->buyPQMutex);
-        if (!this->buyOrders.empty()) {
-            return this->buyOrders.top();
-        } else {
-            return std::nullopt;
+// The last command out puts the orders it used back into compact form
+Orderbook::Activity::~Activity() {
+    if (this->book.users.load() == 1) {
+        this->book.state->buyOrders->settle();
+        this->book.state->sellOrders->settle();
+    }
+    this->book.users.fetch_sub(1);
+}
+
+/*
+A book must have gone a whole interval without an Activity to shrink, so one
+that trades now and then keeps its state. With no command using the book every
+order is ready and nothing is in flight, so the level maps can be rebuilt from
+the records. Other side books hold RestingOrder objects, which are only
+dropped along with the side books once the levels say nothing rests.
+An Activity increments users and then reads shrinking, this sets shrinking and
+then reads users, all sequentially consistent. So either this sees the
+Activity and backs off, or the Activity sees shrinking and waits for
+activity_mutex, by when the state is either kept or gone and marked stub.
+*/
+void Orderbook::shrink_if_idle() {
+    std::lock_guard<std::mutex> lock(this->activity_mutex);
+    if (this->state == nullptr || this->touched.exchange(false, std::memory_order_relaxed)) {
+        return;
+    }
+    this->shrinking.store(true);
+    if (this->users.load() > 0) {
+        this->shrinking.store(false);
+        return;
+    }
+    this->shrink_locked();
+    this->shrinking.store(false);
+}
+
+// Must hold activity_mutex with shrinking set and no Activity held
+void Orderbook::shrink_locked() {
+    if (this->compact && !this->ladder.has_value()) {
+        CompactSideBook& buys = static_cast<CompactSideBook&>(*this->state->buyOrders);
+        CompactSideBook& sells = static_cast<CompactSideBook&>(*this->state->sellOrders);
+        if (!buys.settled() || !sells.settled()) {
+            return;
         }
-    } else {
-        std::lock_guard<std::mutex> lock(this->sellPQMutex);
-        if (!this->sellOrders.empty()) {
-            return this->sellOrders.top();
-        } else {
-            return std::nullopt;
+        std::array<CompactLevels, 2> records {buys.release(), sells.release()};
+        if (!records[0].empty() || !records[1].empty()) {
+            this->frozen = std::make_unique<std::array<CompactLevels, 2>>(std::move(records));
         }
+    } else if (!this->state->buyLevels.empty() || !this->state->sellLevels.empty()) {
+        return;
     }
+    this->state.reset();
+    this->stub.store(true);
+}
+
+bool Orderbook::empty_stub() {
+    std::lock_guard<std::mutex> lock(this->activity_mutex);
+    return this->state == nullptr && this->frozen == nullptr;
+}
+
+AsyncMutex& Orderbook::side_mutex(const std::string& side) {
+    return side == "buy" ? this->state->buyMutex : this->state->sellMutex;
+}
+
+SideBook& Orderbook::side_book(const std::string& side) {
+    return side == "buy" ? *this->state->buyOrders : *this->state->sellOrders;
+}
+
+std::shared_ptr<RestingOrder> Orderbook::insert_order(const std::string& side, uint32_t order_id, const std::string& instrument, uint32_t price, uint32_t count, intmax_t timestamp, uint32_t stp_key, uint32_t owner) {
+    std::shared_ptr<RestingOrder> order = std::make_shared<RestingOrder>(order_id, instrument, price, count, side, timestamp, stp_key, owner);
+    this->side_book(side).push(order);
+    return order;
+}
+
+void Orderbook::insert_order_with_val(const std::string& side, std::shared_ptr<RestingOrder> val) {
+    this->side_book(side).push(std::move(val));
+}
+
+// Get the top order
+std::optional<std::shared_ptr<RestingOrder>> Orderbook::get_top_order(std::string side) {
+    return this->side_book(side).top();
 }
 
 // Pop the top order
 std::optional<std::shared_ptr<RestingOrder>> Orderbook::popTopOrder(std::string side) {
+    return this->side_book(side).pop();
+}
+
+// Pop top order if deleted
+void Orderbook::popTopOrderIfDeleted(std::string side, intmax_t curr_timestamp) {
+    this->side_book(side).pop_if_deleted(curr_timestamp);
+}
+
+std::shared_ptr<RestingOrder> Orderbook::find_order(const std::string& side, uint32_t price, intmax_t timestamp, uint32_t order_id) {
+    return this->side_book(side).find_order(order_id, price, timestamp);
+}
+
+void Orderbook::forget(const std::string& side, uint32_t order_id, OrderIndex &order_map) {
+    this->side_book(side).forget_order(order_id);
+    order_map.erase(order_id);
+}
+
+void Orderbook::add_level_quantity(const std::string& side, uint32_t price, uint64_t count) {
+    std::lock_guard<std::mutex> lock(this->state->levelsMutex);
     if (side == "buy") {
-        std::lock_guard<std::mutex> lock(this->buyPQMutex);
-        if (!this->buyOrders.empty()) {
-            std::optional<std::shared_ptr<RestingOrder>> order = this->buyOrders.top();
-            this->buyOrders.pop();
-            return order;
-        }
+        this->state->buyLevels[price] += count;
     } else {
-        std::lock_guard<std::mutex> lock(this->sellPQMutex);
-        if (!this->sellOrders.empty()) {
-            std::optional<std::shared_ptr<RestingOrder>> order = this->sellOrders.top();
-            this->sellOrders.pop();
-            return order;
-        }
+        this->state->sellLevels[price] += count;
     }
+    this->publish_bbo();
+}
 
-    return std::nullopt;
+void Orderbook::remove_level_quantity(const std::string& side, uint32_t price, uint64_t count) {
+    std::lock_guard<std::mutex> lock(this->state->levelsMutex);
+    std::map<uint32_t, uint64_t>& levels = side == "buy" ? this->state->buyLevels : this->state->sellLevels;
+    auto it = levels.find(price);
+    if (it == levels.end()) {
+        return;
+    }
+    it->second -= std::min(it->second, count);
+    if (it->second == 0) {
+        levels.erase(it);
+    }
+    this->publish_bbo();
 }
 
-// Pop top order if deleted
-void Orderbook::popTopOrderIfDeleted(std::string side, intmax_t curr_timestamp) {
+// Must hold levelsMutex
+void Orderbook::publish_bbo() {
+    BestBidOffer top;
+    if (!this->state->buyLevels.empty()) {
+        auto best = this->state->buyLevels.rbegin();
+        top.bid_price = best->first;
+        top.bid_count = best->second;
+    }
+    if (!this->state->sellLevels.empty()) {
+        auto best = this->state->sellLevels.begin();
+        top.ask_price = best->first;
+        top.ask_count = best->second;
+    }
+    this->bbo.store(top);
+}
+
+BestBidOffer Orderbook::get_bbo() const {
+    return this->bbo.load();
+}
+
+uint64_t Orderbook::available_quantity(const std::string& side, uint32_t price, uint64_t needed) {
+    std::lock_guard<std::mutex> lock(this->state->levelsMutex);
+    uint64_t available = 0;
     if (side == "buy") {
-        std::lock_guard<std::mutex> lock(this->buyPQMutex);
-        if (!this->buyOrders.empty() && this->buyOrders.top()->get_deleted_timestamp() >= 0 && this->buyOrders.top()->get_deleted_timestamp() <= curr_timestamp) {
-            this->buyOrders.pop();
+        for (auto it = this->state->buyLevels.rbegin(); it != this->state->buyLevels.rend() && it->first >= price && available < needed; it++) {
+            available += it->second;
         }
     } else {
-        std::lock_guard<std::mutex> lock(this->sellPQMutex);
-        if (!this->sellOrders.empty() && this->sellOrders.top()->get_deleted_timestamp() >= 0 && this->sellOrders.top()->get_deleted_timestamp() <= curr_timestamp) {
-            this->sellOrders.pop();
+        for (auto it = this->state->sellLevels.begin(); it != this->state->sellLevels.end() && it->first <= price && available < needed; it++) {
+            available += it->second;
         }
     }
+    return available;
+}
+
+bool Orderbook::crosses_levels(const std::string& side, uint32_t price) const {
+    if (side == "buy") {
+        return !this->state->sellLevels.empty() && this->state->sellLevels.begin()->first <= price;
+    }
+    return !this->state->buyLevels.empty() && this->state->buyLevels.rbegin()->first >= price;
+}
+
+bool Orderbook::crosses_in_flight(const std::string& side, uint32_t price) const {
+    if (side == "buy") {
+        return !this->state->sellInFlight.empty() && *this->state->sellInFlight.begin() <= price;
+    }
+    return !this->state->buyInFlight.empty() && *this->state->buyInFlight.rbegin() >= price;
 }
 
 /*
@@ -90,12 +238,173 @@ Prevent any other incoming order from getting processed.
 Get timestamp and insert order with is_ready set to false.
 */ 
 std::pair<intmax_t, std::shared_ptr<RestingOrder>> Orderbook::initialOrderProcessing(std::string side, uint32_t price, uint32_t count, uint32_t order_id,
-	ts_orderbook_hashmap<uint32_t, RestingOrder> &order_map) {
+	uint32_t stp_key, OrderIndex &order_map, uint32_t owner) {
     // Acquire full orderbook lock
-    std::lock_guard<std::mutex> lock(this->incoming_order_mutex);
+    TracedLock<std::mutex> lock(this->state->incoming_order_mutex, trace_book_lock_wait);
+    {
+        std::lock_guard<std::mutex> levels_lock(this->state->levelsMutex);
+        (side == "buy" ? this->state->buyInFlight : this->state->sellInFlight).insert(price);
+    }
     intmax_t timestamp = getCurrentTimestamp();
     // Insert into side
-    std::shared_ptr<RestingOrder> order = this->insert_order(side, order_id, this->instrument, price, count, timestamp);
-    order_map.insert(order_id, order);
+    std::shared_ptr<RestingOrder> order = this->insert_order(side, order_id, this->instrument, price, count, timestamp, stp_key, owner);
+    this->side_book(side).track_order(order);
+    order_map.insert(order_id, {this, side == "buy", price, timestamp});
     return std::make_pair(timestamp, order);
 }
+
+intmax_t Orderbook::reserveTimestamp() {
+    TracedLock<std::mutex> lock(this->state->incoming_order_mutex, trace_book_lock_wait);
+    return getCurrentTimestamp();
+}
+
+std::pair<intmax_t, bool> Orderbook::reserveFillOrKillTimestamp(const std::string& side, uint32_t price, uint64_t needed) {
+    TracedLock<std::mutex> lock(this->state->incoming_order_mutex, trace_book_lock_wait);
+    intmax_t timestamp = getCurrentTimestamp();
+    return {timestamp, this->available_quantity(side, price, needed) >= needed};
+}
+
+void Orderbook::finishOrderProcessing(const std::string& side, uint32_t price, uint32_t count_left) {
+    std::lock_guard<std::mutex> lock(this->state->levelsMutex);
+    std::multiset<uint32_t>& in_flight = side == "buy" ? this->state->buyInFlight : this->state->sellInFlight;
+    in_flight.erase(in_flight.find(price));
+    if (count_left > 0) {
+        (side == "buy" ? this->state->buyLevels : this->state->sellLevels)[price] += count_left;
+        this->publish_bbo();
+    }
+}
+
+/*
+Fast path for orders priced away from the market.
+Holding incoming_order_mutex means no other order can take a timestamp, and every
+opposite order with an earlier timestamp is either in the levels or in flight, so
+checking both is enough to know the order cannot trade. Levels only ever lag by
+still holding quantity that is being traded or cancelled, which errs towards the
+slow path. Its level is added before
+releasing the lock so later orders, FOK depth checks and post-only checks see it.
+*/
+Orderbook::PassiveOrder Orderbook::rest_passive_order(const std::string& side, uint32_t price, uint32_t count, uint32_t order_id, uint32_t stp_key, bool reject_if_crossing,
+    OrderIndex &order_map, uint32_t owner) {
+    TracedLock<std::mutex> lock(this->state->incoming_order_mutex, trace_book_lock_wait);
+    std::lock_guard<std::mutex> levels_lock(this->state->levelsMutex);
+    if (this->crosses_levels(side, price) || this->crosses_in_flight(side, price)) {
+        if (reject_if_crossing) {
+            return {PassiveOrder::rejected, getCurrentTimestamp(), nullptr};
+        }
+        return {PassiveOrder::crosses, -1, nullptr};
+    }
+    auto [timestamp, order] = this->rest(side, price, count, order_id, stp_key, order_map, owner);
+    return {PassiveOrder::rested, timestamp, order};
+}
+
+std::pair<intmax_t, std::shared_ptr<RestingOrder>> Orderbook::rest(const std::string& side, uint32_t price, uint32_t count, uint32_t order_id, uint32_t stp_key,
+    OrderIndex &order_map, uint32_t owner) {
+    intmax_t timestamp = getCurrentTimestamp();
+    std::shared_ptr<RestingOrder> order = this->insert_order(side, order_id, this->instrument, price, count, timestamp, stp_key, owner);
+    this->side_book(side).track_order(order);
+    order_map.insert(order_id, {this, side == "buy", price, timestamp});
+    (side == "buy" ? this->state->buyLevels : this->state->sellLevels)[price] += count;
+    this->publish_bbo();
+    return {timestamp, order};
+}
+
+Orderbook::PassiveOrder Orderbook::rest_call_order(const std::string& side, uint32_t price, uint32_t count, uint32_t order_id, uint32_t stp_key,
+    OrderIndex &order_map, uint32_t owner) {
+    TracedLock<std::mutex> lock(this->state->incoming_order_mutex, trace_book_lock_wait);
+    std::lock_guard<std::mutex> levels_lock(this->state->levelsMutex);
+    auto [timestamp, order] = this->rest(side, price, count, order_id, stp_key, order_map, owner);
+    return {PassiveOrder::rested, timestamp, order};
+}
+
+std::shared_ptr<RestingOrder> Orderbook::next_auction_order(const std::string& side, uint32_t price) {
+    while (true) {
+        std::optional<std::shared_ptr<RestingOrder>> top = this->popTopOrder(side);
+        if (!top.has_value()) {
+            return nullptr;
+        }
+        std::shared_ptr<RestingOrder> order = top.value();
+        // Cancelled and filled orders are dropped here, as when matching
+        if (order->get_deleted_timestamp() >= 0 || order->get_count() == 0) {
+            continue;
+        }
+        if (side == "buy" ? order->get_price() < price : order->get_price() > price) {
+            this->insert_order_with_val(side, std::move(order));
+            return nullptr;
+        }
+        return order;
+    }
+}
+
+/*
+Call auction uncross.
+Only prices between the best ask and the best bid can clear, so just those levels
+go into the clearing price calculation. Both sides are then filled in priority
+order at the clearing price until its volume is used up: the levels say exactly
+how much is resting, so every order walked past is live and priced to trade.
+Each execution is reported against the order that arrived first, as if it was
+resting when the other arrived.
+*/
+ClearingPrice Orderbook::uncross(intmax_t timestamp, std::vector<AuctionFill>& fills, OrderIndex &order_map, bool vectorised) {
+    std::lock_guard<std::mutex> lock(this->state->levelsMutex);
+    if (this->state->buyLevels.empty() || this->state->sellLevels.empty() || this->state->buyLevels.rbegin()->first < this->state->sellLevels.begin()->first) {
+        return {};
+    }
+    thread_local std::vector<uint32_t> prices;
+    thread_local std::vector<uint64_t> buy;
+    thread_local std::vector<uint64_t> sell;
+    prices.clear();
+    buy.clear();
+    sell.clear();
+    auto bid = this->state->buyLevels.lower_bound(this->state->sellLevels.begin()->first);
+    auto ask = this->state->sellLevels.begin();
+    auto ask_end = this->state->sellLevels.upper_bound(this->state->buyLevels.rbegin()->first);
+    while (bid != this->state->buyLevels.end() || ask != ask_end) {
+        uint32_t price = bid == this->state->buyLevels.end() ? ask->first : ask == ask_end ? bid->first : std::min(bid->first, ask->first);
+        prices.push_back(price);
+        buy.push_back(bid != this->state->buyLevels.end() && bid->first == price ? (bid++)->second : 0);
+        sell.push_back(ask != ask_end && ask->first == price ? (ask++)->second : 0);
+    }
+    ClearingPrice clearing = find_clearing_price(prices.data(), buy.data(), sell.data(), prices.size(), vectorised);
+
+    uint64_t left = clearing.volume;
+    std::shared_ptr<RestingOrder> buy_order;
+    std::shared_ptr<RestingOrder> sell_order;
+    while (left > 0) {
+        if (buy_order == nullptr) {
+            buy_order = this->next_auction_order("buy", clearing.price);
+        }
+        if (sell_order == nullptr) {
+            sell_order = this->next_auction_order("sell", clearing.price);
+        }
+        if (buy_order == nullptr || sell_order == nullptr) {
+            break;
+        }
+        uint32_t count = std::min<uint64_t>({buy_order->get_count(), sell_order->get_count(), left});
+        bool buy_first = buy_order->get_timestamp() < sell_order->get_timestamp();
+        std::shared_ptr<RestingOrder>& earlier = buy_first ? buy_order : sell_order;
+        fills.push_back({earlier, buy_first ? sell_order : buy_order, earlier->get_execution_id(), count});
+        left -= count;
+        for (std::shared_ptr<RestingOrder>* order : {&buy_order, &sell_order}) {
+            std::map<uint32_t, uint64_t>& levels = order == &buy_order ? this->state->buyLevels : this->state->sellLevels;
+            auto level = levels.find((*order)->get_price());
+            if ((level->second -= count) == 0) {
+                levels.erase(level);
+            }
+            (*order)->decrease_count(count);
+            if ((*order)->get_count() == 0) {
+                (*order)->delete_order(timestamp);
+                this->forget(order == &buy_order ? "buy" : "sell", (*order)->get_order_id(), order_map);
+                *order = nullptr;
+            }
+        }
+    }
+    // Partly filled orders keep their place
+    if (buy_order != nullptr) {
+        this->insert_order_with_val("buy", std::move(buy_order));
+    }
+    if (sell_order != nullptr) {
+        this->insert_order_with_val("sell", std::move(sell_order));
+    }
+    this->publish_bbo();
+    return clearing;
+}
@@ -1,58 +1,109 @@
 #ifndef ORDERBOOK_H
 #define ORDERBOOK_H
 
+#include <array>
+#include <atomic>
 #include <list>
+#include <map>
+#include <set>
 #include <queue>
 #include <optional>
 #include "order.h"
 #include <memory>
 #include "ts_orderbook_hashmap.hpp"
-
-struct BuyOrderComparator {
-    bool operator()(const std::shared_ptr<RestingOrder>& a, const std::shared_ptr<RestingOrder>& b) const {
-        uint32_t a_price = a->get_price();
-        uint32_t b_price = b->get_price();
-        if (a_price != b_price) 
-            return a_price < b_price; // Priority highest price
-        else
-            return a->get_timestamp() > b->get_timestamp();
-    }
-};
-
-struct SellOrderComparator {
-    bool operator()(const std::shared_ptr<RestingOrder>& a, const std::shared_ptr<RestingOrder>& b) const {
-        uint32_t a_price = a->get_price();
-        uint32_t b_price = b->get_price();
-        if (a_price != b_price)
-            return a_price > b_price;
-        else
-            return a->get_timestamp() > b->get_timestamp();
-    }
-};
+#include "bbo_cache.hpp"
+#include "sidebook.h"
+#include "compact_book.h"
+#include "order_index.h"
+#include "auction.h"
 
 class Orderbook {
 private:
-    std::priority_queue<std::shared_ptr<RestingOrder>, std::vector<std::shared_ptr<RestingOrder>>, BuyOrderComparator> buyOrders;
-    // mutex for protecting PQ operations
-    std::mutex buyPQMutex;
-    std::priority_queue<std::shared_ptr<RestingOrder>, std::vector<std::shared_ptr<RestingOrder>>, SellOrderComparator> sellOrders;
-    // mutex for protecting PQ operations
-    std::mutex sellPQMutex;
+    // Everything a book needs to trade, dropped by shrink_if_idle while the book is idle
+    struct State {
+        // Side books guard their own structure, see sidebook.h
+        std::unique_ptr<SideBook> buyOrders;
+        std::unique_ptr<SideBook> sellOrders;
+        std::mutex incoming_order_mutex;
+        // Resting quantity aggregated per price level, only holds orders that are ready
+        std::map<uint32_t, uint64_t> buyLevels;
+        std::map<uint32_t, uint64_t> sellLevels;
+        // Prices of orders that took a timestamp in initialOrderProcessing and have
+        // not finished matching yet, their remainder may still rest at that price
+        std::multiset<uint32_t> buyInFlight;
+        std::multiset<uint32_t> sellInFlight;
+        // mutex for protecting level and in flight updates, also serialises writes to bbo
+        std::mutex levelsMutex;
+        // mutex for blocking processing sell orders, held across a task's suspensions
+        AsyncMutex sellMutex;
+        // mutex for blocking processing buy orders
+        AsyncMutex buyMutex;
+    };
+
     std::string instrument;
-    std::mutex incoming_order_mutex;
+    std::optional<LadderConfig> ladder;
+    bool skiplist;
+    bool compact;
+    std::unique_ptr<State> state;
+    // A shrunk compact book's buy and sell records, null if it had none
+    std::unique_ptr<std::array<CompactLevels, 2>> frozen;
+    // Guards state and frozen while the book shrinks or expands. An Activity only
+    // takes it while a shrink is under way or the book is a stub, see shrink_if_idle.
+    std::mutex activity_mutex;
+    std::atomic<uint32_t> users{0};
+    // Set by shrink_if_idle while it holds activity_mutex
+    std::atomic<bool> shrinking{false};
+    // Set while state is null
+    std::atomic<bool> stub{false};
+    // Set by every Activity, cleared by shrink_if_idle
+    std::atomic<bool> touched{false};
+    BboCache bbo;
+
+    // Must hold activity_mutex
+    void expand();
+    void shrink_locked();
+    void publish_bbo();
+    // Must hold levelsMutex
+    bool crosses_levels(const std::string& side, uint32_t price) const;
+    bool crosses_in_flight(const std::string& side, uint32_t price) const;
+    SideBook& side_book(const std::string& side);
+    // Must hold incoming_order_mutex and levelsMutex
+    std::pair<intmax_t, std::shared_ptr<RestingOrder>> rest(const std::string& side, uint32_t price, uint32_t count, uint32_t order_id, uint32_t stp_key,
+        OrderIndex &order_map, uint32_t owner);
+    // Pops side's next order that is still live and can trade at price, nullptr if there is none
+    std::shared_ptr<RestingOrder> next_auction_order(const std::string& side, uint32_t price);
 public:
-    Orderbook(std::string instrument);
+    // Uses a flat price ladder for both sides if a ladder config is given, otherwise
+    // compact records if compact is set, a concurrent skiplist if skiplist is set and a heap if not
+    Orderbook(std::string instrument, std::optional<LadderConfig> ladder = std::nullopt, bool skiplist = false, bool compact = false);
+
+    // Held by every command for as long as it uses the book, which expands it if it was shrunk
+    class Activity {
+    private:
+        Orderbook& book;
+    public:
+        explicit Activity(Orderbook& book);
+        ~Activity();
+        Activity(const Activity&) = delete;
+        Activity& operator=(const Activity&) = delete;
+    };
+
+    // Drops the book's locks, level maps and side books if no Activity has been held since
+    // the last call. Compact books keep their records, other books only shrink when empty.
+    void shrink_if_idle();
+    // Shrunk with nothing resting, so there is nothing to uncross
+    bool empty_stub();
 
-    // mutex for blocking processing sell orders
-    std::mutex sellMutex;
-    // mutex for blocking processing buy orders
-    std::mutex buyMutex;
+    // The side's mutex that a command holds while it matches orders of that side
+    AsyncMutex& side_mutex(const std::string& side);
+    // Orders admitted to this book that have not finished, see AdmissionTicket
+    std::atomic<uint32_t> queue_depth{0};
 
     // Delete copy constructor and copy assignment operator
     Orderbook(const Orderbook&) = delete;
     Orderbook& operator=(const Orderbook&) = delete;
 
-    std::shared_ptr<RestingOrder> insert_order(const std::string& side, uint32_t order_id, const std::string& instrument, uint32_t price, uint32_t count, uint32_t timestamp);
+    std::shared_ptr<RestingOrder> insert_order(const std::string& side, uint32_t order_id, const std::string& instrument, uint32_t price, uint32_t count, intmax_t timestamp, uint32_t stp_key = 0, uint32_t owner = 0);
     void insert_order_with_val(const std::string& side, std::shared_ptr<RestingOrder> val);
     // Get the top order
     std::optional<std::shared_ptr<RestingOrder>> get_top_order(std::string side);
@@ -63,7 +114,50 @@ public:
     // Pop top order if deleted before the provided timestamp
     void popTopOrderIfDeleted(std::string side, intmax_t curr_timestamp);
 
-    std::pair<intmax_t, std::shared_ptr<RestingOrder>>initialOrderProcessing(std::string side, uint32_t price, uint32_t count, uint32_t order_id, ts_orderbook_hashmap<uint32_t, RestingOrder> &order_map);
+    // A resting order for a cancel, nullptr if it is no longer resting on side at price
+    std::shared_ptr<RestingOrder> find_order(const std::string& side, uint32_t price, intmax_t timestamp, uint32_t order_id);
+    // Drops a deleted order from the side book's and order_map's lookups
+    void forget(const std::string& side, uint32_t order_id, OrderIndex &order_map);
+
+    // Update aggregated level quantity and republish the best bid/offer
+    void add_level_quantity(const std::string& side, uint32_t price, uint64_t count);
+    void remove_level_quantity(const std::string& side, uint32_t price, uint64_t count);
+
+    // Read the cached best bid/offer without taking any lock
+    BestBidOffer get_bbo() const;
+
+    // Resting quantity on side that would trade with an opposite order at price, stops counting at needed
+    uint64_t available_quantity(const std::string& side, uint32_t price, uint64_t needed);
+    std::pair<intmax_t, std::shared_ptr<RestingOrder>>initialOrderProcessing(std::string side, uint32_t price, uint32_t count, uint32_t order_id, uint32_t stp_key, OrderIndex &order_map, uint32_t owner = 0);
+
+    // Take a timestamp in the same sequence as initialOrderProcessing without inserting anything
+    intmax_t reserveTimestamp();
+
+    // reserveTimestamp for a fill-or-kill order, with whether side's levels hold needed at that timestamp.
+    // Passive orders rest without the side mutexes, so the check must not see ones stamped after it.
+    std::pair<intmax_t, bool> reserveFillOrKillTimestamp(const std::string& side, uint32_t price, uint64_t needed);
+
+    // Ends an order from initialOrderProcessing, count_left is added to its level if it rests
+    void finishOrderProcessing(const std::string& side, uint32_t price, uint32_t count_left);
+
+    struct PassiveOrder {
+        enum Outcome { rested, rejected, crosses } outcome;
+        intmax_t timestamp = -1;             // rested and rejected only
+        std::shared_ptr<RestingOrder> order; // rested only, not ready yet
+    };
+    // Rests an order that cannot trade without taking the side mutexes. It is checked against the
+    // opposite levels and in flight orders, then timestamped and inserted with its level at once.
+    // If it might cross, no timestamp is taken. Levels can lag behind orders that are still matching,
+    // so only a caller holding both side mutexes can set reject_if_crossing to reject at a timestamp.
+    PassiveOrder rest_passive_order(const std::string& side, uint32_t price, uint32_t count, uint32_t order_id, uint32_t stp_key, bool reject_if_crossing, OrderIndex &order_map,
+        uint32_t owner = 0);
+
+    // Rests an order during a call period, where nothing matches until the uncross, so crossing orders rest too
+    PassiveOrder rest_call_order(const std::string& side, uint32_t price, uint32_t count, uint32_t order_id, uint32_t stp_key, OrderIndex &order_map,
+        uint32_t owner = 0);
 
+    // Ends a call period: every order that can trade at the clearing price does, all at timestamp.
+    // Appends the executions to fills in priority order and forgets filled orders. No other thread may be using the book.
+    ClearingPrice uncross(intmax_t timestamp, std::vector<AuctionFill>& fills, OrderIndex &order_map, bool vectorised = true);
 };
 #endif 
\ No newline at end of file
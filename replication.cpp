@@ -0,0 +1,233 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "replication.h"
+
+namespace {
+
+sockaddr_un socket_address(const std::string& path) {
+    sockaddr_un address {};
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    return address;
+}
+
+} // namespace
+
+// A socket file left behind by a primary that died is replaced
+std::unique_ptr<Replicator> Replicator::listen(const std::string& path, size_t log_limit) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return nullptr;
+    }
+    sockaddr_un address = socket_address(path);
+    unlink(path.c_str());
+    if (bind(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 || ::listen(fd, 8) != 0) {
+        close(fd);
+        return nullptr;
+    }
+    int wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wake_fd == -1) {
+        close(fd);
+        return nullptr;
+    }
+    std::unique_ptr<Replicator> replicator(new Replicator(fd, wake_fd, log_limit));
+    std::thread(&Replicator::accept_thread, replicator.get()).detach();
+    std::thread(&Replicator::send_thread, replicator.get()).detach();
+    return replicator;
+}
+
+void Replicator::accept_thread() {
+    while (true) {
+        int fd = accept4(this->listen_fd, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+        if (fd == -1) {
+            continue;
+        }
+        bool wake_sender;
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->joining.push_back(fd);
+            wake_sender = std::exchange(this->sender_waiting, false);
+        }
+        if (wake_sender) {
+            this->wake_sender();
+        }
+    }
+}
+
+void Replicator::wake_sender() {
+    uint64_t one = 1;
+    ssize_t written = write(this->wake_fd, &one, sizeof(one));
+    (void)written; // only fails if the counter is already non-zero, which wakes the sender too
+}
+
+bool Replicator::write_to(Follower& follower) {
+    uint64_t end = this->base + this->records.size();
+    while (follower.position < end) {
+        const char* data = reinterpret_cast<const char*>(this->records.data() + (follower.position - this->base)) + follower.partial;
+        size_t left = (end - follower.position) * sizeof(ReplicationRecord) - follower.partial;
+        ssize_t sent = send(follower.fd, data, left, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        size_t taken = follower.partial + sent;
+        follower.position += taken / sizeof(ReplicationRecord);
+        follower.partial = taken % sizeof(ReplicationRecord);
+        follower.progress = std::chrono::steady_clock::now();
+    }
+    return true;
+}
+
+/*
+Takes the pending records and new followers, writes what each follower can
+take, then sleeps in poll until a record is appended or a follower that is
+behind has room again. Waking every second notices followers that hang.
+*/
+void Replicator::send_thread() {
+    std::vector<ReplicationRecord> batch;
+    std::vector<int> joined;
+    std::vector<pollfd> polled;
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            batch.swap(this->pending);
+            joined.swap(this->joining);
+        }
+        this->records.insert(this->records.end(), batch.begin(), batch.end());
+        batch.clear();
+        auto now = std::chrono::steady_clock::now();
+        // A new follower starts from the beginning of the stream
+        for (int fd : joined) {
+            if (!this->log_complete) {
+                SyncCerr {} << "Refused a follower, the replication log passed " << this->log_limit << " commands" << std::endl;
+                close(fd);
+            } else {
+                this->followers.push_back({fd, 0, 0, this->base + this->records.size(), now});
+            }
+        }
+        joined.clear();
+
+        uint64_t end = this->base + this->records.size();
+        uint64_t taken = end;
+        uint64_t oldest = end;
+        for (auto it = this->followers.begin(); it != this->followers.end();) {
+            Follower& follower = *it;
+            uint64_t before = follower.position;
+            bool gone = !this->write_to(follower);
+            if (follower.position == end) {
+                follower.progress = now;
+            }
+            if (gone || now - follower.progress > follower_timeout) {
+                SyncCerr {} << "Dropped a follower that " << (gone ? "is gone" : "has taken nothing for too long")
+                            << " at record " << follower.position << std::endl;
+                close(follower.fd);
+                it = this->followers.erase(it);
+                continue;
+            }
+            uint64_t took = follower.position - before;
+            follower.allowed_lag -= std::min(follower.allowed_lag, (took + 1) / 2);
+            follower.allowed_lag = std::min(follower.allowed_lag, end - follower.position);
+            taken = std::min(taken, follower.position + follower.allowed_lag);
+            oldest = std::min(oldest, follower.position);
+            it++;
+        }
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->sent = taken;
+        }
+        this->sent_wake.notify_all();
+
+        if (this->log_complete && this->records.size() > this->log_limit) {
+            this->log_complete = false;
+            SyncCerr {} << "Replication log passed " << this->log_limit << " commands, later followers are refused" << std::endl;
+        }
+        // Past the limit only what a follower still has to take is kept, dropped in large steps
+        if (!this->log_complete && oldest - this->base >= std::max<size_t>(4096, this->records.size() / 2)) {
+            this->records.erase(this->records.begin(), this->records.begin() + (oldest - this->base));
+            this->base = oldest;
+        }
+
+        polled.assign(1, pollfd {this->wake_fd, POLLIN, 0});
+        for (const Follower& follower : this->followers) {
+            if (follower.position < end) {
+                polled.push_back(pollfd {follower.fd, POLLOUT, 0});
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            if (!this->pending.empty() || !this->joining.empty()) {
+                continue;
+            }
+            this->sender_waiting = true;
+        }
+        poll(polled.data(), polled.size(), polled.size() > 1 ? 1000 : -1);
+        uint64_t wakes;
+        ssize_t cleared = read(this->wake_fd, &wakes, sizeof(wakes));
+        (void)cleared; // EAGAIN if the sender woke for a follower instead
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->sender_waiting = false;
+    }
+}
+
+void Replicator::wait_sent(uint64_t sequence) {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->sent_wake.wait(lock, [&] { return this->sent >= sequence; });
+}
+
+ReplicationStream::~ReplicationStream() {
+    close(this->fd);
+}
+
+std::unique_ptr<ReplicationStream> ReplicationStream::connect(const std::string& path, unsigned timeout_ms) {
+    sockaddr_un address = socket_address(path);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    while (true) {
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1) {
+            return nullptr;
+        }
+        if (::connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0) {
+            return std::unique_ptr<ReplicationStream>(new ReplicationStream(fd));
+        }
+        close(fd);
+        if (std::chrono::steady_clock::now() >= deadline) {
+            return nullptr;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
+
+bool ReplicationStream::read(std::vector<ReplicationRecord>& records) {
+    records.clear();
+    while (records.empty()) {
+        ssize_t received = recv(this->fd, this->buffer.data() + this->buffered, this->buffer.size() - this->buffered, 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return false;
+        }
+        this->buffered += received;
+        size_t whole = this->buffered / sizeof(ReplicationRecord);
+        records.resize(whole);
+        std::memcpy(records.data(), this->buffer.data(), whole * sizeof(ReplicationRecord));
+        // Keep the start of a record split across reads
+        size_t used = whole * sizeof(ReplicationRecord);
+        std::memmove(this->buffer.data(), this->buffer.data() + used, this->buffered - used);
+        this->buffered -= used;
+    }
+    return true;
+}
@@ -0,0 +1,135 @@
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "io.hpp"
+
+// One handled command in the primary's sequence. Every command that takes a
+// timestamp is replicated, so the timestamps are dense and a follower can tell
+// a record that has not arrived yet from the end of the stream.
+struct ReplicationRecord {
+    int64_t timestamp;
+    ClientCommand command;
+    uint32_t session_key; // resolves the command's default self-trade prevention key
+    uint32_t rejected;    // the RejectReason if admission control rejected it, it only takes its timestamp, else 0
+};
+static_assert(sizeof(ReplicationRecord) == 48, "ReplicationRecord is the wire format");
+
+/*
+Primary side. Command threads append records as they take their timestamps, and
+one sender thread writes them to the followers without blocking, each follower
+from its own position in the stream. A command's events wait until every live
+follower has taken its record, see wait_sent, so a client never sees a command
+the followers could lose. A follower that is slow to take records holds the
+primary back to its pace instead of being dropped, so it lags by no more than
+what the sockets buffer.
+A follower that connects later replays the stream from the start. It may lag by
+as much as it did when it joined, and that allowance shrinks by half of every
+record it takes. So the primary goes at half its pace until it has caught up
+and is live. The stream is kept in memory for such followers until it reaches
+log_limit records. Past that only what a follower has not taken yet is kept,
+and later followers are refused. A follower is only dropped if it is gone or
+takes nothing for follower_timeout while it has records to take.
+*/
+class Replicator {
+private:
+    struct Follower {
+        int fd;
+        uint64_t position = 0; // records taken
+        size_t partial = 0;    // bytes of the next record taken
+        uint64_t allowed_lag;  // records it may still lag by, 0 once it is live
+        std::chrono::steady_clock::time_point progress; // when it last took anything
+    };
+
+    int listen_fd;
+    int wake_fd; // eventfd the sender polls with its followers
+    std::mutex mutex;
+    bool sender_waiting = false;
+    std::vector<ReplicationRecord> pending;
+    std::vector<int> joining;
+    std::condition_variable sent_wake;
+    uint64_t appended = 0;
+    uint64_t sent = 0; // records every follower has taken, or may still lag behind
+
+    // Sender thread only
+    const size_t log_limit;
+    bool log_complete = true; // false once the stream passed log_limit and its start was dropped
+    std::vector<ReplicationRecord> records; // the stream from record base on
+    uint64_t base = 0;
+    std::vector<Follower> followers;
+
+    Replicator(int listen_fd, int wake_fd, size_t log_limit) : listen_fd(listen_fd), wake_fd(wake_fd), log_limit(log_limit) {}
+    void accept_thread();
+    void send_thread();
+    // Writes what the follower can take, false if it is gone
+    bool write_to(Follower& follower);
+    void wake_sender();
+public:
+    // A follower that takes nothing for this long while it has records to take is hung
+    static constexpr std::chrono::seconds follower_timeout {10};
+
+    Replicator(const Replicator&) = delete;
+    Replicator& operator=(const Replicator&) = delete;
+
+    // Listens for followers on path and starts the sender, nullptr on failure.
+    // Followers can join until log_limit records have been sent.
+    static std::unique_ptr<Replicator> listen(const std::string& path, size_t log_limit);
+
+    // Sets record's timestamp from take_timestamp and appends it, returning its place in the
+    // stream for wait_sent. Both happen under the mutex, so the stream is in timestamp order
+    // and a follower never has a later command than one it is missing. Only wakes the sender if it is idle.
+    template <typename TakeTimestamp>
+    uint64_t append(ReplicationRecord& record, TakeTimestamp take_timestamp) {
+        bool wake_sender;
+        uint64_t sequence;
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            record.timestamp = take_timestamp();
+            this->pending.push_back(record);
+            sequence = ++this->appended;
+            wake_sender = std::exchange(this->sender_waiting, false);
+        }
+        if (wake_sender) {
+            this->wake_sender();
+        }
+        return sequence;
+    }
+
+    // For a record that already has its timestamp
+    uint64_t append(ReplicationRecord record) {
+        int64_t timestamp = record.timestamp;
+        return this->append(record, [timestamp] { return timestamp; });
+    }
+
+    // Blocks until every live follower has taken the record append returned sequence for,
+    // and every follower still catching up is within its allowed lag of it
+    void wait_sent(uint64_t sequence);
+};
+
+// Follower side, a primary's stream of records in the order it sent them
+class ReplicationStream {
+private:
+    int fd;
+    std::vector<char> buffer;
+    size_t buffered = 0;
+
+    explicit ReplicationStream(int fd) : fd(fd), buffer(1 << 16) {}
+public:
+    ReplicationStream(const ReplicationStream&) = delete;
+    ReplicationStream& operator=(const ReplicationStream&) = delete;
+    ~ReplicationStream();
+
+    // Connects to a primary's replication socket, retrying for up to timeout_ms
+    static std::unique_ptr<ReplicationStream> connect(const std::string& path, unsigned timeout_ms);
+
+    // Replaces records with the next records received, false once the primary is gone
+    bool read(std::vector<ReplicationRecord>& records);
+};
+
+#endif
@@ -0,0 +1,146 @@
+#include <algorithm>
+#include <cerrno>
+#include <thread>
+#include <unordered_map>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "report_session.h"
+
+// Sessions whose sockets were full, each held until its socket is writable
+struct ReportSession::Poller {
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    std::mutex mutex;
+    std::unordered_map<ReportSession*, std::shared_ptr<ReportSession>> waiting;
+
+    void run() {
+        epoll_event events[64];
+        while (true) {
+            int ready_count = epoll_wait(this->epoll_fd, events, 64, -1);
+            for (int i = 0; i < ready_count; i++) {
+                std::shared_ptr<ReportSession> session;
+                {
+                    std::lock_guard<std::mutex> lock(this->mutex);
+                    auto it = this->waiting.find(static_cast<ReportSession*>(events[i].data.ptr));
+                    if (it == this->waiting.end()) {
+                        continue;
+                    }
+                    session = std::move(it->second);
+                    this->waiting.erase(it);
+                }
+                // Sends without blocking, so one client cannot hold up the others here either
+                session->flush();
+            }
+        }
+    }
+};
+
+ReportSession::Poller& ReportSession::poller() {
+    static Poller poller;
+    static std::once_flag started;
+    std::call_once(started, [] { std::thread(&Poller::run, &poller).detach(); });
+    return poller;
+}
+
+ReportSession::ReportSession(int fd) : fd(fd) {}
+
+ReportSession::~ReportSession() {
+    if (this->polled) {
+        epoll_ctl(poller().epoll_fd, EPOLL_CTL_DEL, this->fd, nullptr);
+    }
+    close(this->fd);
+}
+
+void ReportSession::publish(const EngineEvent& event) {
+    if (this->broken.load(std::memory_order_relaxed)) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(this->buffer_mutex);
+        this->buffer.push_back(event);
+    }
+    auto it = std::find_if(dirty.begin(), dirty.end(), [this](const std::shared_ptr<ReportSession>& s) { return s.get() == this; });
+    if (it == dirty.end()) {
+        dirty.push_back(this->shared_from_this());
+    }
+}
+
+void ReportSession::flush_dirty() {
+    for (const std::shared_ptr<ReportSession>& session : dirty) {
+        session->flush();
+    }
+    dirty.clear();
+}
+
+void ReportSession::wait_writable(std::shared_ptr<ReportSession> session) {
+    Poller& poller = ReportSession::poller();
+    std::lock_guard<std::mutex> lock(poller.mutex);
+    ReportSession* key = session.get();
+    if (!poller.waiting.emplace(key, std::move(session)).second) {
+        // Already waiting, the poller flushes everything once it is writable
+        return;
+    }
+    epoll_event event {};
+    event.events = EPOLLOUT | EPOLLONESHOT;
+    event.data.ptr = key;
+    // One shot, so it is armed again for every wait and fires for one
+    if (epoll_ctl(poller.epoll_fd, key->polled ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, key->fd, &event) == 0) {
+        key->polled = true;
+    } else {
+        key->broken.store(true, std::memory_order_relaxed);
+        poller.waiting.erase(key);
+    }
+}
+
+// Whoever holds write_mutex sends for everyone. The request flag is set before
+// trying the lock and checked after unlocking, so a thread that backs off is
+// always picked up by the writer it backed off from. A writer that finds the
+// socket full keeps the rest in unsent and leaves it, and anything published
+// after, to the report poller.
+void ReportSession::flush() {
+    this->flush_requested.store(true);
+    std::vector<EngineEvent> batch;
+    while (this->flush_requested.load() && this->write_mutex.try_lock()) {
+        this->flush_requested.store(false);
+        batch.clear();
+        {
+            std::lock_guard<std::mutex> lock(this->buffer_mutex);
+            batch.swap(this->buffer);
+        }
+        const char* events = reinterpret_cast<const char*>(batch.data());
+        this->unsent.insert(this->unsent.end(), events, events + batch.size() * sizeof(EngineEvent));
+        size_t done = 0;
+        bool would_block = false;
+        while (done < this->unsent.size() && !this->broken.load(std::memory_order_relaxed)) {
+            ssize_t sent = send(this->fd, this->unsent.data() + done, this->unsent.size() - done, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                would_block = true;
+                break;
+            }
+            if (sent <= 0) {
+                // The client went away
+                this->broken.store(true, std::memory_order_relaxed);
+                break;
+            }
+            done += sent;
+        }
+        this->unsent.erase(this->unsent.begin(), this->unsent.begin() + done);
+        if (this->unsent.size() > max_unsent) {
+            // A client this far behind has stopped reading, it loses the rest of its reports
+            this->broken.store(true, std::memory_order_relaxed);
+        }
+        if (this->broken.load(std::memory_order_relaxed)) {
+            std::vector<char>().swap(this->unsent);
+            would_block = false;
+        }
+        this->write_mutex.unlock();
+        if (would_block) {
+            // flush_requested may be left set, the poller's flush picks it up
+            wait_writable(this->shared_from_this());
+            return;
+        }
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef REPORT_SESSION_H
+#define REPORT_SESSION_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "io.hpp"
+
+// Execution reports for one socket connection, written back to the client as
+// EngineEvent records. Any thread can publish to a session: the connection's
+// own commands and the executions or cancels of its resting orders by others.
+// Events are buffered and sent by flush_dirty at the end of a command, so one
+// write carries everything published since the last one. Those writes never
+// block: whatever the socket does not take stays with the session, which the
+// report poller holds until its socket is writable again. A session whose
+// backlog outgrows max_unsent is dropped, the others are not held up by it.
+class ReportSession : public EventSink, public std::enable_shared_from_this<ReportSession> {
+private:
+    int fd;
+    std::mutex buffer_mutex;
+    std::vector<EngineEvent> buffer;
+    // Held while writing, a thread that finds it taken leaves its events to the writer
+    std::mutex write_mutex;
+    // Bytes taken from buffer that the socket has not accepted yet, guarded by write_mutex
+    std::vector<char> unsent;
+    std::atomic<bool> flush_requested{false};
+    // Set once a write fails or the backlog overflows, events are dropped from then on
+    std::atomic<bool> broken{false};
+    // Whether fd was ever added to the report poller's epoll set, guarded by the poller's mutex
+    bool polled = false;
+
+    // Sessions this thread published to since its last flush_dirty
+    inline static thread_local std::vector<std::shared_ptr<ReportSession>> dirty;
+
+    struct Poller;
+    static Poller& poller();
+    // Sends what the socket takes now, a full socket hands the session to the report poller
+    void flush();
+    // Holds the session until its socket is writable, then flushes it from the report poller's thread
+    static void wait_writable(std::shared_ptr<ReportSession> session);
+public:
+    // Unsent bytes a session may pile up before it is dropped
+    static constexpr size_t max_unsent = 4 << 20;
+
+    // Takes ownership of fd, a duplicate of the connection's socket
+    explicit ReportSession(int fd);
+    ~ReportSession();
+    ReportSession(const ReportSession&) = delete;
+    ReportSession& operator=(const ReportSession&) = delete;
+
+    void publish(const EngineEvent& event) override;
+
+    // Writes out the sessions this thread published to. Call with no book locks held.
+    static void flush_dirty();
+};
+
+#endif
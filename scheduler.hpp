@@ -0,0 +1,588 @@
+#ifndef SCHEDULER_HPP
+#define SCHEDULER_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "flight_recorder.hpp"
+
+class Scheduler;
+
+// Thread locals that belong to a task rather than to the thread running it.
+// A task saves them when it suspends and restores them on whichever worker
+// resumes it.
+struct TaskContext {
+    virtual ~TaskContext() = default;
+    virtual void save() = 0;
+    virtual void restore() = 0;
+};
+
+// Context of the task running on this thread, null if it has none
+inline thread_local TaskContext* current_task_context = nullptr;
+
+// A suspended task, queued on whatever it waits for
+struct Waiter {
+    std::coroutine_handle<> handle;
+    Scheduler* scheduler = nullptr;
+    TaskContext* context = nullptr;
+    Waiter* next = nullptr;
+
+    // Queues the task on its scheduler. The waiter lives in the task's frame,
+    // so it must not be touched afterwards.
+    void wake();
+};
+
+// Base of the awaiters that can suspend a task
+class Suspension {
+protected:
+    Waiter waiter;
+
+    // Call from await_suspend before the waiter is visible to whoever wakes it
+    void suspending(std::coroutine_handle<> handle);
+
+    // Call first in await_resume
+    void resumed() {
+        if (this->waiter.context != nullptr) {
+            this->waiter.context->restore();
+            current_task_context = this->waiter.context;
+        }
+    }
+};
+
+template<typename T = void>
+class Task;
+
+struct TaskPromiseBase {
+    std::coroutine_handle<> continuation = std::noop_coroutine();
+    // Set by the first of the task finishing and its awaiter suspending, the
+    // second then knows the awaiter is suspended and must be resumed. A task
+    // that finishes without suspending returns to its awaiter like a call, so
+    // a loop of awaits does not grow the stack.
+    std::atomic<bool> rendezvous{false};
+
+    // Resumes the awaiter if it suspended, otherwise returns to it
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        template<typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+            TaskPromiseBase& promise = handle.promise();
+            return promise.rendezvous.exchange(true) ? promise.continuation : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { std::terminate(); }
+};
+
+template<typename T>
+struct TaskPromise : TaskPromiseBase {
+    std::optional<T> value;
+
+    Task<T> get_return_object();
+    void return_value(T value) { this->value.emplace(std::move(value)); }
+    T result() { return std::move(*this->value); }
+};
+
+template<>
+struct TaskPromise<void> : TaskPromiseBase {
+    Task<void> get_return_object();
+    void return_void() {}
+    void result() {}
+};
+
+// A coroutine that starts when it is awaited and resumes its awaiter when it
+// finishes. Awaiting one runs it on the awaiting thread until it either
+// finishes or suspends on something it waits for.
+template<typename T>
+class [[nodiscard]] Task {
+public:
+    using promise_type = TaskPromise<T>;
+
+private:
+    std::coroutine_handle<promise_type> handle;
+
+public:
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+    Task(Task&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    Task& operator=(Task&& other) = delete;
+    ~Task() {
+        if (this->handle) {
+            this->handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        this->handle.promise().continuation = awaiting;
+        this->handle.resume();
+        return !this->handle.promise().rendezvous.exchange(true);
+    }
+    T await_resume() { return this->handle.promise().result(); }
+
+    // Runs the task on this thread. Off a scheduler's workers nothing a task
+    // awaits suspends, it blocks instead, so the task has finished on return.
+    T run() {
+        this->handle.resume();
+        if (!this->handle.done()) {
+            std::terminate();
+        }
+        return this->handle.promise().result();
+    }
+};
+
+template<typename T>
+Task<T> TaskPromise<T>::get_return_object() {
+    return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() {
+    return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+// Runs tasks on a fixed set of worker threads. A task that waits on an
+// AsyncMutex, a resting order's readiness, the auction gate, its socket or a
+// deadline suspends and is queued again once it can continue, so a few workers
+// keep any number of tasks moving. Off the workers the same awaits block instead.
+class Scheduler {
+private:
+    // Frame of a spawned task, destroyed once the task finishes
+    struct Detached {
+        struct promise_type {
+            Detached get_return_object() noexcept { return {}; }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() noexcept {}
+            void unhandled_exception() { std::terminate(); }
+        };
+    };
+
+    // Moves a new task onto a worker
+    struct ScheduleAwaiter {
+        Scheduler& scheduler;
+        bool await_ready() noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle) { this->scheduler.schedule(handle); }
+        void await_resume() noexcept {}
+    };
+
+    std::mutex mutex;
+    std::condition_variable work;
+    std::deque<std::coroutine_handle<>> ready;
+    std::vector<std::thread> workers;
+    bool stopping = false;
+    // Runs on the worker each time a task suspends or finishes
+    std::function<void()> after_slice;
+    int epoll_fd;
+    int wake_fd;
+    int timer_fd;
+    std::thread poller;
+    // Held while a socket is armed and while its waiter is woken. epoll orders the two
+    // already, this makes it plain to the thread sanitizer. Also guards timers.
+    std::mutex poll_mutex;
+    // Sleeping tasks as a heap, the earliest deadline first. timer_fd fires at that one.
+    using Timer = std::pair<std::chrono::steady_clock::time_point, Waiter*>;
+    std::vector<Timer> timers;
+
+    inline static thread_local Scheduler* current_scheduler = nullptr;
+
+    static Detached start(Scheduler& scheduler, Task<void> task) {
+        co_await ScheduleAwaiter {scheduler};
+        co_await task;
+    }
+
+    void worker() {
+        current_scheduler = this;
+        std::unique_lock<std::mutex> lock(this->mutex);
+        while (true) {
+            this->work.wait(lock, [this] { return this->stopping || !this->ready.empty(); });
+            if (this->stopping) {
+                return;
+            }
+            std::coroutine_handle<> handle = this->ready.front();
+            this->ready.pop_front();
+            lock.unlock();
+            current_task_context = nullptr;
+            handle.resume();
+            if (this->after_slice) {
+                this->after_slice();
+            }
+            lock.lock();
+        }
+    }
+
+    static bool later(const Timer& a, const Timer& b) { return a.first > b.first; }
+
+    // Points timer_fd at the earliest deadline. Must hold poll_mutex
+    void arm_timer() {
+        itimerspec spec {};
+        if (!this->timers.empty()) {
+            auto since_epoch = this->timers.front().first.time_since_epoch();
+            auto seconds = std::chrono::duration_cast<std::chrono::seconds>(since_epoch);
+            spec.it_value.tv_sec = seconds.count();
+            spec.it_value.tv_nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(since_epoch - seconds).count();
+            // A zero it_value disarms the timer, a deadline at the epoch has long passed anyway
+            if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) {
+                spec.it_value.tv_nsec = 1;
+            }
+        }
+        // steady_clock is CLOCK_MONOTONIC
+        timerfd_settime(this->timer_fd, TFD_TIMER_ABSTIME, &spec, nullptr);
+    }
+
+    void add_timer(std::chrono::steady_clock::time_point deadline, Waiter* waiter) {
+        std::lock_guard<std::mutex> lock(this->poll_mutex);
+        this->timers.emplace_back(deadline, waiter);
+        std::push_heap(this->timers.begin(), this->timers.end(), &Scheduler::later);
+        if (this->timers.front().second == waiter) {
+            this->arm_timer();
+        }
+    }
+
+    // Wakes the tasks whose deadlines have passed. Must hold poll_mutex
+    void expire_timers() {
+        uint64_t expirations;
+        // Nothing to read if it was rearmed since it fired, the deadlines are checked either way
+        while (read(this->timer_fd, &expirations, sizeof(expirations)) < 0 && errno == EINTR) {
+        }
+        auto now = std::chrono::steady_clock::now();
+        while (!this->timers.empty() && this->timers.front().first <= now) {
+            std::pop_heap(this->timers.begin(), this->timers.end(), &Scheduler::later);
+            Waiter* waiter = this->timers.back().second;
+            this->timers.pop_back();
+            waiter->wake();
+        }
+        this->arm_timer();
+    }
+
+    // Wakes the tasks whose sockets became readable or whose deadlines passed
+    void poll_sockets() {
+        epoll_event events[64];
+        while (true) {
+            int ready_count = epoll_wait(this->epoll_fd, events, 64, -1);
+            std::lock_guard<std::mutex> lock(this->poll_mutex);
+            for (int i = 0; i < ready_count; i++) {
+                if (events[i].data.ptr == nullptr) {
+                    return;
+                }
+                if (events[i].data.ptr == &this->timer_fd) {
+                    this->expire_timers();
+                    continue;
+                }
+                static_cast<Waiter*>(events[i].data.ptr)->wake();
+            }
+        }
+    }
+
+public:
+    // Awaits data on a socket. Only the socket's own task may wait on it.
+    class ReadableAwaiter : public Suspension {
+    private:
+        int fd;
+    public:
+        explicit ReadableAwaiter(int fd) : fd(fd) {}
+
+        bool await_ready() {
+            if (Scheduler::current() != nullptr) {
+                return false;
+            }
+            pollfd pfd {this->fd, POLLIN, 0};
+            while (::poll(&pfd, 1, -1) < 0 && errno == EINTR) {
+            }
+            return true;
+        }
+
+        bool await_suspend(std::coroutine_handle<> handle) {
+            this->suspending(handle);
+            epoll_event event {};
+            event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+            event.data.ptr = &this->waiter;
+            int epoll_fd = this->waiter.scheduler->epoll_fd;
+            std::lock_guard<std::mutex> lock(this->waiter.scheduler->poll_mutex);
+            // One shot, so it is armed again for every wait and fires for one
+            return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, this->fd, &event) == 0 || (errno == ENOENT && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, this->fd, &event) == 0);
+        }
+
+        void await_resume() { this->resumed(); }
+    };
+
+    // Awaits a deadline. Off the workers the thread sleeps until then.
+    class SleepAwaiter : public Suspension {
+    private:
+        std::chrono::steady_clock::time_point deadline;
+    public:
+        explicit SleepAwaiter(std::chrono::steady_clock::time_point deadline) : deadline(deadline) {}
+
+        bool await_ready() {
+            if (std::chrono::steady_clock::now() >= this->deadline) {
+                return true;
+            }
+            if (Scheduler::current() != nullptr) {
+                return false;
+            }
+            std::this_thread::sleep_until(this->deadline);
+            return true;
+        }
+
+        void await_suspend(std::coroutine_handle<> handle) {
+            this->suspending(handle);
+            this->waiter.scheduler->add_timer(this->deadline, &this->waiter);
+        }
+
+        void await_resume() { this->resumed(); }
+    };
+
+    // Lets the tasks waiting for a worker run first, if there are any
+    class YieldAwaiter : public Suspension {
+    public:
+        bool await_ready() {
+            Scheduler* scheduler = Scheduler::current();
+            if (scheduler == nullptr) {
+                return true;
+            }
+            std::lock_guard<std::mutex> lock(scheduler->mutex);
+            return scheduler->ready.empty();
+        }
+
+        void await_suspend(std::coroutine_handle<> handle) {
+            this->suspending(handle);
+            this->waiter.wake();
+        }
+
+        void await_resume() { this->resumed(); }
+    };
+
+    // after_slice runs on the worker every time a task suspends or finishes
+    explicit Scheduler(unsigned threads, std::function<void()> after_slice = {}) : after_slice(std::move(after_slice)) {
+        this->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        this->wake_fd = eventfd(0, EFD_CLOEXEC);
+        epoll_event event {};
+        event.events = EPOLLIN;
+        event.data.ptr = nullptr;
+        epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, this->wake_fd, &event);
+        this->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+        event.data.ptr = &this->timer_fd;
+        epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, this->timer_fd, &event);
+        for (unsigned i = 0; i < std::max(threads, 1u); i++) {
+            this->workers.emplace_back(&Scheduler::worker, this);
+        }
+        this->poller = std::thread(&Scheduler::poll_sockets, this);
+    }
+
+    // Tasks that have not finished are abandoned
+    ~Scheduler() {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->stopping = true;
+        }
+        this->work.notify_all();
+        for (std::thread& worker : this->workers) {
+            worker.join();
+        }
+        uint64_t one = 1;
+        if (write(this->wake_fd, &one, sizeof(one)) == sizeof(one)) {
+            this->poller.join();
+        } else {
+            this->poller.detach();
+        }
+        close(this->wake_fd);
+        close(this->timer_fd);
+        close(this->epoll_fd);
+    }
+
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+    // The scheduler whose worker is running this thread, null off the workers
+    static Scheduler* current() { return current_scheduler; }
+
+    unsigned size() const { return this->workers.size(); }
+
+    void schedule(std::coroutine_handle<> handle) {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->ready.push_back(handle);
+        }
+        this->work.notify_one();
+    }
+
+    // Runs task on the workers, the caller does not wait for it
+    void spawn(Task<void> task) {
+        start(*this, std::move(task));
+    }
+
+    static ReadableAwaiter readable(int fd) { return ReadableAwaiter(fd); }
+
+    static YieldAwaiter yield() { return YieldAwaiter(); }
+
+    static SleepAwaiter sleep_until(std::chrono::steady_clock::time_point deadline) { return SleepAwaiter(deadline); }
+
+    // Stops watching a socket its task waited on, before the socket is closed or handed on
+    void forget(int fd) {
+        epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    }
+};
+
+inline void Waiter::wake() {
+    this->scheduler->schedule(this->handle);
+}
+
+inline void Suspension::suspending(std::coroutine_handle<> handle) {
+    this->waiter.handle = handle;
+    this->waiter.scheduler = Scheduler::current();
+    this->waiter.context = current_task_context;
+    if (this->waiter.context != nullptr) {
+        this->waiter.context->save();
+    }
+}
+
+// Mutex a task can hold across suspensions, so it may be unlocked by another
+// thread than the one that locked it. unlock hands it straight to the longest
+// waiting thread or task. Threads block in lock(), tasks on a worker suspend
+// in lock_async() instead.
+class AsyncMutex {
+private:
+    struct Queued {
+        Waiter* task = nullptr;                    // a suspended task
+        std::condition_variable* thread = nullptr; // or a blocked thread
+        bool granted = false;
+        Queued* next = nullptr;
+    };
+
+    std::mutex state;
+    bool locked = false;
+    Queued* head = nullptr;
+    Queued* tail = nullptr;
+
+    // Must hold state
+    void enqueue(Queued* queued) {
+        if (this->tail == nullptr) {
+            this->head = queued;
+        } else {
+            this->tail->next = queued;
+        }
+        this->tail = queued;
+    }
+
+public:
+    class LockAwaiter : public Suspension {
+    private:
+        AsyncMutex& mutex;
+        TraceStage wait;
+        bool waited = false;
+        Queued queued;
+    public:
+        LockAwaiter(AsyncMutex& mutex, TraceStage wait) : mutex(mutex), wait(wait) {}
+
+        bool await_ready() {
+            if (this->mutex.try_lock()) {
+                return true;
+            }
+            this->waited = this->wait != trace_stage_count;
+            if (this->waited) {
+                FlightRecorder::record(this->wait);
+            }
+            if (Scheduler::current() != nullptr) {
+                return false;
+            }
+            this->mutex.lock();
+            return true;
+        }
+
+        bool await_suspend(std::coroutine_handle<> handle) {
+            this->suspending(handle);
+            std::lock_guard<std::mutex> lock(this->mutex.state);
+            if (!this->mutex.locked) {
+                this->mutex.locked = true;
+                return false;
+            }
+            this->queued.task = &this->waiter;
+            this->mutex.enqueue(&this->queued);
+            return true;
+        }
+
+        std::unique_lock<AsyncMutex> await_resume() {
+            this->resumed();
+            if (this->waited) {
+                FlightRecorder::record(static_cast<TraceStage>(this->wait + 1));
+            }
+            return std::unique_lock<AsyncMutex>(this->mutex, std::adopt_lock);
+        }
+    };
+
+    AsyncMutex() = default;
+    AsyncMutex(const AsyncMutex&) = delete;
+    AsyncMutex& operator=(const AsyncMutex&) = delete;
+
+    bool try_lock() {
+        std::lock_guard<std::mutex> lock(this->state);
+        if (this->locked) {
+            return false;
+        }
+        this->locked = true;
+        return true;
+    }
+
+    void lock() {
+        std::unique_lock<std::mutex> lock(this->state);
+        if (!this->locked) {
+            this->locked = true;
+            return;
+        }
+        std::condition_variable granted;
+        Queued queued;
+        queued.thread = &granted;
+        this->enqueue(&queued);
+        granted.wait(lock, [&queued] { return queued.granted; });
+    }
+
+    void unlock() {
+        Waiter* task;
+        {
+            std::lock_guard<std::mutex> lock(this->state);
+            Queued* next = this->head;
+            if (next == nullptr) {
+                this->locked = false;
+                return;
+            }
+            this->head = next->next;
+            if (this->head == nullptr) {
+                this->tail = nullptr;
+            }
+            next->granted = true;
+            if (next->thread != nullptr) {
+                // Under state, the condition variable goes away once its thread sees granted
+                next->thread->notify_one();
+                return;
+            }
+            task = next->task;
+        }
+        // Nothing else can wake the task, so its waiter is still there
+        task->wake();
+    }
+
+    // Awaits the mutex and returns it locked. If it has to wait, wait and
+    // wait + 1 are stamped in the flight recorder, unless wait is trace_stage_count.
+    LockAwaiter lock_async(TraceStage wait = trace_stage_count) { return LockAwaiter(*this, wait); }
+};
+
+#endif
@@ -0,0 +1,1484 @@
+// Deterministic stress test for the engine.
+//
+// Generates a seeded workload of buy/sell/cancel commands spread over many
+// concurrent connections, runs it against a freshly started engine and checks
+// the engine's stdout against a single threaded reference matcher:
+// - every command is resolved exactly once (added, fully filled or cancelled)
+// - commands replayed in engine timestamp order produce exactly the same
+//   executions (price-time priority) and adds/cancels as the reference
+// - quantity is conserved for every aggressive and resting order
+// - once everything is resolved, the best bid/offer queried from the engine
+//   matches the top of the reference books
+//
+// A share of the orders carry IOC, FOK, post-only or self-trade prevention
+// flags, with each connection being its own self-trade prevention session.
+//
+// With -F the first connections flood the hot instrument as fast as they can
+// while the others send one order every -p microseconds, and the report adds
+// the well-behaved connections' order latency. Orders the engine rejects for
+// admission control (R T / R Q) are checked as leaving the books untouched.
+//
+// With -m every connection sends its commands over a shared memory session,
+// and the events handed back on the sessions' rings are counted against stdout.
+//
+// With -K the engine runs as a primary with a hot standby follower, and the
+// primary is killed once its output covers the given share of the commands.
+// The follower prints what it replays, which must include every line the
+// primary printed. It must take over with books equal to the reference
+// replayed up to the timestamp it took over at, checked through its best
+// bid/offer and by cancelling every order. With -g the follower is stopped for
+// a while halfway to the kill, so it lags the primary and must catch up.
+//
+// With -E every connection asks for execution reports, and each connection's
+// reports must be exactly the stdout events for its own orders, executions of
+// its resting orders included, plus its end marker's query.
+//
+// With -U the engine starts in a call period and an extra connection sends
+// the uncross once the given share of the commands is handled. Until then
+// every order rests, IOC and FOK are rejected. The uncross is the first
+// timestamp with executions, and they must be exactly the reference's: the
+// same clearing price per instrument and the same fills in priority order.
+//
+// The grader is not needed. Build the engine with -fsanitize=thread to run
+// the same workload under TSan; a non-zero engine exit status fails the run.
+
+#include <algorithm>
+#include <atomic>
+#include <cstdarg>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../io.hpp"
+#include "../shm_ring.hpp"
+
+namespace {
+
+struct Options {
+    const char* engine = "./engine";
+    uint64_t seed = 1;
+    int connections = 64;
+    long commands = 1000000;
+    int instruments = 4;
+    int hot_pct = 50; // share of orders sent to instrument 0
+    uint32_t base_price = 1000;
+    uint32_t price_band = 8;
+    uint32_t max_count = 100;
+    int cancel_pct = 20;
+    int flags_pct = 10; // share of orders with IOC/FOK/post-only/STP flags
+    int timeout_s = 30;
+    int flooders = 0;     // connections that flood the hot instrument
+    int flood_pct = 90;   // share of commands sent by the flooders
+    int pace_us = 0;      // gap between the other connections' commands
+    bool shm = false;     // shared memory sessions instead of writing to the socket
+    bool split = false;   // write socket commands in pieces, so the engine reads parts of commands
+    bool reports = false; // execution reports on every connection
+    int failover_pct = 0; // kill the primary after this share of the commands, 0 runs without a follower
+    int follower_pause_ms = 0; // stop the follower for this long halfway to the kill, so it lags
+    int auction_pct = 0;  // uncross an opening auction after this share of the commands, 0 runs without one
+    const char* dump_path = nullptr;
+    const char* engine_stderr = "/dev/null";
+    std::vector<const char*> engine_args;
+};
+
+struct OrderInfo {
+    uint32_t price = 0;
+    uint32_t count = 0;
+    uint16_t instrument = 0;
+    uint16_t connection = 0; // self-trade prevention session
+    uint8_t flags = 0;
+    bool sell = false;
+};
+
+constexpr uint8_t flag_choices[] = {
+    order_flag_ioc, order_flag_fok, order_flag_post_only, order_flag_stp, order_flag_ioc | order_flag_stp,
+};
+
+struct Workload {
+    std::vector<std::vector<ClientCommand>> per_connection;
+    std::vector<OrderInfo> orders; // indexed by order id, id 0 unused
+    std::vector<uint32_t> cancels_per_id;
+    long total = 0;
+};
+
+std::string instrument_name(int i) {
+    return "SYM" + std::to_string(i);
+}
+
+Workload generate(const Options& opt) {
+    Workload w;
+    w.per_connection.resize(opt.connections);
+    w.orders.emplace_back();
+    std::mt19937_64 rng(opt.seed);
+    auto uniform = [&rng](uint64_t n) { return static_cast<uint64_t>(rng() % n); };
+
+    for (long i = 0; i < opt.commands; i++) {
+        int conn = static_cast<int>(uniform(opt.connections));
+        bool flooding = false;
+        if (opt.flooders > 0 && opt.flooders < opt.connections) {
+            flooding = static_cast<int>(uniform(100)) < opt.flood_pct;
+            conn = flooding ? static_cast<int>(uniform(opt.flooders))
+                            : opt.flooders + static_cast<int>(uniform(opt.connections - opt.flooders));
+        }
+        std::vector<ClientCommand>& cmds = w.per_connection[conn];
+        ClientCommand cmd {};
+
+        if (static_cast<int>(uniform(100)) < opt.cancel_pct) {
+            // Cancel one of this connection's recent orders so that cancels
+            // race with concurrent fills of the same order.
+            std::vector<uint32_t> recent;
+            for (auto it = cmds.rbegin(); it != cmds.rend() && recent.size() < 8; it++) {
+                if (it->type != input_cancel) {
+                    recent.push_back(it->order_id);
+                }
+            }
+            if (!recent.empty()) {
+                cmd.type = input_cancel;
+                cmd.order_id = recent[uniform(recent.size())];
+                cmds.push_back(cmd);
+                w.total++;
+                continue;
+            }
+        }
+
+        OrderInfo info;
+        info.sell = uniform(2) == 1;
+        info.instrument = static_cast<int>(uniform(100)) < opt.hot_pct || opt.instruments == 1 || flooding
+            ? 0 : static_cast<uint16_t>(1 + uniform(opt.instruments - 1));
+        info.price = opt.base_price - opt.price_band / 2 + static_cast<uint32_t>(uniform(opt.price_band + 1));
+        info.count = 1 + static_cast<uint32_t>(uniform(opt.max_count));
+        info.connection = static_cast<uint16_t>(conn);
+        if (static_cast<int>(uniform(100)) < opt.flags_pct) {
+            info.flags = flag_choices[uniform(sizeof(flag_choices))];
+        }
+
+        cmd.type = info.sell ? input_sell : input_buy;
+        cmd.order_id = static_cast<uint32_t>(w.orders.size());
+        cmd.price = info.price;
+        cmd.count = info.count;
+        cmd.flags = info.flags;
+        std::string name = instrument_name(info.instrument);
+        std::strncpy(cmd.instrument, name.c_str(), sizeof(cmd.instrument) - 1);
+
+        w.orders.push_back(info);
+        cmds.push_back(cmd);
+        w.total++;
+    }
+    w.cancels_per_id.resize(w.orders.size());
+    for (const std::vector<ClientCommand>& cmds : w.per_connection) {
+        for (const ClientCommand& cmd : cmds) {
+            if (cmd.type == input_cancel) {
+                w.cancels_per_id[cmd.order_id]++;
+            }
+        }
+    }
+    return w;
+}
+
+// Write the workload in the grader's testcase format, flags use the client's syntax
+void dump_workload(const Workload& w, const char* path) {
+    std::ofstream out(path);
+    out << w.per_connection.size() << "\no\n";
+    for (size_t c = 0; c < w.per_connection.size(); c++) {
+        for (const ClientCommand& cmd : w.per_connection[c]) {
+            out << c << " " << static_cast<char>(cmd.type) << " " << cmd.order_id;
+            if (cmd.type != input_cancel) {
+                out << " " << cmd.instrument << " " << cmd.price << " " << cmd.count;
+                out << (cmd.flags & order_flag_ioc ? " IOC" : "") << (cmd.flags & order_flag_fok ? " FOK" : "")
+                    << (cmd.flags & order_flag_post_only ? " POST" : "") << (cmd.flags & order_flag_stp ? " STP" : "");
+            }
+            out << "\n";
+        }
+    }
+    out << "x\n";
+}
+
+struct Event {
+    char kind; // 'B', 'S', 'E', 'X' or 'R'
+    bool accepted;
+    char reason;
+    uint32_t id; // added/cancelled id, or resting id for executions
+    uint32_t new_id;
+    uint32_t exec_id;
+    uint32_t price;
+    uint32_t count;
+    char instrument[9];
+    intmax_t timestamp;
+    size_t line;
+};
+
+bool operator==(const Event& a, const Event& b) {
+    return a.kind == b.kind && a.accepted == b.accepted && a.reason == b.reason && a.id == b.id && a.new_id == b.new_id
+        && a.exec_id == b.exec_id && a.price == b.price && a.count == b.count
+        && std::strcmp(a.instrument, b.instrument) == 0;
+}
+
+std::string to_string(const Event& e) {
+    char buf[128];
+    switch (e.kind) {
+        case 'E':
+            std::snprintf(buf, sizeof(buf), "E %u %u %u %u %u", e.id, e.new_id, e.exec_id, e.price, e.count);
+            break;
+        case 'X':
+            std::snprintf(buf, sizeof(buf), "X %u %c", e.id, e.accepted ? 'A' : 'R');
+            break;
+        case 'R':
+            std::snprintf(buf, sizeof(buf), "R %u %c", e.id, e.reason);
+            break;
+        default:
+            std::snprintf(buf, sizeof(buf), "%c %u %s %u %u", e.kind, e.id, e.instrument, e.price, e.count);
+    }
+    return buf;
+}
+
+bool parse_event(const char* line, Event& e) {
+    e = Event {};
+    char* end;
+    auto next_u = [&end](const char* from) { return static_cast<uint32_t>(std::strtoul(from, &end, 10)); };
+    e.kind = line[0];
+    switch (e.kind) {
+        case 'B':
+        case 'S': {
+            e.id = next_u(line + 1);
+            const char* sym = end + 1;
+            size_t len = std::strcspn(sym, " ");
+            if (len >= sizeof(e.instrument)) {
+                return false;
+            }
+            std::memcpy(e.instrument, sym, len);
+            e.price = next_u(sym + len);
+            e.count = next_u(end);
+            break;
+        }
+        case 'E':
+            e.id = next_u(line + 1);
+            e.new_id = next_u(end);
+            e.exec_id = next_u(end);
+            e.price = next_u(end);
+            e.count = next_u(end);
+            break;
+        case 'X':
+            e.id = next_u(line + 1);
+            e.accepted = end[1] == 'A';
+            end += 2;
+            break;
+        case 'R':
+            e.id = next_u(line + 1);
+            e.reason = end[1];
+            end += 2;
+            break;
+        default:
+            return false;
+    }
+    e.timestamp = std::strtoll(end, &end, 10);
+    return true;
+}
+
+struct TopOfBook {
+    std::string instrument;
+    uint32_t bid_price = 0;
+    uint64_t bid_count = 0;
+    uint32_t ask_price = 0;
+    uint64_t ask_count = 0;
+    intmax_t timestamp = 0;
+};
+
+bool operator==(const TopOfBook& a, const TopOfBook& b) {
+    return a.instrument == b.instrument && a.bid_price == b.bid_price && a.bid_count == b.bid_count
+        && a.ask_price == b.ask_price && a.ask_count == b.ask_count;
+}
+
+std::string to_string(const TopOfBook& t) {
+    return t.instrument + " " + std::to_string(t.bid_count) + " @ " + std::to_string(t.bid_price) + " / "
+        + std::to_string(t.ask_count) + " @ " + std::to_string(t.ask_price);
+}
+
+bool parse_top_of_book(const char* line, TopOfBook& t) {
+    char sym[9];
+    unsigned long long bid_count, ask_count;
+    if (std::sscanf(line, "Q %8s %u %llu %u %llu %jd", sym, &t.bid_price, &bid_count, &t.ask_price, &ask_count, &t.timestamp) != 6) {
+        return false;
+    }
+    t.instrument = sym;
+    t.bid_count = bid_count;
+    t.ask_count = ask_count;
+    return true;
+}
+
+int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Reads the engine's stdout. Each connection ends with a query, so a
+// connection's commands are all resolved once its query is answered.
+struct OutputCollector {
+    std::vector<Event> events;
+    std::vector<int64_t> first_output_ns; // by order id, when the order's own first line arrived
+    std::vector<TopOfBook> tops;
+    std::atomic<size_t> tops_seen{0};
+    std::atomic<size_t> lines{0};
+    std::vector<std::string> bad_lines;
+    std::atomic<bool> done{false};
+    // Instrument of a query sent once, the lines read up to its answer are counted in marker_line
+    std::string marker;
+    std::atomic<size_t> marker_line{0};
+
+    void run(int fd) {
+        FILE* in = fdopen(fd, "r");
+        char* line = nullptr;
+        size_t cap = 0;
+        ssize_t len;
+        while ((len = getline(&line, &cap, in)) != -1) {
+            lines++;
+            if (line[len - 1] != '\n') {
+                // Cut off by the engine being killed
+                bad_lines.emplace_back(line, len);
+                continue;
+            }
+            if (line[0] == 'Q') {
+                TopOfBook t;
+                if (parse_top_of_book(line, t)) {
+                    if (t.instrument == marker) {
+                        marker_line = lines.load();
+                    }
+                    tops.push_back(t);
+                    tops_seen++;
+                } else {
+                    bad_lines.emplace_back(line, len);
+                }
+                continue;
+            }
+            Event e;
+            if (!parse_event(line, e)) {
+                bad_lines.emplace_back(line, len);
+                continue;
+            }
+            e.line = events.size();
+            events.push_back(e);
+            uint32_t id = e.kind == 'E' ? e.new_id : e.id;
+            if (id < first_output_ns.size() && first_output_ns[id] == 0) {
+                first_output_ns[id] = now_ns();
+            }
+        }
+        std::free(line);
+        std::fclose(in);
+        done = true;
+    }
+};
+
+struct RefOrder {
+    uint32_t id;
+    uint32_t price;
+    uint32_t count;
+    uint16_t connection;
+    uint64_t arrival; // which of two orders trading in an uncross counts as resting
+    uint32_t next_exec_id = 1;
+};
+
+// Single threaded price-time priority book used as the oracle
+struct RefBook {
+    std::map<uint32_t, std::deque<RefOrder>, std::greater<uint32_t>> bids;
+    std::map<uint32_t, std::deque<RefOrder>> asks;
+};
+
+struct Reference {
+    const Workload& w;
+    std::vector<RefBook> books;
+    std::vector<bool> resting;
+    uint64_t arrivals = 0;
+    // In a call period until the uncross at auction_timestamp
+    bool call = false;
+    intmax_t auction_timestamp = -1;
+
+    explicit Reference(const Workload& w, int instruments) : w(w), books(instruments), resting(w.orders.size()) {}
+
+    template <typename Levels>
+    void match(Levels& levels, uint32_t id, const OrderInfo& info, uint32_t& left, std::vector<Event>& out) {
+        while (left > 0 && !levels.empty()) {
+            auto level = levels.begin();
+            if (info.sell ? level->first < info.price : level->first > info.price) {
+                break;
+            }
+            RefOrder& rest = level->second.front();
+            if ((info.flags & order_flag_stp) && rest.connection == info.connection) {
+                Event e {};
+                e.kind = 'X';
+                e.id = rest.id;
+                e.accepted = true;
+                out.push_back(e);
+                resting[rest.id] = false;
+                level->second.pop_front();
+                if (level->second.empty()) {
+                    levels.erase(level);
+                }
+                continue;
+            }
+            uint32_t qty = std::min(left, rest.count);
+            Event e {};
+            e.kind = 'E';
+            e.id = rest.id;
+            e.new_id = id;
+            e.exec_id = rest.next_exec_id++;
+            e.price = rest.price;
+            e.count = qty;
+            out.push_back(e);
+            left -= qty;
+            rest.count -= qty;
+            if (rest.count == 0) {
+                resting[rest.id] = false;
+                level->second.pop_front();
+                if (level->second.empty()) {
+                    levels.erase(level);
+                }
+            }
+        }
+    }
+
+    template <typename Levels>
+    static uint64_t available(const Levels& levels, const OrderInfo& info) {
+        uint64_t total = 0;
+        for (const auto& [price, queue] : levels) {
+            if (info.sell ? price < info.price : price > info.price) {
+                break;
+            }
+            for (const RefOrder& o : queue) {
+                total += o.count;
+            }
+        }
+        return total;
+    }
+
+    std::vector<Event> new_order(uint32_t id) {
+        const OrderInfo& info = w.orders[id];
+        RefBook& book = books[info.instrument];
+        std::vector<Event> out;
+        uint32_t left = info.count;
+        uint64_t crossing = info.sell ? available(book.bids, info) : available(book.asks, info);
+        Event kill {};
+        kill.kind = 'X';
+        kill.id = id;
+        kill.accepted = true;
+        if (call && (info.flags & (order_flag_ioc | order_flag_fok))) {
+            Event e {};
+            e.kind = 'R';
+            e.id = id;
+            e.reason = reject_auction;
+            return {e};
+        }
+        if (call) {
+            // Nothing trades until the uncross
+            crossing = 0;
+        } else if ((info.flags & order_flag_fok) && crossing < info.count) {
+            return {kill};
+        }
+        if ((info.flags & order_flag_post_only) && crossing > 0) {
+            Event e {};
+            e.kind = 'R';
+            e.id = id;
+            e.reason = reject_post_only;
+            return {e};
+        }
+        if (call) {
+        } else if (info.sell) {
+            match(book.bids, id, info, left, out);
+        } else {
+            match(book.asks, id, info, left, out);
+        }
+        if (left > 0 && (info.flags & (order_flag_ioc | order_flag_fok))) {
+            out.push_back(kill);
+        } else if (left > 0) {
+            Event e {};
+            e.kind = info.sell ? 'S' : 'B';
+            e.id = id;
+            e.price = info.price;
+            e.count = left;
+            std::string name = instrument_name(info.instrument);
+            std::strncpy(e.instrument, name.c_str(), sizeof(e.instrument) - 1);
+            out.push_back(e);
+            resting[id] = true;
+            if (info.sell) {
+                book.asks[info.price].push_back({id, info.price, left, info.connection, arrivals++});
+            } else {
+                book.bids[info.price].push_back({id, info.price, left, info.connection, arrivals++});
+            }
+        }
+        return out;
+    }
+
+    template <typename Levels>
+    static void erase(Levels& levels, uint32_t id, uint32_t price) {
+        auto level = levels.find(price);
+        auto& queue = level->second;
+        queue.erase(std::find_if(queue.begin(), queue.end(), [id](const RefOrder& o) { return o.id == id; }));
+        if (queue.empty()) {
+            levels.erase(level);
+        }
+    }
+
+    // Executes everything that can trade at the price maximising volume, then
+    // minimising the surplus, then the lowest, with both sides in priority order
+    std::vector<Event> uncross(int instrument) {
+        RefBook& book = books[instrument];
+        std::map<uint32_t, std::pair<uint64_t, uint64_t>> levels;
+        for (const auto& [price, queue] : book.bids) {
+            for (const RefOrder& o : queue) {
+                levels[price].first += o.count;
+            }
+        }
+        for (const auto& [price, queue] : book.asks) {
+            for (const RefOrder& o : queue) {
+                levels[price].second += o.count;
+            }
+        }
+        uint32_t clearing = 0;
+        uint64_t volume = 0, surplus = 0;
+        for (const auto& [price, unused] : levels) {
+            uint64_t bid = 0, ask = 0;
+            for (const auto& [other, quantity] : levels) {
+                bid += other >= price ? quantity.first : 0;
+                ask += other <= price ? quantity.second : 0;
+            }
+            uint64_t executable = std::min(bid, ask);
+            uint64_t imbalance = std::max(bid, ask) - executable;
+            if (executable > volume || (executable == volume && volume > 0 && imbalance < surplus)) {
+                clearing = price;
+                volume = executable;
+                surplus = imbalance;
+            }
+        }
+        std::vector<Event> out;
+        while (volume > 0) {
+            auto bid_level = book.bids.begin();
+            auto ask_level = book.asks.begin();
+            RefOrder& bid = bid_level->second.front();
+            RefOrder& ask = ask_level->second.front();
+            RefOrder& earlier = bid.arrival < ask.arrival ? bid : ask;
+            Event e {};
+            e.kind = 'E';
+            e.id = earlier.id;
+            e.new_id = (&earlier == &bid ? ask : bid).id;
+            e.exec_id = earlier.next_exec_id++;
+            e.price = clearing;
+            e.count = std::min<uint64_t>({bid.count, ask.count, volume});
+            out.push_back(e);
+            volume -= e.count;
+            bid.count -= e.count;
+            ask.count -= e.count;
+            if (bid.count == 0) {
+                resting[bid.id] = false;
+                bid_level->second.pop_front();
+                if (bid_level->second.empty()) {
+                    book.bids.erase(bid_level);
+                }
+            }
+            if (ask.count == 0) {
+                resting[ask.id] = false;
+                ask_level->second.pop_front();
+                if (ask_level->second.empty()) {
+                    book.asks.erase(ask_level);
+                }
+            }
+        }
+        return out;
+    }
+
+    TopOfBook top(int instrument) {
+        TopOfBook t;
+        t.instrument = instrument_name(instrument);
+        const RefBook& book = books[instrument];
+        if (!book.bids.empty()) {
+            t.bid_price = book.bids.begin()->first;
+            for (const RefOrder& o : book.bids.begin()->second) {
+                t.bid_count += o.count;
+            }
+        }
+        if (!book.asks.empty()) {
+            t.ask_price = book.asks.begin()->first;
+            for (const RefOrder& o : book.asks.begin()->second) {
+                t.ask_count += o.count;
+            }
+        }
+        return t;
+    }
+
+    std::vector<Event> cancel(uint32_t id) {
+        Event e {};
+        e.kind = 'X';
+        e.id = id;
+        e.accepted = id < resting.size() && resting[id];
+        if (e.accepted) {
+            const OrderInfo& info = w.orders[id];
+            RefBook& book = books[info.instrument];
+            if (info.sell) {
+                erase(book.asks, id, info.price);
+            } else {
+                erase(book.bids, id, info.price);
+            }
+            resting[id] = false;
+        }
+        return {e};
+    }
+};
+
+int fail(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+int fail(const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    std::fputs("FAIL: ", stdout);
+    std::vprintf(fmt, args);
+    std::fputs("\n", stdout);
+    va_end(args);
+    return 1;
+}
+
+// Replays the engine's output for timestamps before `before` through ref, counting the commands in groups
+int replay(const Workload& w, const std::vector<Event>& events, intmax_t before, Reference& ref, long& groups) {
+    // Every command takes exactly one timestamp, so grouping the output by
+    // timestamp recovers the engine's serialisation of the commands.
+    std::vector<const Event*> sorted;
+    sorted.reserve(events.size());
+    for (const Event& e : events) {
+        if (e.timestamp < before) {
+            sorted.push_back(&e);
+        }
+    }
+    std::stable_sort(sorted.begin(), sorted.end(), [](const Event* a, const Event* b) { return a->timestamp < b->timestamp; });
+
+    std::vector<bool> seen(w.orders.size());
+    for (size_t begin = 0; begin < sorted.size();) {
+        size_t end = begin;
+        std::vector<Event> actual;
+        while (end < sorted.size() && sorted[end]->timestamp == sorted[begin]->timestamp) {
+            actual.push_back(*sorted[end++]);
+        }
+        // The command's own order comes last: self-trade prevention cancels
+        // precede its executions and add, and an X for an order that has not
+        // been seen yet is an IOC/FOK remainder rather than a cancel.
+        const Event& last = actual.back();
+        uint32_t id = last.kind == 'E' ? last.new_id : last.id;
+        std::vector<Event> expected;
+        if (last.timestamp == ref.auction_timestamp) {
+            // Instruments are uncrossed in parallel, each one's executions are printed together
+            for (size_t i = 0; i < ref.books.size(); i++) {
+                std::vector<Event> fills = ref.uncross(static_cast<int>(i));
+                expected.insert(expected.end(), fills.begin(), fills.end());
+            }
+            ref.call = false;
+            auto by_text = [](const Event& a, const Event& b) { return to_string(a) < to_string(b); };
+            std::sort(expected.begin(), expected.end(), by_text);
+            std::sort(actual.begin(), actual.end(), by_text);
+        } else if (last.kind == 'X' && seen[id]) {
+            expected = ref.cancel(id);
+        } else if (seen[id]) {
+            return fail("order %u resolved twice (timestamp %jd)", id, last.timestamp);
+        } else if (actual.size() == 1 && last.kind == 'R' && (last.reason == reject_throttled || last.reason == reject_queue_full)) {
+            // Admission control is the engine's call, the reference only checks the book is untouched
+            seen[id] = true;
+            expected = actual;
+        } else {
+            seen[id] = true;
+            expected = ref.new_order(id);
+        }
+        if (expected != actual) {
+            std::printf("FAIL: engine diverges from reference at timestamp %jd\n", last.timestamp);
+            std::printf("  expected:\n");
+            for (const Event& e : expected) {
+                std::printf("    %s\n", to_string(e).c_str());
+            }
+            std::printf("  engine:\n");
+            for (const Event& e : actual) {
+                std::printf("    %s (output line %zu)\n", to_string(e).c_str(), e.line + 1);
+            }
+            return 1;
+        }
+        groups++;
+        begin = end;
+    }
+    return 0;
+}
+
+// Nothing trades in the call period, so the first executions are the uncross. -1 if there are none.
+intmax_t uncross_timestamp(const OutputCollector& out) {
+    intmax_t auction = -1;
+    for (const Event& e : out.events) {
+        if (e.kind == 'E' && (auction == -1 || e.timestamp < auction)) {
+            auction = e.timestamp;
+        }
+    }
+    return auction;
+}
+
+int verify(const Options& opt, const Workload& w, const OutputCollector& out) {
+    if (!out.bad_lines.empty()) {
+        return fail("unparseable engine output: %s", out.bad_lines.front().c_str());
+    }
+    intmax_t auction = opt.auction_pct > 0 ? uncross_timestamp(out) : -1;
+    if (opt.auction_pct > 0 && auction == -1) {
+        return fail("the uncross executed nothing");
+    }
+
+    // Conservation of quantity, independent of any ordering
+    std::vector<uint64_t> filled_as_new(w.orders.size()), filled_as_resting(w.orders.size());
+    std::vector<uint64_t> added(w.orders.size());
+    std::vector<uint32_t> cancels(w.orders.size());
+    std::vector<bool> rejected(w.orders.size());
+    for (const Event& e : out.events) {
+        if (e.id == 0 || e.id >= w.orders.size() || (e.kind == 'E' && (e.new_id == 0 || e.new_id >= w.orders.size()))) {
+            return fail("output for unknown order: %s", to_string(e).c_str());
+        }
+        const OrderInfo& info = w.orders[e.id];
+        switch (e.kind) {
+            case 'E': {
+                const OrderInfo& aggressor = w.orders[e.new_id];
+                if (e.timestamp == auction) {
+                    // Both orders were resting and trade at the clearing price, within both limits
+                    const OrderInfo& buy = info.sell ? aggressor : info;
+                    const OrderInfo& sell = info.sell ? info : aggressor;
+                    if (info.instrument != aggressor.instrument || info.sell == aggressor.sell || e.price > buy.price || e.price < sell.price) {
+                        return fail("invalid uncross execution: %s", to_string(e).c_str());
+                    }
+                    filled_as_resting[e.id] += e.count;
+                    filled_as_resting[e.new_id] += e.count;
+                    break;
+                }
+                if (e.price != info.price || info.instrument != aggressor.instrument || info.sell == aggressor.sell
+                    || (aggressor.sell ? aggressor.price > info.price : aggressor.price < info.price)) {
+                    return fail("invalid execution: %s", to_string(e).c_str());
+                }
+                filled_as_new[e.new_id] += e.count;
+                filled_as_resting[e.id] += e.count;
+                break;
+            }
+            case 'X':
+                cancels[e.id]++;
+                break;
+            case 'R':
+                if (e.reason != reject_throttled && e.reason != reject_queue_full
+                    && (!(info.flags & order_flag_post_only) || e.reason != reject_post_only)
+                    && (opt.auction_pct == 0 || !(info.flags & (order_flag_ioc | order_flag_fok)) || e.reason != reject_auction)) {
+                    return fail("invalid reject: %s", to_string(e).c_str());
+                }
+                rejected[e.id] = true;
+                break;
+            default:
+                if (added[e.id] != 0 || (e.kind == 'S') != info.sell || e.price != info.price) {
+                    return fail("invalid add: %s", to_string(e).c_str());
+                }
+                added[e.id] = e.count;
+        }
+    }
+    for (size_t id = 1; id < w.orders.size(); id++) {
+        const OrderInfo& info = w.orders[id];
+        // IOC and FOK remainders are cancelled rather than added
+        bool never_rests = info.flags & (order_flag_ioc | order_flag_fok);
+        uint64_t expected = rejected[id] ? 0 : info.count;
+        if (never_rests ? added[id] != 0 || filled_as_new[id] > info.count : filled_as_new[id] + added[id] != expected) {
+            return fail("order %zu: filled %lu + added %lu != count %u", id, filled_as_new[id], added[id], info.count);
+        }
+        if ((info.flags & order_flag_fok) && filled_as_new[id] != 0 && filled_as_new[id] != info.count) {
+            return fail("order %zu: fill-or-kill order partially filled (%lu of %u)", id, filled_as_new[id], info.count);
+        }
+        if ((info.flags & order_flag_post_only) && filled_as_new[id] != 0) {
+            return fail("order %zu: post-only order traded", id);
+        }
+        if (filled_as_resting[id] > added[id]) {
+            return fail("order %zu: resting quantity %lu overfilled by %lu", id, added[id], filled_as_resting[id]);
+        }
+        // At most one extra cancel for an IOC/FOK remainder or a self-trade prevention cancel
+        if (cancels[id] < w.cancels_per_id[id] || cancels[id] > w.cancels_per_id[id] + 1) {
+            return fail("order %zu: %u cancel responses for %u cancels", id, cancels[id], w.cancels_per_id[id]);
+        }
+    }
+
+    Reference ref(w, opt.instruments);
+    ref.call = opt.auction_pct > 0;
+    ref.auction_timestamp = auction;
+    long groups = 0;
+    if (replay(w, out.events, INTMAX_MAX, ref, groups) != 0) {
+        return 1;
+    }
+    // The uncross is one more command
+    if (groups != w.total + (opt.auction_pct > 0)) {
+        return fail("%ld command timestamps for %ld commands", groups, w.total + (opt.auction_pct > 0));
+    }
+
+    // The first responses answer the queries that end each connection
+    if (out.tops.size() != static_cast<size_t>(opt.connections + opt.instruments)) {
+        return fail("%zu best bid/offer responses for %d instruments", out.tops.size() - opt.connections, opt.instruments);
+    }
+    for (auto it = out.tops.begin() + opt.connections; it != out.tops.end(); it++) {
+        const TopOfBook& actual = *it;
+        TopOfBook expected = ref.top(std::stoi(actual.instrument.substr(3)));
+        if (!(expected == actual)) {
+            return fail("best bid/offer %s, expected %s", to_string(actual).c_str(), to_string(expected).c_str());
+        }
+    }
+    return 0;
+}
+
+// Reads a connection's execution reports until the engine closes it or goes quiet for timeout_s
+void collect_reports(int fd, int timeout_s, std::vector<EngineEvent>& reports) {
+    EngineEvent event;
+    size_t have = 0;
+    struct pollfd pfd {};
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (poll(&pfd, 1, timeout_s * 1000) > 0) {
+        ssize_t n = read(fd, reinterpret_cast<char*>(&event) + have, sizeof(event) - have);
+        if (n <= 0) {
+            break;
+        }
+        have += n;
+        if (have == sizeof(event)) {
+            reports.push_back(event);
+            have = 0;
+        }
+    }
+}
+
+int verify_reports(const Workload& w, const OutputCollector& out, const std::vector<std::vector<EngineEvent>>& reports) {
+    auto key = [](const Event& e) { return to_string(e) + " " + std::to_string(e.timestamp); };
+    std::vector<std::map<std::string, int>> expected(reports.size());
+    for (const Event& e : out.events) {
+        uint16_t owner = w.orders[e.id].connection;
+        expected[owner][key(e)]++;
+        if (e.kind == 'E' && w.orders[e.new_id].connection != owner) {
+            expected[w.orders[e.new_id].connection][key(e)]++;
+        }
+    }
+    for (size_t c = 0; c < reports.size(); c++) {
+        int queries = 0;
+        for (const EngineEvent& r : reports[c]) {
+            if (r.kind == 'Q') {
+                queries++;
+                continue;
+            }
+            Event e {};
+            e.kind = r.kind;
+            e.accepted = r.kind == 'X' && r.detail == 'A';
+            e.reason = r.kind == 'R' ? r.detail : 0;
+            e.id = r.id;
+            e.new_id = r.new_id;
+            e.exec_id = r.execution_id;
+            e.price = r.price;
+            e.count = static_cast<uint32_t>(r.count);
+            std::memcpy(e.instrument, r.instrument, sizeof(e.instrument));
+            e.timestamp = r.timestamp;
+            auto it = expected[c].find(key(e));
+            if (it == expected[c].end() || it->second == 0) {
+                return fail("connection %zu: unexpected report %s", c, key(e).c_str());
+            }
+            it->second--;
+        }
+        for (const auto& [line, left] : expected[c]) {
+            if (left != 0) {
+                return fail("connection %zu: no report for %s", c, line.c_str());
+            }
+        }
+        if (queries != 1) {
+            return fail("connection %zu: %d query reports for its end marker", c, queries);
+        }
+    }
+    return 0;
+}
+
+/*
+The follower prints the commands it replays, then answers the marker query,
+one query per instrument and a cancel for every order id. Every line the
+primary printed must be among the replayed ones: a client that saw a command
+handled must find it on the follower. The reference is replayed from the
+follower's lines, which also cover commands the primary sent but was killed
+before printing.
+*/
+int verify_failover(const Options& opt, const Workload& w, const OutputCollector& primary, const OutputCollector& follower, double takeover_ms) {
+    if (!follower.bad_lines.empty()) {
+        return fail("unparseable follower output: %s", follower.bad_lines.front().c_str());
+    }
+    size_t marker = 0;
+    while (marker < follower.tops.size() && follower.tops[marker].instrument != follower.marker) {
+        marker++;
+    }
+    if (marker == follower.tops.size()) {
+        return fail("follower did not answer the takeover query");
+    }
+    // Nothing but the follower's own commands has taken a timestamp since it took over
+    intmax_t taken_over = follower.tops[marker].timestamp;
+    std::vector<Event> replayed;
+    for (const Event& e : follower.events) {
+        if (e.timestamp < taken_over) {
+            replayed.push_back(e);
+        }
+    }
+    size_t cancels = follower.events.size() - replayed.size();
+    if (follower.tops.size() - marker != static_cast<size_t>(opt.instruments + 1) || cancels != w.orders.size() - 1) {
+        return fail("follower answered %zu queries and %zu cancels", follower.tops.size() - marker, cancels);
+    }
+
+    std::multiset<std::pair<intmax_t, std::string>> replayed_lines;
+    for (const Event& e : replayed) {
+        replayed_lines.emplace(e.timestamp, to_string(e));
+    }
+    for (size_t i = 0; i < marker; i++) {
+        replayed_lines.emplace(follower.tops[i].timestamp, "Q " + to_string(follower.tops[i]));
+    }
+    std::set<intmax_t> acknowledged;
+    auto check_acknowledged = [&](intmax_t timestamp, const std::string& line) {
+        auto it = replayed_lines.find({timestamp, line});
+        if (it == replayed_lines.end()) {
+            return fail("the primary printed %s at timestamp %jd, the follower %s", line.c_str(), timestamp,
+                timestamp < taken_over ? "replayed something else" : "took over before it");
+        }
+        replayed_lines.erase(it);
+        acknowledged.insert(timestamp);
+        return 0;
+    };
+    for (const Event& e : primary.events) {
+        if (check_acknowledged(e.timestamp, to_string(e)) != 0) {
+            return 1;
+        }
+    }
+    for (const TopOfBook& t : primary.tops) {
+        if (check_acknowledged(t.timestamp, "Q " + to_string(t)) != 0) {
+            return 1;
+        }
+    }
+
+    Reference ref(w, opt.instruments);
+    long groups = 0;
+    if (replay(w, replayed, taken_over, ref, groups) != 0) {
+        return 1;
+    }
+    if (groups + static_cast<long>(marker) != taken_over) {
+        return fail("follower took over at timestamp %jd, its replayed output has %ld commands before it", taken_over, groups + static_cast<long>(marker));
+    }
+    for (int i = 0; i < opt.instruments; i++) {
+        const TopOfBook& actual = follower.tops[marker + 1 + i];
+        TopOfBook expected = ref.top(i);
+        if (!(expected == actual)) {
+            return fail("follower best bid/offer %s, expected %s", to_string(actual).c_str(), to_string(expected).c_str());
+        }
+    }
+    for (const Event& e : follower.events) {
+        if (e.timestamp < taken_over) {
+            continue;
+        }
+        if (e.kind != 'X' || e.id == 0 || e.id >= w.orders.size() || e.accepted != ref.resting[e.id]) {
+            return fail("follower cancel %s, order %s resting in the reference", to_string(e).c_str(),
+                e.id < w.orders.size() && ref.resting[e.id] ? "is" : "is not");
+        }
+    }
+    std::printf("follower took over %.1fms after the kill at timestamp %jd, it replayed %jd commands the primary had not printed yet\n",
+        takeover_ms, taken_over, taken_over - static_cast<intmax_t>(acknowledged.size()));
+    return 0;
+}
+
+// Latency from writing an order to its first output line, for the connections that do not flood
+void report_latency(const Options& opt, const Workload& w, const std::vector<int64_t>& sent_ns, const OutputCollector& out) {
+    std::vector<int64_t> latencies;
+    long throttled = 0, shed = 0;
+    for (const Event& e : out.events) {
+        throttled += e.kind == 'R' && e.reason == reject_throttled;
+        shed += e.kind == 'R' && e.reason == reject_queue_full;
+    }
+    for (size_t id = 1; id < w.orders.size(); id++) {
+        if (w.orders[id].connection >= opt.flooders && sent_ns[id] != 0 && out.first_output_ns[id] != 0) {
+            latencies.push_back(out.first_output_ns[id] - sent_ns[id]);
+        }
+    }
+    std::printf("admission rejects: %ld throttled, %ld shed\n", throttled, shed);
+    if (latencies.empty()) {
+        return;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&latencies](double p) {
+        return latencies[std::min(latencies.size() - 1, static_cast<size_t>(p * latencies.size()))] / 1000.0;
+    };
+    std::printf("paced order latency (us, %zu orders): p50 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+        latencies.size(), percentile(0.5), percentile(0.99), percentile(0.999), latencies.back() / 1000.0);
+}
+
+// Sent after each connection's commands, see OutputCollector
+const ClientCommand end_marker = [] {
+    ClientCommand cmd {};
+    cmd.type = input_query;
+    std::strncpy(cmd.instrument, "SYM0", sizeof(cmd.instrument) - 1);
+    return cmd;
+}();
+
+int connect_to(const std::string& path) {
+    for (int attempt = 0; attempt < 500; attempt++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr {};
+        addr.sun_family = AF_UNIX;
+        std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        if (connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) == 0) {
+            return fd;
+        }
+        close(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return -1;
+}
+
+bool write_all(int fd, const void* data, size_t len) {
+    const char* p = static_cast<const char*>(data);
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+// write_all in pieces of 1 to 13 bytes. Yielding between pieces lets the engine
+// read a command before the rest of it has been written.
+bool write_split(int fd, const void* data, size_t len) {
+    const char* p = static_cast<const char*>(data);
+    for (size_t piece = 1; len > 0; piece = piece % 13 + 1) {
+        size_t n = std::min(piece, len);
+        if (!write_all(fd, p, n)) {
+            return false;
+        }
+        p += n;
+        len -= n;
+        std::this_thread::yield();
+    }
+    return true;
+}
+
+// Sends one connection's commands over a shared memory session, draining the
+// session's events so the engine never waits on a full ring. Returns the number
+// of events received, or -1 if the session could not be set up.
+long run_shm_connection(const Options& opt, int fd, const std::vector<ClientCommand>& cmds, bool paced, std::vector<int64_t>& sent_ns) {
+    ClientCommand request {};
+    request.type = input_session;
+    std::unique_ptr<ShmSession> session;
+    if (!write_all(fd, &request, sizeof(request)) || (session = ShmSession::attach(recv_fd(fd))) == nullptr) {
+        return -1;
+    }
+    long received = 0;
+    EngineEvent event;
+    auto drain = [&] {
+        while (session->events.try_pop(event)) {
+            received++;
+        }
+    };
+    auto send = [&](const ClientCommand& cmd) {
+        while (!session->commands.try_push(cmd)) {
+            drain();
+            std::this_thread::yield();
+        }
+        drain();
+    };
+    for (const ClientCommand& cmd : cmds) {
+        if (paced && cmd.type != input_cancel) {
+            sent_ns[cmd.order_id] = now_ns();
+        }
+        send(cmd);
+        if (paced) {
+            std::this_thread::sleep_for(std::chrono::microseconds(opt.pace_us));
+        }
+    }
+    send(end_marker);
+    session->commands.close();
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(opt.timeout_s);
+    while (!session->events.closed() && std::chrono::steady_clock::now() < deadline) {
+        if (session->events.pop(event, 0, 100)) {
+            received++;
+        }
+    }
+    drain();
+    return received;
+}
+
+pid_t start_engine(const Options& opt, const std::string& socket_path, std::vector<const char*> role_args, const char* stderr_path, int& stdout_fd) {
+    int pipefd[2];
+    if (pipe(pipefd) != 0) {
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(pipefd[1], STDOUT_FILENO);
+        int err = open(stderr_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        dup2(err, STDERR_FILENO);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        std::vector<char*> argv {const_cast<char*>(opt.engine)};
+        for (const char* arg : opt.engine_args) {
+            argv.push_back(const_cast<char*>(arg));
+        }
+        for (const char* arg : role_args) {
+            argv.push_back(const_cast<char*>(arg));
+        }
+        argv.push_back(const_cast<char*>(socket_path.c_str()));
+        argv.push_back(nullptr);
+        execv(opt.engine, argv.data());
+        _exit(127);
+    }
+    close(pipefd[1]);
+    stdout_fd = pipefd[0];
+    return pid;
+}
+
+void usage(const char* argv0) {
+    std::fprintf(stderr,
+        "Usage: %s [options] [engine binary]\n"
+        "  -s seed         workload seed (default 1)\n"
+        "  -c connections  concurrent client connections (default 64)\n"
+        "  -n commands     total commands (default 1000000)\n"
+        "  -i instruments  number of instruments (default 4)\n"
+        "  -H percent      share of orders on the hot instrument (default 50)\n"
+        "  -b band         price band in ticks around the mid (default 8)\n"
+        "  -q count        max order quantity (default 100)\n"
+        "  -x percent      cancel share of commands (default 20)\n"
+        "  -f percent      share of orders with IOC/FOK/post-only/STP flags (default 10)\n"
+        "  -t seconds      fail if the engine makes no progress for this long (default 30)\n"
+        "  -F connections  connections that flood the hot instrument (default 0)\n"
+        "  -P percent      share of commands sent by the flooders (default 90)\n"
+        "  -p usec         gap between each other connection's commands, enables the latency report\n"
+        "  -m              send commands over shared memory sessions instead of the socket\n"
+        "  -S              write each command in pieces of a few bytes, so the engine reads partial commands\n"
+        "  -K percent      kill the primary once this share of the commands is handled, check its follower took over\n"
+        "  -g ms           with -K, stop the follower for this long halfway to the kill\n"
+        "  -E              ask for execution reports on every connection and check them against stdout\n"
+        "  -U percent      start the engine in a call period and uncross once this share of the commands is handled\n"
+        "  -o file         also write the workload as a grader testcase, the grader needs -f 0\n"
+        "  -e file         write the engine's stderr to file (default /dev/null)\n"
+        "  -a arg          pass an extra argument to the engine, can be repeated\n",
+        argv0);
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    Options opt;
+    int c;
+    while ((c = getopt(argc, argv, "s:c:n:i:H:b:q:x:f:t:F:P:p:mSEK:g:U:o:e:a:h")) != -1) {
+        switch (c) {
+            case 's': opt.seed = std::strtoull(optarg, nullptr, 10); break;
+            case 'c': opt.connections = std::atoi(optarg); break;
+            case 'n': opt.commands = std::atol(optarg); break;
+            case 'i': opt.instruments = std::atoi(optarg); break;
+            case 'H': opt.hot_pct = std::atoi(optarg); break;
+            case 'b': opt.price_band = std::strtoul(optarg, nullptr, 10); break;
+            case 'q': opt.max_count = std::strtoul(optarg, nullptr, 10); break;
+            case 'x': opt.cancel_pct = std::atoi(optarg); break;
+            case 'f': opt.flags_pct = std::atoi(optarg); break;
+            case 't': opt.timeout_s = std::atoi(optarg); break;
+            case 'F': opt.flooders = std::atoi(optarg); break;
+            case 'P': opt.flood_pct = std::atoi(optarg); break;
+            case 'p': opt.pace_us = std::atoi(optarg); break;
+            case 'm': opt.shm = true; break;
+            case 'S': opt.split = true; break;
+            case 'E': opt.reports = true; break;
+            case 'K': opt.failover_pct = std::atoi(optarg); break;
+            case 'g': opt.follower_pause_ms = std::atoi(optarg); break;
+            case 'U': opt.auction_pct = std::atoi(optarg); break;
+            case 'o': opt.dump_path = optarg; break;
+            case 'e': opt.engine_stderr = optarg; break;
+            case 'a': opt.engine_args.push_back(optarg); break;
+            default: usage(argv[0]); return 2;
+        }
+    }
+    if (optind < argc) {
+        opt.engine = argv[optind];
+    }
+    if (opt.connections < 1 || opt.flooders < 0 || opt.flooders >= opt.connections || opt.instruments < 1 || opt.instruments > 10000 || opt.max_count < 1 || (opt.shm && opt.reports) || (opt.shm && opt.split)
+        || opt.failover_pct < 0 || opt.failover_pct > 100 || (opt.failover_pct > 0 && (opt.shm || opt.reports))
+        || opt.follower_pause_ms < 0 || (opt.follower_pause_ms > 0 && opt.failover_pct == 0)
+        || opt.auction_pct < 0 || opt.auction_pct > 100 || (opt.auction_pct > 0 && opt.failover_pct > 0)) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    Workload w = generate(opt);
+    if (opt.dump_path) {
+        dump_workload(w, opt.dump_path);
+    }
+    std::printf("seed %lu: %ld commands, %zu orders, %d connections, %d instruments\n",
+        opt.seed, w.total, w.orders.size() - 1, opt.connections, opt.instruments);
+
+    signal(SIGPIPE, SIG_IGN);
+    std::string socket_path = "/tmp/stress-" + std::to_string(getpid()) + ".sock";
+    std::string replication_path = "/tmp/stress-" + std::to_string(getpid()) + ".repl";
+    std::string follower_stderr = std::string(opt.engine_stderr) + ".follower";
+    int stdout_fd, follower_stdout_fd = -1;
+    std::vector<const char*> primary_args;
+    if (opt.failover_pct > 0) {
+        primary_args = {"-R", replication_path.c_str()};
+    } else if (opt.auction_pct > 0) {
+        primary_args = {"-A"};
+    }
+    pid_t engine = start_engine(opt, socket_path, primary_args, opt.engine_stderr, stdout_fd);
+    if (engine < 0) {
+        return fail("could not start %s", opt.engine);
+    }
+    // The follower waits for the primary to listen, then only binds the socket once the primary is gone
+    pid_t follower = -1;
+    if (opt.failover_pct > 0) {
+        follower = start_engine(opt, socket_path, {"-F", replication_path.c_str(), "-P"},
+            std::strcmp(opt.engine_stderr, "/dev/null") == 0 ? "/dev/null" : follower_stderr.c_str(), follower_stdout_fd);
+        if (follower < 0) {
+            kill(engine, SIGKILL);
+            return fail("could not start the follower");
+        }
+    }
+
+    OutputCollector out;
+    out.first_output_ns.resize(w.orders.size());
+    std::vector<int64_t> sent_ns(w.orders.size());
+    std::thread reader(&OutputCollector::run, &out, stdout_fd);
+    // Read from the start, a follower blocked on a full pipe would stop taking the primary's stream
+    OutputCollector follower_out;
+    std::thread follower_reader;
+    if (opt.failover_pct > 0) {
+        // No workload instrument, so the answer tells the follower's own lines from the ones it replayed
+        follower_out.marker = "TAKEOVER";
+        follower_reader = std::thread(&OutputCollector::run, &follower_out, follower_stdout_fd);
+    }
+
+    std::vector<int> fds;
+    for (int i = 0; i < opt.connections; i++) {
+        int fd = connect_to(socket_path);
+        if (fd == -1) {
+            kill(engine, SIGKILL);
+            reader.join();
+            return fail("could not connect to engine at %s", socket_path.c_str());
+        }
+        fds.push_back(fd);
+    }
+    int auction_fd = opt.auction_pct > 0 ? connect_to(socket_path) : -1;
+
+    // Reports are read for the whole run, the sockets stay open until every connection has finished
+    std::vector<std::vector<EngineEvent>> reports(opt.reports ? opt.connections : 0);
+    std::vector<std::thread> report_readers;
+    for (int i = 0; opt.reports && i < opt.connections; i++) {
+        ClientCommand request {};
+        request.type = input_reports;
+        write_all(fds[i], &request, sizeof(request));
+        report_readers.emplace_back(collect_reports, fds[i], opt.timeout_s, std::ref(reports[i]));
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> writers;
+    std::atomic<long> shm_events{0};
+    std::atomic<int> shm_failures{0};
+    for (int i = 0; i < opt.connections; i++) {
+        writers.emplace_back([&opt, &w, &fds, &sent_ns, &shm_events, &shm_failures, i] {
+            const std::vector<ClientCommand>& cmds = w.per_connection[i];
+            if (opt.shm) {
+                long received = run_shm_connection(opt, fds[i], cmds, opt.pace_us > 0 && i >= opt.flooders, sent_ns);
+                if (received < 0) {
+                    shm_failures++;
+                } else {
+                    shm_events += received;
+                }
+                close(fds[i]);
+                return;
+            }
+            if (opt.pace_us > 0 && i >= opt.flooders) {
+                for (const ClientCommand& cmd : cmds) {
+                    if (cmd.type != input_cancel) {
+                        sent_ns[cmd.order_id] = now_ns();
+                    }
+                    if (!write_all(fds[i], &cmd, sizeof(cmd))) {
+                        break;
+                    }
+                    std::this_thread::sleep_for(std::chrono::microseconds(opt.pace_us));
+                }
+            } else if (opt.split) {
+                write_split(fds[i], cmds.data(), cmds.size() * sizeof(ClientCommand));
+            } else {
+                write_all(fds[i], cmds.data(), cmds.size() * sizeof(ClientCommand));
+            }
+            write_all(fds[i], &end_marker, sizeof(end_marker));
+            if (!opt.reports) {
+                close(fds[i]);
+            }
+        });
+    }
+    if (opt.failover_pct > 0) {
+        long kill_at = w.total * opt.failover_pct / 100;
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(opt.timeout_s);
+        auto wait_for_output = [&](long lines) {
+            while (static_cast<long>(out.lines) < lines && !out.done && std::chrono::steady_clock::now() < deadline) {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        };
+        if (opt.follower_pause_ms > 0) {
+            wait_for_output(kill_at / 2);
+            // A stopped process takes nothing from its socket, as a follower whose replay fell behind
+            kill(follower, SIGSTOP);
+            std::this_thread::sleep_for(std::chrono::milliseconds(opt.follower_pause_ms));
+            kill(follower, SIGCONT);
+        }
+        wait_for_output(kill_at);
+        kill(engine, SIGKILL);
+        auto killed = std::chrono::steady_clock::now();
+        // Until it is reaped the primary's socket may still accept
+        waitpid(engine, nullptr, 0);
+        // Retries until the follower has replayed what it got and bound the socket
+        int fd = connect_to(socket_path);
+        double takeover_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - killed).count();
+        for (std::thread& t : writers) {
+            t.join();
+        }
+        reader.join();
+
+        size_t expected = opt.instruments + w.orders.size();
+        for (int i = -1; i < opt.instruments && fd != -1; i++) {
+            ClientCommand query {};
+            query.type = input_query;
+            std::strncpy(query.instrument, i < 0 ? follower_out.marker.c_str() : instrument_name(i).c_str(), sizeof(query.instrument) - 1);
+            write_all(fd, &query, sizeof(query));
+        }
+        for (uint32_t id = 1; id < w.orders.size() && fd != -1; id++) {
+            ClientCommand cancel {};
+            cancel.type = input_cancel;
+            cancel.order_id = id;
+            write_all(fd, &cancel, sizeof(cancel));
+        }
+        deadline = std::chrono::steady_clock::now() + std::chrono::seconds(opt.timeout_s);
+        while (fd != -1 && (follower_out.marker_line == 0 || follower_out.lines - follower_out.marker_line + 1 < expected)
+            && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+        kill(follower, SIGTERM);
+        int status = 0;
+        waitpid(follower, &status, 0);
+        follower_reader.join();
+        unlink(socket_path.c_str());
+        unlink(replication_path.c_str());
+        if (fd == -1) {
+            return fail("follower did not take over");
+        }
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            return fail("follower exited abnormally (status %d), see its stderr", status);
+        }
+        if (verify_failover(opt, w, out, follower_out, takeover_ms) != 0) {
+            return 1;
+        }
+        std::printf("PASS\n");
+        return 0;
+    }
+
+    if (opt.auction_pct > 0) {
+        long uncross_at = w.total * opt.auction_pct / 100;
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(opt.timeout_s);
+        while (static_cast<long>(out.lines) < uncross_at && !out.done && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        ClientCommand uncross {};
+        uncross.type = input_auction;
+        write_all(auction_fd, &uncross, sizeof(uncross));
+    }
+    for (std::thread& t : writers) {
+        t.join();
+    }
+    if (auction_fd != -1) {
+        close(auction_fd);
+    }
+
+    // Wait for every connection's end marker, or for the engine to stall
+    size_t connections = static_cast<size_t>(opt.connections);
+    size_t last = 0;
+    auto last_progress = std::chrono::steady_clock::now();
+    while (out.tops_seen < connections && !out.done) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        if (out.lines != last) {
+            last = out.lines;
+            last_progress = std::chrono::steady_clock::now();
+        } else if (std::chrono::steady_clock::now() - last_progress > std::chrono::seconds(opt.timeout_s)) {
+            break;
+        }
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    size_t finished = out.tops_seen;
+
+    // With the books quiet, ask for every instrument's best bid/offer
+    if (finished == connections) {
+        int fd = connect_to(socket_path);
+        for (int i = 0; i < opt.instruments && fd != -1; i++) {
+            ClientCommand query {};
+            query.type = input_query;
+            std::strncpy(query.instrument, instrument_name(i).c_str(), sizeof(query.instrument) - 1);
+            write_all(fd, &query, sizeof(query));
+        }
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(opt.timeout_s);
+        while (out.tops_seen < connections + opt.instruments && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        close(fd);
+    }
+    // The engine closes a report socket once the connection is gone and its last reports are written
+    for (int i = 0; opt.reports && i < opt.connections; i++) {
+        shutdown(fds[i], SHUT_WR);
+    }
+    for (std::thread& t : report_readers) {
+        t.join();
+    }
+    for (int i = 0; opt.reports && i < opt.connections; i++) {
+        close(fds[i]);
+    }
+
+    kill(engine, SIGTERM);
+    int status = 0;
+    waitpid(engine, &status, 0);
+    unlink(socket_path.c_str());
+    reader.join();
+
+    if (finished < connections) {
+        return fail("engine stalled with %zu of %zu connections unfinished", connections - finished, connections);
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return fail("engine exited abnormally (status %d), see its stderr", status);
+    }
+    std::printf("engine processed %ld commands in %.3fs (%.0f commands/s), %zu output lines\n",
+        w.total, elapsed, w.total / elapsed, out.events.size());
+
+    if (shm_failures > 0) {
+        return fail("%d shared memory sessions could not be set up", shm_failures.load());
+    }
+    // Every stdout line except the final queries came from a command on some session, the uncross is on none
+    intmax_t auction = opt.auction_pct > 0 ? uncross_timestamp(out) : -1;
+    size_t session_lines = out.events.size() + connections
+        - std::count_if(out.events.begin(), out.events.end(), [auction](const Event& e) { return e.timestamp == auction; });
+    if (opt.shm && static_cast<size_t>(shm_events) != session_lines) {
+        return fail("%ld events on the session rings for %zu output lines", shm_events.load(), session_lines);
+    }
+    if (opt.pace_us > 0) {
+        report_latency(opt, w, sent_ns, out);
+    }
+    if (verify(opt, w, out) != 0) {
+        return 1;
+    }
+    if (opt.reports && verify_reports(w, out, reports) != 0) {
+        return 1;
+    }
+    std::printf("PASS\n");
+    return 0;
+}
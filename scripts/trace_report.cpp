@@ -0,0 +1,210 @@
+// Reads a flight recorder dump and breaks each command's time down by stage.
+// Usage: ./trace_report [-n worst] <dump file>
+//
+// Prints, for every kind of wait, how many commands waited and how long for,
+// then the slowest commands with where their time went. A command's time runs
+// from decoding it to handling it; reading it off the connection is reported
+// separately because it includes time the connection was idle.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "../flight_recorder.hpp"
+
+namespace {
+
+// Waits a command can be broken down into, by the stage that starts them
+enum Span { span_side, span_book, span_ready, span_output, span_log, span_count };
+
+const char* span_names[span_count] = {"side mutex", "book mutex", "ready wait", "output mutex", "log mutex"};
+
+int span_of(uint16_t wait_stage) {
+    switch (wait_stage) {
+        case trace_side_lock_wait: return span_side;
+        case trace_book_lock_wait: return span_book;
+        case trace_ready_wait: return span_ready;
+        case trace_output_wait: return span_output;
+        case trace_log_wait: return span_log;
+        default: return -1;
+    }
+}
+
+struct Command {
+    uint32_t order_id = 0;
+    uint32_t ring = 0;
+    uint64_t start = 0;
+    double read_ns = 0;
+    double total_ns = 0;
+    double span_ns[span_count] = {};
+};
+
+struct Dump {
+    TraceFileHeader header;
+    std::vector<std::pair<TraceRingHeader, std::vector<TraceEvent>>> rings;
+};
+
+bool load(const char* path, Dump& dump) {
+    FILE* file = std::fopen(path, "rb");
+    if (file == nullptr) {
+        return false;
+    }
+    bool ok = std::fread(&dump.header, sizeof(dump.header), 1, file) == 1 && std::memcmp(dump.header.magic, "FLTREC1", 8) == 0;
+    for (uint32_t i = 0; ok && i < dump.header.rings; i++) {
+        TraceRingHeader ring;
+        ok = std::fread(&ring, sizeof(ring), 1, file) == 1;
+        std::vector<TraceEvent> events(ok ? ring.events : 0);
+        ok = ok && std::fread(events.data(), sizeof(TraceEvent), events.size(), file) == events.size();
+        dump.rings.push_back({ring, std::move(events)});
+    }
+    std::fclose(file);
+    return ok;
+}
+
+// Walks each ring in order. Events are only ever written by the thread that
+// owns the ring, so one command's events are contiguous apart from the wait
+// pairs nested inside it.
+std::vector<Command> reconstruct(const Dump& dump) {
+    double ns_per_tick = 1 / dump.header.ticks_per_ns;
+    std::vector<Command> commands;
+    for (const auto& [ring, events] : dump.rings) {
+        bool in_command = false;
+        Command command;
+        uint64_t read_began = 0;
+        uint64_t wait_began[trace_stage_count] = {};
+        for (const TraceEvent& event : events) {
+            switch (event.stage) {
+                case trace_read_begin:
+                    read_began = event.tick;
+                    break;
+                case trace_read_done:
+                    command = Command {};
+                    command.order_id = event.order_id;
+                    command.ring = ring.ring;
+                    command.start = event.tick;
+                    command.read_ns = read_began != 0 ? (event.tick - read_began) * ns_per_tick : 0;
+                    std::fill(std::begin(wait_began), std::end(wait_began), 0);
+                    in_command = true;
+                    break;
+                case trace_done:
+                    if (in_command) {
+                        command.total_ns = (event.tick - command.start) * ns_per_tick;
+                        commands.push_back(command);
+                    }
+                    in_command = false;
+                    read_began = 0;
+                    break;
+                default:
+                    if (event.stage >= trace_stage_count) {
+                        break;
+                    }
+                    if (span_of(event.stage) >= 0) {
+                        wait_began[event.stage] = event.tick;
+                    } else if (int span = span_of(event.stage - 1); span >= 0 && wait_began[event.stage - 1] != 0) {
+                        // Waits outside a command, such as the dump thread's log lines, are dropped
+                        if (in_command) {
+                            command.span_ns[span] += (event.tick - wait_began[event.stage - 1]) * ns_per_tick;
+                        }
+                        wait_began[event.stage - 1] = 0;
+                    }
+                    break;
+            }
+        }
+    }
+    return commands;
+}
+
+double percentile(std::vector<double>& values, double p) {
+    if (values.empty()) {
+        return 0;
+    }
+    size_t index = std::min(values.size() - 1, static_cast<size_t>(values.size() * p));
+    std::nth_element(values.begin(), values.begin() + index, values.end());
+    return values[index];
+}
+
+void print_distribution(const char* name, std::vector<double> values) {
+    double total = 0;
+    for (double v : values) {
+        total += v;
+    }
+    double max = values.empty() ? 0 : *std::max_element(values.begin(), values.end());
+    double p50 = percentile(values, 0.5);
+    double p99 = percentile(values, 0.99);
+    std::printf("%-14s %10zu %12.0f %12.0f %12.0f %12.3f\n", name, values.size(), p50, p99, max, total / 1e6);
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    size_t worst = 20;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt != 'n') {
+            std::fprintf(stderr, "usage: %s [-n worst] <dump file>\n", argv[0]);
+            return 2;
+        }
+        worst = std::strtoul(optarg, nullptr, 10);
+    }
+    if (optind >= argc) {
+        std::fprintf(stderr, "usage: %s [-n worst] <dump file>\n", argv[0]);
+        return 2;
+    }
+    Dump dump;
+    if (!load(argv[optind], dump)) {
+        std::fprintf(stderr, "%s is not a complete flight recorder dump\n", argv[optind]);
+        return 1;
+    }
+
+    std::vector<Command> commands = reconstruct(dump);
+    const char* reason = dump.header.reason == dump_signal ? "signal" : dump.header.reason == dump_threshold ? "slow command" : "request";
+    std::printf("%zu commands on %u threads, dumped on %s, clock %.3f ticks/ns\n", commands.size(), dump.header.rings, reason, dump.header.ticks_per_ns);
+    if (commands.empty()) {
+        return 0;
+    }
+
+    std::printf("\n%-14s %10s %12s %12s %12s %12s\n", "stage", "commands", "p50 ns", "p99 ns", "max ns", "total ms");
+    std::vector<double> totals, reads;
+    for (const Command& c : commands) {
+        totals.push_back(c.total_ns);
+        reads.push_back(c.read_ns);
+    }
+    print_distribution("command", totals);
+    print_distribution("read", reads);
+    for (int span = 0; span < span_count; span++) {
+        std::vector<double> waits;
+        for (const Command& c : commands) {
+            if (c.span_ns[span] > 0) {
+                waits.push_back(c.span_ns[span]);
+            }
+        }
+        print_distribution(span_names[span], waits);
+    }
+
+    // Slowest commands, with whatever is not a wait counted as running
+    std::sort(commands.begin(), commands.end(), [](const Command& a, const Command& b) { return a.total_ns > b.total_ns; });
+    std::printf("\n%-10s %6s %10s %10s", "order", "thread", "start us", "total us");
+    for (const char* name : span_names) {
+        std::printf(" %12s", name);
+    }
+    std::printf(" %10s\n", "running");
+    for (size_t i = 0; i < std::min(worst, commands.size()); i++) {
+        const Command& c = commands[i];
+        double waited = 0;
+        for (double span : c.span_ns) {
+            waited += span;
+        }
+        // Relative to the dump, so the slowest commands can be lined up with each other
+        double start_us = -static_cast<double>(dump.header.dump_tick - c.start) / dump.header.ticks_per_ns / 1e3;
+        std::printf("%-10u %6u %10.0f %10.1f", c.order_id, c.ring, start_us, c.total_ns / 1e3);
+        for (double span : c.span_ns) {
+            std::printf(" %12.1f", span / 1e3);
+        }
+        std::printf(" %10.1f\n", (c.total_ns - waited) / 1e3);
+    }
+    return 0;
+}
@@ -0,0 +1,308 @@
+#ifndef SHM_RING_HPP
+#define SHM_RING_HPP
+
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <new>
+
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "io.hpp"
+
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// Shared (not private) futexes, the rings are mapped by two processes
+inline void futex_wait(std::atomic<uint32_t>& word, uint32_t expected, int timeout_ms) {
+    timespec timeout {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT, expected, timeout_ms >= 0 ? &timeout : nullptr, nullptr, 0);
+}
+
+inline void futex_wake(std::atomic<uint32_t>& word) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+// Control block of one ring direction, lives in the shared mapping.
+// A side that runs out of spins sets its sleeping flag and waits on its futex
+// word; the other side bumps the word after every change if the flag is set.
+// Both sides fence between their store and their check, so one of them always
+// sees the other and a wakeup is never lost.
+struct ShmRingControl {
+    alignas(64) std::atomic<uint64_t> head{0}; // next slot to read, written by the consumer
+    alignas(64) std::atomic<uint64_t> tail{0}; // next slot to write, written by the producer
+    alignas(64) std::atomic<uint32_t> readable{0};
+    std::atomic<uint32_t> consumer_sleeping{0};
+    std::atomic<uint32_t> writable{0};
+    std::atomic<uint32_t> producer_sleeping{0};
+    std::atomic<uint32_t> closed{0};
+};
+
+inline void ring_wake(std::atomic<uint32_t>& word, std::atomic<uint32_t>& sleeping) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping.load(std::memory_order_relaxed)) {
+        word.fetch_add(1, std::memory_order_release);
+        futex_wake(word);
+    }
+}
+
+template<typename Ready>
+bool ring_sleep(std::atomic<uint32_t>& word, std::atomic<uint32_t>& sleeping, Ready ready, int timeout_ms) {
+    uint32_t seq = word.load(std::memory_order_acquire);
+    sleeping.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!ready()) {
+        futex_wait(word, seq, timeout_ms);
+    }
+    sleeping.store(0, std::memory_order_relaxed);
+    return ready();
+}
+
+// Single producer single consumer ring of trivially copyable records.
+// Each side caches the other side's index and only rereads it when the ring
+// looks full or empty.
+template<typename T>
+class ShmRing {
+private:
+    ShmRingControl* control = nullptr;
+    T* slots = nullptr;
+    uint64_t mask = 0;
+    uint64_t cached_head = 0; // producer's view of head
+    uint64_t cached_tail = 0; // consumer's view of tail
+
+    bool has_space() const {
+        return this->control->tail.load(std::memory_order_relaxed) - this->control->head.load(std::memory_order_relaxed) <= this->mask;
+    }
+    bool has_data() const {
+        return this->control->tail.load(std::memory_order_relaxed) != this->control->head.load(std::memory_order_relaxed);
+    }
+public:
+    ShmRing() = default;
+    ShmRing(ShmRingControl* control, T* slots, uint32_t capacity) : control(control), slots(slots), mask(capacity - 1) {}
+
+    bool try_push(const T& item) {
+        uint64_t tail = this->control->tail.load(std::memory_order_relaxed);
+        if (tail - this->cached_head > this->mask) {
+            this->cached_head = this->control->head.load(std::memory_order_acquire);
+            if (tail - this->cached_head > this->mask) {
+                return false;
+            }
+        }
+        this->slots[tail & this->mask] = item;
+        this->control->tail.store(tail + 1, std::memory_order_release);
+        ring_wake(this->control->readable, this->control->consumer_sleeping);
+        return true;
+    }
+
+    bool try_pop(T& item) {
+        uint64_t head = this->control->head.load(std::memory_order_relaxed);
+        if (head == this->cached_tail) {
+            this->cached_tail = this->control->tail.load(std::memory_order_acquire);
+            if (head == this->cached_tail) {
+                return false;
+            }
+        }
+        item = this->slots[head & this->mask];
+        this->control->head.store(head + 1, std::memory_order_release);
+        ring_wake(this->control->writable, this->control->producer_sleeping);
+        return true;
+    }
+
+    // Busy-polls for spins attempts, then sleeps on the futex.
+    // Returns false if the ring is closed, or if timeout_ms passes (-1 waits forever).
+    bool push(const T& item, unsigned spins, int timeout_ms) {
+        for (unsigned i = 0;; i++) {
+            if (this->closed()) {
+                return false;
+            }
+            if (this->try_push(item)) {
+                return true;
+            }
+            if (i < spins) {
+                cpu_relax();
+            } else if (!ring_sleep(this->control->writable, this->control->producer_sleeping,
+                           [this] { return this->has_space() || this->closed(); }, timeout_ms)) {
+                return false;
+            }
+        }
+    }
+
+    // Same as push, items written before the ring was closed are still returned
+    bool pop(T& item, unsigned spins, int timeout_ms) {
+        for (unsigned i = 0;; i++) {
+            if (this->try_pop(item)) {
+                return true;
+            }
+            if (this->closed()) {
+                return this->try_pop(item);
+            }
+            if (i < spins) {
+                cpu_relax();
+            } else if (!ring_sleep(this->control->readable, this->control->consumer_sleeping,
+                           [this] { return this->has_data() || this->closed(); }, timeout_ms)) {
+                return false;
+            }
+        }
+    }
+
+    // Called by the producer when it will not push again, wakes both sides
+    void close() {
+        this->control->closed.store(1, std::memory_order_release);
+        this->control->readable.fetch_add(1, std::memory_order_release);
+        this->control->writable.fetch_add(1, std::memory_order_release);
+        futex_wake(this->control->readable);
+        futex_wake(this->control->writable);
+    }
+
+    bool closed() const {
+        return this->control->closed.load(std::memory_order_acquire) != 0;
+    }
+};
+
+// Shared mapping of one session: client commands in, engine events out.
+// The engine creates it in an anonymous memory file and passes the file to the
+// client over the session's socket, see input_session.
+class ShmSession {
+private:
+    struct Header {
+        uint32_t magic;
+        uint32_t capacity;
+        ShmRingControl commands;
+        ShmRingControl events;
+    };
+    static constexpr uint32_t session_magic = 0x53484d31; // "SHM1"
+
+    int fd;
+    void* base;
+    size_t size;
+
+    ShmSession(int fd, void* base, size_t size) : fd(fd), base(base), size(size) {
+        Header* header = static_cast<Header*>(base);
+        char* slots = static_cast<char*>(base) + sizeof(Header);
+        ClientCommand* command_slots = reinterpret_cast<ClientCommand*>(slots);
+        EngineEvent* event_slots = reinterpret_cast<EngineEvent*>(slots + header->capacity * sizeof(ClientCommand));
+        this->commands = ShmRing<ClientCommand>(&header->commands, command_slots, header->capacity);
+        this->events = ShmRing<EngineEvent>(&header->events, event_slots, header->capacity);
+    }
+
+    static size_t mapping_size(uint32_t capacity) {
+        return sizeof(Header) + capacity * (sizeof(ClientCommand) + sizeof(EngineEvent));
+    }
+public:
+    static constexpr uint32_t default_capacity = 4096;
+    static constexpr uint32_t max_capacity = 1 << 20;
+
+    ShmRing<ClientCommand> commands;
+    ShmRing<EngineEvent> events;
+
+    ShmSession(const ShmSession&) = delete;
+    ShmSession& operator=(const ShmSession&) = delete;
+    ~ShmSession() {
+        munmap(this->base, this->size);
+        close(this->fd);
+    }
+
+    int file() const { return this->fd; }
+
+    // Engine side, capacity is rounded up to a power of two
+    static std::unique_ptr<ShmSession> create(uint32_t capacity) {
+        if (capacity == 0) {
+            capacity = default_capacity;
+        }
+        uint32_t rounded = 2;
+        while (rounded < capacity && rounded < max_capacity) {
+            rounded *= 2;
+        }
+        size_t size = mapping_size(rounded);
+        int fd = memfd_create("engine-session", MFD_CLOEXEC);
+        if (fd == -1) {
+            return nullptr;
+        }
+        void* base = ftruncate(fd, size) == 0 ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+        if (base == MAP_FAILED) {
+            close(fd);
+            return nullptr;
+        }
+        Header* header = new (base) Header {};
+        header->capacity = rounded;
+        header->magic = session_magic;
+        return std::unique_ptr<ShmSession>(new ShmSession(fd, base, size));
+    }
+
+    // Client side, takes ownership of the file received from the engine
+    static std::unique_ptr<ShmSession> attach(int fd) {
+        struct stat st {};
+        if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(Header)) {
+            close(fd);
+            return nullptr;
+        }
+        size_t size = st.st_size;
+        void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (base == MAP_FAILED) {
+            close(fd);
+            return nullptr;
+        }
+        Header* header = static_cast<Header*>(base);
+        if (header->magic != session_magic || header->capacity < 2 || header->capacity > max_capacity
+            || (header->capacity & (header->capacity - 1)) != 0 || mapping_size(header->capacity) > size) {
+            munmap(base, size);
+            close(fd);
+            return nullptr;
+        }
+        return std::unique_ptr<ShmSession>(new ShmSession(fd, base, size));
+    }
+};
+
+// File descriptor passing over a Unix socket, one byte of payload carries it
+inline bool send_fd(int socket, int fd) {
+    char byte = 0;
+    iovec iov {&byte, 1};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] {};
+    msghdr msg {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    return sendmsg(socket, &msg, MSG_NOSIGNAL) == 1;
+}
+
+inline int recv_fd(int socket) {
+    char byte;
+    iovec iov {&byte, 1};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] {};
+    msghdr msg {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(socket, &msg, MSG_CMSG_CLOEXEC) != 1) {
+        return -1;
+    }
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == nullptr || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        return -1;
+    }
+    int fd;
+    std::memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+#endif
@@ -0,0 +1,185 @@
+#include <algorithm>
+#include <bit>
+#include "sidebook.h"
+
+void SideBook::track_order(std::shared_ptr<RestingOrder> order) {
+    uint32_t order_id = order->get_order_id();
+    std::lock_guard<std::mutex> lock(this->live_mutex);
+    this->live[order_id] = std::move(order);
+}
+
+std::shared_ptr<RestingOrder> SideBook::find_order(uint32_t order_id, uint32_t, intmax_t) {
+    std::lock_guard<std::mutex> lock(this->live_mutex);
+    auto it = this->live.find(order_id);
+    return it == this->live.end() ? nullptr : it->second;
+}
+
+void SideBook::forget_order(uint32_t order_id) {
+    std::lock_guard<std::mutex> lock(this->live_mutex);
+    this->live.erase(order_id);
+}
+
+LadderSideBook::LadderSideBook(bool is_buy, LadderConfig config)
+        : is_buy(is_buy), config(config), levels(config.levels),
+          occupied((config.levels + 63) / 64), summary(((config.levels + 63) / 64 + 63) / 64) {}
+
+std::optional<size_t> LadderSideBook::level_index(uint32_t price) const {
+    if (price < this->config.base || (price - this->config.base) % this->config.tick != 0) {
+        return std::nullopt;
+    }
+    size_t index = (price - this->config.base) / this->config.tick;
+    if (index >= this->config.levels) {
+        return std::nullopt;
+    }
+    return index;
+}
+
+void LadderSideBook::mark(size_t index) {
+    size_t word = index / 64;
+    this->occupied[word] |= uint64_t{1} << (index % 64);
+    this->summary[word / 64] |= uint64_t{1} << (word % 64);
+}
+
+void LadderSideBook::unmark(size_t index) {
+    size_t word = index / 64;
+    this->occupied[word] &= ~(uint64_t{1} << (index % 64));
+    if (this->occupied[word] == 0) {
+        this->summary[word / 64] &= ~(uint64_t{1} << (word % 64));
+    }
+}
+
+// Highest occupied level for buys, lowest for sells
+std::optional<size_t> LadderSideBook::best_level() const {
+    size_t n = this->summary.size();
+    for (size_t i = 0; i < n; i++) {
+        size_t s = this->is_buy ? n - 1 - i : i;
+        uint64_t bits = this->summary[s];
+        if (bits == 0) {
+            continue;
+        }
+        size_t word = s * 64 + (this->is_buy ? 63 - std::countl_zero(bits) : std::countr_zero(bits));
+        uint64_t level_bits = this->occupied[word];
+        return word * 64 + (this->is_buy ? 63 - std::countl_zero(level_bits) : std::countr_zero(level_bits));
+    }
+    return std::nullopt;
+}
+
+bool LadderSideBook::overflow_empty() const {
+    return this->is_buy ? this->overflowBuys.empty() : this->overflowSells.empty();
+}
+
+const std::shared_ptr<RestingOrder>& LadderSideBook::overflow_top() const {
+    return this->is_buy ? this->overflowBuys.top() : this->overflowSells.top();
+}
+
+void LadderSideBook::overflow_pop() {
+    if (this->is_buy) {
+        this->overflowBuys.pop();
+    } else {
+        this->overflowSells.pop();
+    }
+}
+
+// Prices on and off the ladder never coincide, so comparing prices is enough
+std::optional<bool> LadderSideBook::top_is_overflow() {
+    std::optional<size_t> best = this->best_level();
+    if (this->overflow_empty()) {
+        return best.has_value() ? std::optional<bool>(false) : std::nullopt;
+    }
+    if (!best.has_value()) {
+        return true;
+    }
+    uint32_t ladder_price = this->config.base + static_cast<uint32_t>(*best) * this->config.tick;
+    uint32_t overflow_price = this->overflow_top()->get_price();
+    return this->is_buy ? overflow_price > ladder_price : overflow_price < ladder_price;
+}
+
+void LadderSideBook::push(std::shared_ptr<RestingOrder> order) {
+    uint32_t price = order->get_price();
+    intmax_t timestamp = order->get_timestamp();
+    std::lock_guard<std::mutex> lock(this->mut);
+    std::optional<size_t> index = this->level_index(price);
+    if (!index.has_value()) {
+        if (this->is_buy) {
+            this->overflowBuys.push(std::move(order));
+        } else {
+            this->overflowSells.push(std::move(order));
+        }
+        return;
+    }
+
+    Level& level = this->levels[*index];
+    if (level.head == level.orders.size()) {
+        level.orders.clear();
+        level.head = 0;
+        this->mark(*index);
+    }
+    if (level.orders.size() == level.head || level.orders.back().timestamp < timestamp) {
+        level.orders.push_back({timestamp, std::move(order)});
+    } else if (level.head > 0 && level.orders[level.head].timestamp > timestamp) {
+        // Orders that were popped and are being added back go in front
+        level.orders[--level.head] = {timestamp, std::move(order)};
+    } else {
+        auto pos = std::upper_bound(level.orders.begin() + level.head, level.orders.end(), timestamp,
+            [](intmax_t t, const Entry& e) { return t < e.timestamp; });
+        level.orders.insert(pos, {timestamp, std::move(order)});
+    }
+}
+
+std::optional<std::shared_ptr<RestingOrder>> LadderSideBook::top_locked() {
+    std::optional<bool> is_overflow = this->top_is_overflow();
+    if (!is_overflow.has_value()) {
+        return std::nullopt;
+    }
+    if (*is_overflow) {
+        return this->overflow_top();
+    }
+    Level& level = this->levels[*this->best_level()];
+    return level.orders[level.head].order;
+}
+
+std::optional<std::shared_ptr<RestingOrder>> LadderSideBook::pop_locked() {
+    std::optional<bool> is_overflow = this->top_is_overflow();
+    if (!is_overflow.has_value()) {
+        return std::nullopt;
+    }
+    if (*is_overflow) {
+        std::shared_ptr<RestingOrder> order = this->overflow_top();
+        this->overflow_pop();
+        return order;
+    }
+    size_t index = *this->best_level();
+    Level& level = this->levels[index];
+    std::shared_ptr<RestingOrder> order = std::move(level.orders[level.head++].order);
+    if (level.head == level.orders.size()) {
+        level.orders.clear();
+        level.head = 0;
+        this->unmark(index);
+    } else if (level.head >= 64 && level.head * 2 >= level.orders.size()) {
+        // Reclaim popped entries of a level that never drains
+        level.orders.erase(level.orders.begin(), level.orders.begin() + level.head);
+        level.head = 0;
+    }
+    return order;
+}
+
+std::optional<std::shared_ptr<RestingOrder>> LadderSideBook::top() {
+    std::lock_guard<std::mutex> lock(this->mut);
+    return this->top_locked();
+}
+
+std::optional<std::shared_ptr<RestingOrder>> LadderSideBook::pop() {
+    std::lock_guard<std::mutex> lock(this->mut);
+    return this->pop_locked();
+}
+
+void LadderSideBook::pop_if_deleted(intmax_t curr_timestamp) {
+    std::lock_guard<std::mutex> lock(this->mut);
+    std::optional<std::shared_ptr<RestingOrder>> order = this->top_locked();
+    if (order.has_value()) {
+        intmax_t deleted_timestamp = order.value()->get_deleted_timestamp();
+        if (deleted_timestamp >= 0 && deleted_timestamp <= curr_timestamp) {
+            this->pop_locked();
+        }
+    }
+}
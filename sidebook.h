@@ -0,0 +1,156 @@
+#ifndef SIDEBOOK_H
+#define SIDEBOOK_H
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+#include "order.h"
+
+struct BuyOrderComparator {
+    bool operator()(const std::shared_ptr<RestingOrder>& a, const std::shared_ptr<RestingOrder>& b) const {
+        uint32_t a_price = a->get_price();
+        uint32_t b_price = b->get_price();
+        if (a_price != b_price)
+            return a_price < b_price; // Priority highest price
+        else
+            return a->get_timestamp() > b->get_timestamp();
+    }
+};
+
+struct SellOrderComparator {
+    bool operator()(const std::shared_ptr<RestingOrder>& a, const std::shared_ptr<RestingOrder>& b) const {
+        uint32_t a_price = a->get_price();
+        uint32_t b_price = b->get_price();
+        if (a_price != b_price)
+            return a_price > b_price;
+        else
+            return a->get_timestamp() > b->get_timestamp();
+    }
+};
+
+// One side of an orderbook, ordered by price-time priority.
+// Implementations are thread safe.
+class SideBook {
+private:
+    std::mutex live_mutex;
+    std::unordered_map<uint32_t, std::shared_ptr<RestingOrder>> live;
+public:
+    virtual ~SideBook() = default;
+
+    virtual void push(std::shared_ptr<RestingOrder> order) = 0;
+    // Get the top order
+    virtual std::optional<std::shared_ptr<RestingOrder>> top() = 0;
+    // Pop the top order and return value
+    virtual std::optional<std::shared_ptr<RestingOrder>> pop() = 0;
+    // Pop top order if deleted before the provided timestamp
+    virtual void pop_if_deleted(intmax_t curr_timestamp) = 0;
+
+    // Resting orders by id for cancels, from track_order until forget_order.
+    // find_order returns nullptr for an order that is not resting on this side at price.
+    // timestamp is the order's, as given to the order index.
+    virtual void track_order(std::shared_ptr<RestingOrder> order);
+    virtual std::shared_ptr<RestingOrder> find_order(uint32_t order_id, uint32_t price, intmax_t timestamp);
+    virtual void forget_order(uint32_t order_id);
+    // Called whenever no command is using the book
+    virtual void settle() {}
+};
+
+// General side book, a binary heap guarded by one mutex
+template<typename Comparator>
+class HeapSideBook : public SideBook {
+private:
+    std::priority_queue<std::shared_ptr<RestingOrder>, std::vector<std::shared_ptr<RestingOrder>>, Comparator> orders;
+    // mutex for protecting PQ operations
+    std::mutex mut;
+public:
+    void push(std::shared_ptr<RestingOrder> order) override {
+        std::lock_guard<std::mutex> lock(this->mut);
+        this->orders.push(std::move(order));
+    }
+
+    std::optional<std::shared_ptr<RestingOrder>> top() override {
+        std::lock_guard<std::mutex> lock(this->mut);
+        if (this->orders.empty()) {
+            return std::nullopt;
+        }
+        return this->orders.top();
+    }
+
+    std::optional<std::shared_ptr<RestingOrder>> pop() override {
+        std::lock_guard<std::mutex> lock(this->mut);
+        if (this->orders.empty()) {
+            return std::nullopt;
+        }
+        std::shared_ptr<RestingOrder> order = this->orders.top();
+        this->orders.pop();
+        return order;
+    }
+
+    void pop_if_deleted(intmax_t curr_timestamp) override {
+        std::lock_guard<std::mutex> lock(this->mut);
+        if (!this->orders.empty()) {
+            intmax_t deleted_timestamp = this->orders.top()->get_deleted_timestamp();
+            if (deleted_timestamp >= 0 && deleted_timestamp <= curr_timestamp) {
+                this->orders.pop();
+            }
+        }
+    }
+};
+
+// Price band of an instrument that trades on a known tick grid
+struct LadderConfig {
+    uint32_t base;   // lowest price on the ladder
+    uint32_t tick;   // price increment between levels
+    uint32_t levels; // number of levels
+};
+
+// Side book for tick-bounded instruments.
+// Price levels live in a flat array indexed by (price - base) / tick, with a
+// two level bitmap of non-empty levels so the best level is found with a few
+// count-zero instructions instead of heap comparisons. Each level is a FIFO
+// ordered by timestamp. Prices off the ladder fall back to a heap.
+class LadderSideBook : public SideBook {
+private:
+    struct Entry {
+        intmax_t timestamp;
+        std::shared_ptr<RestingOrder> order;
+    };
+    struct Level {
+        std::vector<Entry> orders; // entries before head have been popped
+        size_t head = 0;
+    };
+
+    const bool is_buy;
+    const LadderConfig config;
+    std::vector<Level> levels;
+    std::vector<uint64_t> occupied; // one bit per level
+    std::vector<uint64_t> summary;  // one bit per non-zero word of occupied
+    std::priority_queue<std::shared_ptr<RestingOrder>, std::vector<std::shared_ptr<RestingOrder>>, BuyOrderComparator> overflowBuys;
+    std::priority_queue<std::shared_ptr<RestingOrder>, std::vector<std::shared_ptr<RestingOrder>>, SellOrderComparator> overflowSells;
+    std::mutex mut;
+
+    std::optional<size_t> level_index(uint32_t price) const;
+    void mark(size_t index);
+    void unmark(size_t index);
+    std::optional<size_t> best_level() const;
+    bool overflow_empty() const;
+    const std::shared_ptr<RestingOrder>& overflow_top() const;
+    void overflow_pop();
+    // Returns true if the top order lives in the overflow heap, must hold mut
+    std::optional<bool> top_is_overflow();
+    std::optional<std::shared_ptr<RestingOrder>> top_locked();
+    std::optional<std::shared_ptr<RestingOrder>> pop_locked();
+public:
+    LadderSideBook(bool is_buy, LadderConfig config);
+
+    void push(std::shared_ptr<RestingOrder> order) override;
+    std::optional<std::shared_ptr<RestingOrder>> top() override;
+    std::optional<std::shared_ptr<RestingOrder>> pop() override;
+    void pop_if_deleted(intmax_t curr_timestamp) override;
+};
+
+#endif
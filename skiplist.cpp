@@ -0,0 +1,322 @@
+#include <functional>
+#include <thread>
+#include "skiplist.h"
+
+thread_local EpochDomain::ThreadRecord EpochDomain::thread_record;
+
+// Never destroyed, detached connection threads can still be retiring nodes at exit
+EpochDomain& EpochDomain::instance() {
+    static EpochDomain* domain = new EpochDomain();
+    return *domain;
+}
+
+EpochDomain::ThreadRecord::~ThreadRecord() {
+    if (this->record == nullptr) {
+        return;
+    }
+    EpochDomain& domain = EpochDomain::instance();
+    {
+        std::lock_guard<std::mutex> lock(domain.orphans_mutex);
+        domain.orphans.insert(domain.orphans.end(), this->record->retired.begin(), this->record->retired.end());
+    }
+    this->record->retired.clear();
+    this->record->epoch.store(0, std::memory_order_release);
+    this->record->in_use.store(false, std::memory_order_release);
+}
+
+// Records are never freed, a thread that exits leaves its record for the next one
+EpochDomain::Record* EpochDomain::local_record() {
+    if (thread_record.record != nullptr) {
+        return thread_record.record;
+    }
+    for (Record* r = this->records.load(std::memory_order_acquire); r != nullptr; r = r->next) {
+        bool expected = false;
+        if (!r->in_use.load(std::memory_order_relaxed) && r->in_use.compare_exchange_strong(expected, true)) {
+            thread_record.record = r;
+            return r;
+        }
+    }
+    Record* r = new Record();
+    r->in_use.store(true, std::memory_order_relaxed);
+    r->next = this->records.load(std::memory_order_relaxed);
+    while (!this->records.compare_exchange_weak(r->next, r, std::memory_order_release, std::memory_order_relaxed)) {
+    }
+    thread_record.record = r;
+    return r;
+}
+
+EpochDomain::Guard::Guard() : record(EpochDomain::instance().local_record()) {
+    this->outer = this->record->epoch.load(std::memory_order_relaxed) == 0;
+    if (!this->outer) {
+        return;
+    }
+    // Announce an epoch that was still current after the announcement was visible
+    std::atomic<uint64_t>& global = EpochDomain::instance().global_epoch;
+    uint64_t epoch;
+    do {
+        epoch = global.load(std::memory_order_acquire);
+        this->record->epoch.store(epoch, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    } while (global.load(std::memory_order_acquire) != epoch);
+}
+
+EpochDomain::Guard::~Guard() {
+    if (this->outer) {
+        this->record->epoch.store(0, std::memory_order_release);
+    }
+}
+
+bool EpochDomain::try_advance() {
+    uint64_t epoch = this->global_epoch.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    for (Record* r = this->records.load(std::memory_order_acquire); r != nullptr; r = r->next) {
+        uint64_t announced = r->epoch.load(std::memory_order_acquire);
+        if (announced != 0 && announced != epoch) {
+            return false;
+        }
+    }
+    return this->global_epoch.compare_exchange_strong(epoch, epoch + 1);
+}
+
+void EpochDomain::free_retired(std::vector<Retired>& retired, uint64_t epoch) {
+    size_t kept = 0;
+    for (Retired& r : retired) {
+        if (r.epoch + 2 <= epoch) {
+            r.deleter(r.object);
+        } else {
+            retired[kept++] = r;
+        }
+    }
+    retired.resize(kept);
+}
+
+void EpochDomain::retire(void* object, void (*deleter)(void*)) {
+    Record* record = this->local_record();
+    record->retired.push_back({this->global_epoch.load(std::memory_order_acquire), object, deleter});
+    if (record->retired.size() < 64) {
+        return;
+    }
+    this->try_advance();
+    uint64_t epoch = this->global_epoch.load(std::memory_order_acquire);
+    this->free_retired(record->retired, epoch);
+    std::unique_lock<std::mutex> lock(this->orphans_mutex, std::try_to_lock);
+    if (lock.owns_lock() && !this->orphans.empty()) {
+        this->free_retired(this->orphans, epoch);
+    }
+}
+
+SkipListSideBook::Node::Node(uint32_t price, intmax_t timestamp, uint64_t sequence, std::shared_ptr<RestingOrder> order, int top_level)
+        : price(price), timestamp(timestamp), sequence(sequence), order(std::move(order)), top_level(top_level) {
+    for (std::atomic<Node*>& n : this->next) {
+        n.store(nullptr, std::memory_order_relaxed);
+    }
+}
+
+void SkipListSideBook::Node::acquire() {
+    while (this->lock.test_and_set(std::memory_order_acquire)) {
+        std::this_thread::yield();
+    }
+}
+
+void SkipListSideBook::Node::release() {
+    this->lock.clear(std::memory_order_release);
+}
+
+SkipListSideBook::SkipListSideBook(bool is_buy) : is_buy(is_buy), head(0, 0, 0, nullptr, max_level) {}
+
+SkipListSideBook::~SkipListSideBook() {
+    Node* curr = this->head.next[0].load(std::memory_order_relaxed);
+    while (curr != nullptr) {
+        Node* next = curr->next[0].load(std::memory_order_relaxed);
+        delete curr;
+        curr = next;
+    }
+}
+
+bool SkipListSideBook::before(const Node* a, const Node* b) const {
+    if (a == nullptr) {
+        return false;
+    }
+    if (b == nullptr) {
+        return true;
+    }
+    if (a->price != b->price) {
+        return this->is_buy ? a->price > b->price : a->price < b->price;
+    }
+    if (a->timestamp != b->timestamp) {
+        return a->timestamp < b->timestamp;
+    }
+    return a->sequence < b->sequence;
+}
+
+int SkipListSideBook::find(const Node* node, Node** preds, Node** succs) {
+    int found = -1;
+    Node* pred = &this->head;
+    for (int level = max_level - 1; level >= 0; level--) {
+        Node* curr = pred->next[level].load(std::memory_order_acquire);
+        while (this->before(curr, node)) {
+            pred = curr;
+            curr = pred->next[level].load(std::memory_order_acquire);
+        }
+        if (found == -1 && curr == node) {
+            found = level;
+        }
+        preds[level] = pred;
+        succs[level] = curr;
+    }
+    return found;
+}
+
+int SkipListSideBook::random_level() {
+    thread_local uint64_t state = std::hash<std::thread::id>{}(std::this_thread::get_id()) | 1;
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    // One level in four carries on up
+    int level = 1;
+    for (uint64_t bits = state; level < max_level && (bits & 3) == 0; bits >>= 2) {
+        level++;
+    }
+    return level;
+}
+
+void SkipListSideBook::push(std::shared_ptr<RestingOrder> order) {
+    uint32_t price = order->get_price();
+    intmax_t timestamp = order->get_timestamp();
+    Node* node = new Node(price, timestamp, this->next_sequence.fetch_add(1, std::memory_order_relaxed), std::move(order), random_level());
+    EpochDomain::Guard guard;
+    Node* preds[max_level];
+    Node* succs[max_level];
+    while (true) {
+        this->find(node, preds, succs);
+        // Lock the predecessors bottom up, which is back to front, the same order removal uses
+        Node* locked[max_level];
+        int locked_count = 0;
+        bool valid = true;
+        for (int level = 0; valid && level < node->top_level; level++) {
+            Node* pred = preds[level];
+            Node* succ = succs[level];
+            if (locked_count == 0 || locked[locked_count - 1] != pred) {
+                pred->acquire();
+                locked[locked_count++] = pred;
+            }
+            valid = !pred->marked.load(std::memory_order_acquire) && (succ == nullptr || !succ->marked.load(std::memory_order_acquire))
+                && pred->next[level].load(std::memory_order_acquire) == succ;
+        }
+        if (valid) {
+            for (int level = 0; level < node->top_level; level++) {
+                node->next[level].store(succs[level], std::memory_order_relaxed);
+            }
+            for (int level = 0; level < node->top_level; level++) {
+                preds[level]->next[level].store(node, std::memory_order_release);
+            }
+            node->fully_linked.store(true, std::memory_order_release);
+        }
+        while (locked_count > 0) {
+            locked[--locked_count]->release();
+        }
+        if (valid) {
+            return;
+        }
+    }
+}
+
+// Must be inside an epoch guard
+SkipListSideBook::Node* SkipListSideBook::first() {
+    Node* curr = this->head.next[0].load(std::memory_order_acquire);
+    while (curr != nullptr && curr->marked.load(std::memory_order_acquire)) {
+        curr = curr->next[0].load(std::memory_order_acquire);
+    }
+    return curr;
+}
+
+// Must be inside an epoch guard
+bool SkipListSideBook::remove(Node* victim) {
+    Node* preds[max_level];
+    Node* succs[max_level];
+    bool is_marked = false;
+    while (true) {
+        int found = this->find(victim, preds, succs);
+        if (!is_marked) {
+            if (found == -1 || !victim->fully_linked.load(std::memory_order_acquire) || found != victim->top_level - 1) {
+                return false;
+            }
+            victim->acquire();
+            if (victim->marked.load(std::memory_order_relaxed)) {
+                victim->release();
+                return false;
+            }
+            // Logically removed from here on
+            victim->marked.store(true, std::memory_order_release);
+            is_marked = true;
+        }
+
+        Node* locked[max_level];
+        int locked_count = 0;
+        bool valid = true;
+        for (int level = 0; valid && level < victim->top_level; level++) {
+            Node* pred = preds[level];
+            if (locked_count == 0 || locked[locked_count - 1] != pred) {
+                pred->acquire();
+                locked[locked_count++] = pred;
+            }
+            valid = !pred->marked.load(std::memory_order_acquire) && pred->next[level].load(std::memory_order_acquire) == victim;
+        }
+        if (valid) {
+            for (int level = victim->top_level - 1; level >= 0; level--) {
+                preds[level]->next[level].store(victim->next[level].load(std::memory_order_relaxed), std::memory_order_release);
+            }
+        }
+        while (locked_count > 0) {
+            locked[--locked_count]->release();
+        }
+        if (valid) {
+            victim->release();
+            EpochDomain::instance().retire(victim, [](void* p) { delete static_cast<Node*>(p); });
+            return true;
+        }
+    }
+}
+
+std::optional<std::shared_ptr<RestingOrder>> SkipListSideBook::top() {
+    EpochDomain::Guard guard;
+    while (true) {
+        Node* node = this->first();
+        if (node == nullptr) {
+            return std::nullopt;
+        }
+        if (node->fully_linked.load(std::memory_order_acquire)) {
+            return node->order;
+        }
+        std::this_thread::yield(); // an insert at the head is still linking
+    }
+}
+
+std::optional<std::shared_ptr<RestingOrder>> SkipListSideBook::pop() {
+    EpochDomain::Guard guard;
+    while (true) {
+        Node* node = this->first();
+        if (node == nullptr) {
+            return std::nullopt;
+        }
+        if (!node->fully_linked.load(std::memory_order_acquire)) {
+            std::this_thread::yield();
+            continue;
+        }
+        std::shared_ptr<RestingOrder> order = node->order;
+        if (this->remove(node)) {
+            return order;
+        }
+    }
+}
+
+void SkipListSideBook::pop_if_deleted(intmax_t curr_timestamp) {
+    EpochDomain::Guard guard;
+    Node* node = this->first();
+    if (node != nullptr && node->fully_linked.load(std::memory_order_acquire)) {
+        intmax_t deleted_timestamp = node->order->get_deleted_timestamp();
+        if (deleted_timestamp >= 0 && deleted_timestamp <= curr_timestamp) {
+            this->remove(node);
+        }
+    }
+}
@@ -0,0 +1,113 @@
+#ifndef SKIPLIST_H
+#define SKIPLIST_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+#include "sidebook.h"
+
+// Epoch based reclamation for nodes that lock-free readers may still be looking at.
+// Threads announce the global epoch while they are inside an operation. A node
+// retired in epoch e is freed once the global epoch reaches e + 2, because the
+// epoch only advances when every active thread has announced the current one.
+class EpochDomain {
+private:
+    struct Retired {
+        uint64_t epoch;
+        void* object;
+        void (*deleter)(void*);
+    };
+    struct alignas(64) Record {
+        std::atomic<uint64_t> epoch{0}; // 0 while the thread is outside any operation
+        std::atomic<bool> in_use{false};
+        Record* next = nullptr;
+        std::vector<Retired> retired; // only touched by the owning thread
+    };
+    // Gives a thread's record back, with anything it still has retired, when the thread exits
+    struct ThreadRecord {
+        Record* record = nullptr;
+        ~ThreadRecord();
+    };
+
+    std::atomic<Record*> records{nullptr};
+    std::atomic<uint64_t> global_epoch{1};
+    std::mutex orphans_mutex;
+    std::vector<Retired> orphans;
+
+    static thread_local ThreadRecord thread_record;
+    Record* local_record();
+    bool try_advance();
+    void free_retired(std::vector<Retired>& retired, uint64_t epoch);
+    EpochDomain() = default;
+public:
+    static EpochDomain& instance();
+
+    // Holds off reclamation for as long as it lives
+    class Guard {
+    private:
+        Record* record;
+        bool outer;
+    public:
+        Guard();
+        ~Guard();
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+    };
+
+    // Frees object with deleter once no thread can still reach it, must be called inside a Guard
+    void retire(void* object, void (*deleter)(void*));
+};
+
+// Side book on a lazy skiplist (Herlihy, Lev, Luchangco and Shavit) keyed by
+// price-time priority. Searches take no locks. An insert or removal only locks
+// the nodes it links between, so inserts at different prices run in parallel
+// and popping the head does not block inserts further down the book. Removal
+// marks the node first, which takes it out of the book logically, then unlinks
+// it and hands it to the epoch domain to be freed.
+class SkipListSideBook : public SideBook {
+private:
+    static constexpr int max_level = 16;
+
+    struct Node {
+        uint32_t price;
+        intmax_t timestamp;
+        uint64_t sequence; // breaks ties so keys are unique
+        std::shared_ptr<RestingOrder> order;
+        int top_level;
+        std::atomic_flag lock = ATOMIC_FLAG_INIT;
+        std::atomic<bool> marked{false};
+        std::atomic<bool> fully_linked{false};
+        std::atomic<Node*> next[max_level];
+
+        Node(uint32_t price, intmax_t timestamp, uint64_t sequence, std::shared_ptr<RestingOrder> order, int top_level);
+        void acquire();
+        void release();
+    };
+
+    const bool is_buy;
+    Node head;
+    std::atomic<uint64_t> next_sequence{0};
+
+    // True if a comes before b, a null node is the end of the list
+    bool before(const Node* a, const Node* b) const;
+    // Fills preds and succs at every level, returns the highest level node was found at or -1
+    int find(const Node* node, Node** preds, Node** succs);
+    // First node that is linked and not removed
+    Node* first();
+    // Removes node if no one else has, returns false if it was already removed
+    bool remove(Node* node);
+    static int random_level();
+public:
+    explicit SkipListSideBook(bool is_buy);
+    ~SkipListSideBook() override;
+
+    void push(std::shared_ptr<RestingOrder> order) override;
+    std::optional<std::shared_ptr<RestingOrder>> top() override;
+    std::optional<std::shared_ptr<RestingOrder>> pop() override;
+    void pop_if_deleted(intmax_t curr_timestamp) override;
+};
+
+#endif
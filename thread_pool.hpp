@@ -0,0 +1,97 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of workers for splitting one job into independent tasks. The
+// calling thread takes tasks too, so a pool of one thread runs them inline.
+class ThreadPool {
+private:
+    std::mutex mutex;
+    std::condition_variable work;
+    std::condition_variable done;
+    std::vector<std::thread> workers;
+    bool stopping = false;
+    // The current job, changed only once every worker has finished the last one
+    const std::function<void(size_t)>* job = nullptr;
+    size_t tasks = 0;
+    uint64_t generation = 0;
+    unsigned busy = 0;
+    std::atomic<size_t> next{0};
+    // Serialises callers, there is one job at a time
+    std::mutex call_mutex;
+
+    void run_tasks(const std::function<void(size_t)>& task, size_t count) {
+        for (size_t i = this->next.fetch_add(1); i < count; i = this->next.fetch_add(1)) {
+            task(i);
+        }
+    }
+
+    void worker() {
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> lock(this->mutex);
+        while (true) {
+            this->work.wait(lock, [&] { return this->stopping || this->generation != seen; });
+            if (this->stopping) {
+                return;
+            }
+            seen = this->generation;
+            const std::function<void(size_t)>& task = *this->job;
+            size_t count = this->tasks;
+            lock.unlock();
+            this->run_tasks(task, count);
+            lock.lock();
+            if (--this->busy == 0) {
+                this->done.notify_one();
+            }
+        }
+    }
+
+public:
+    // threads counts the caller, so threads - 1 workers are started
+    explicit ThreadPool(unsigned threads) {
+        for (unsigned i = 1; i < threads; i++) {
+            this->workers.emplace_back(&ThreadPool::worker, this);
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->stopping = true;
+        }
+        this->work.notify_all();
+        for (std::thread& worker : this->workers) {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    unsigned size() const { return this->workers.size() + 1; }
+
+    // Runs task(0) ... task(count - 1) across the pool and returns once they have all finished
+    void parallel_for(size_t count, const std::function<void(size_t)>& task) {
+        std::lock_guard<std::mutex> call_lock(this->call_mutex);
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->job = &task;
+            this->tasks = count;
+            this->next.store(0);
+            this->busy = this->workers.size();
+            this->generation++;
+        }
+        this->work.notify_all();
+        this->run_tasks(task, count);
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->done.wait(lock, [this] { return this->busy == 0; });
+    }
+};
+
+#endif
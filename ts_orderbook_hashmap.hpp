@@ -25,7 +25,9 @@ public:
         vec[index].emplace_back(std::make_pair(key,ptr));
     }
 
-    void insert_if_not_exist(const K &key) {
+    // Constructs the value from the key and any extra arguments
+    template<typename... Args>
+    void insert_if_not_exist(const K &key, Args&&... args) {
         int index = hash(key);
         std::unique_lock<std::shared_mutex> lock(mutexes[index]);
         for (auto it = vec[index].begin(); it != vec[index].end(); it++) {
@@ -33,7 +35,7 @@ public:
                 return;
             }
         }
-        vec[index].emplace_back(std::make_pair(key,std::make_shared<V>(key)));
+        vec[index].emplace_back(std::make_pair(key,std::make_shared<V>(key, std::forward<Args>(args)...)));
     }
 
     std::shared_ptr<V> get(const K &key) {
@@ -58,9 +60,20 @@ public:
         return false;
     }
 
+    // Calls fn(key, value) for every entry, locking one bucket at a time
+    template<typename F>
+    void for_each(F&& fn) {
+        for (int index = 0; index < bucket_count; index++) {
+            std::shared_lock<std::shared_mutex> lock(mutexes[index]);
+            for (auto it = vec[index].begin(); it != vec[index].end(); it++) {
+                fn(it->first, *it->second);
+            }
+        }
+    }
+
     void erase(const K &key) {
         int index = hash(key);
-        std::shared_lock<std::shared_mutex> lock(mutexes[index]);
+        std::unique_lock<std::shared_mutex> lock(mutexes[index]);
         for (auto it = vec[index].begin(); it != vec[index].end(); it++) {
             if (it->first == key) {
                 vec[index].erase(it);